@@ -44,19 +44,63 @@
 #define SrtpEncryptionTWOCM   3
 #define SrtpEncryptionTWOF8   4
 
+/*
+ * Limits of the replay window size in packets, the default is 64 as
+ * specified in RFC 3711.
+ */
+#define ZSRTP_REPLAY_WINDOW_MIN 64
+#define ZSRTP_REPLAY_WINDOW_MAX 4096
+
+/*
+ * Threads that may use one context at the same time, see
+ * zsrtp_setConcurrency().
+ */
+#define ZSRTP_CONCURRENCY_DEFAULT 4
+#define ZSRTP_CONCURRENCY_MAX     128
+
+/*
+ * AEAD transform that the wrapper implements itself (RFC 7714 packet
+ * format), not part of CryptoContext.h. Use it with SrtpAuthenticationNull,
+ * the AEAD tag is always 16 bytes. The session keys come from the RFC 3711
+ * key derivation with a 14 byte master salt truncated to 12 bytes, this is
+ * not the RFC 7714 keying and interoperates only with this implementation.
+ */
+#define SrtpEncryptionAESGCM  16
 
 #ifdef __cplusplus
 extern "C"
 {
     typedef class CryptoContext CryptoContext;
+    typedef class SrtpAeadGcm SrtpAeadGcm;
+    typedef class SrtpMac SrtpMac;
+    typedef class SrtpAesCm SrtpAesCm;
+    typedef class SrtpTwofishCm SrtpTwofishCm;
+    typedef class SrtpIndexState SrtpIndexState;
+    typedef class SrtpReplayWindow SrtpReplayWindow;
+    typedef class SrtpStreamTable SrtpStreamTable;
+    typedef class SrtpCtrlStreamTable SrtpCtrlStreamTable;
 #else
     typedef struct CryptoContext CryptoContext;
+    typedef struct SrtpAeadGcm SrtpAeadGcm;
+    typedef struct SrtpMac SrtpMac;
+    typedef struct SrtpAesCm SrtpAesCm;
+    typedef struct SrtpTwofishCm SrtpTwofishCm;
+    typedef struct SrtpIndexState SrtpIndexState;
+    typedef struct SrtpReplayWindow SrtpReplayWindow;
+    typedef struct SrtpStreamTable SrtpStreamTable;
+    typedef struct SrtpCtrlStreamTable SrtpCtrlStreamTable;
 #endif
 
     typedef struct zsrtpContext
     {
         CryptoContext* srtp;
         void* userData;
+        SrtpAeadGcm* aead;          /* AEAD transform, used instead of srtp */
+        SrtpIndexState* index;      /* ROC and replay state, used instead of srtp */
+        SrtpMac* mac;               /* pre-keyed HMAC-SHA1 or Skein, replaces the MAC of srtp */
+        SrtpAesCm* cipher;          /* keyed AES-CM, replaces the cipher of srtp */
+        SrtpTwofishCm* twofish;     /* Twofish-CM, replaces the cipher of srtp */
+        SrtpStreamTable* streams;   /* per SSRC state of a receiver, replaces index */
     } ZsrtpContext;
 
     /**
@@ -80,9 +124,10 @@ extern "C"
      *
      * @param ealg
      *    The encryption algorithm to use. Possible values are <code>
-     *    SrtpEncryptionNull, SrtpEncryptionAESCM, SrtpEncryptionAESF8
-     *    </code>. See chapter 4.1.1 for AESCM (Counter mode) and 4.1.2
-     *    for AES F8 mode.
+     *    SrtpEncryptionNull, SrtpEncryptionAESCM, SrtpEncryptionAESF8,
+     *    SrtpEncryptionAESGCM</code>. See chapter 4.1.1 for AESCM (Counter
+     *    mode) and 4.1.2 for AES F8 mode. AES-GCM is specified in RFC 7714,
+     *    it ignores the authentication parameters.
      *
      * @param aalg
      *    The authentication algorithm to use. Possible values are <code>
@@ -167,6 +212,10 @@ extern "C"
      * buffer and computes a new length. The RTP packet buffer must be large
      * enough to hold this authentication code.
      *
+     * Several threads may protect packets of the same context at the same
+     * time, the function derives the ROC of each packet from its sequence
+     * number and the highest index sent so far.
+     *
      * @param ctx
      *     The ZsrtpContext
      *
@@ -186,6 +235,100 @@ extern "C"
     int32_t zsrtp_protect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
                           int32_t* newLength);
 
+    /**
+     * Return the number of bytes <code>zsrtp_protect</code> appends to a
+     * packet.
+     *
+     * A caller that protects packets in its own buffers must reserve this
+     * room after the RTP packet data.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     * @return
+     *     Length of MKI and authentication tag in bytes.
+     */
+    int32_t zsrtp_getTrailerLength(ZsrtpContext* ctx);
+
+    /**
+     * Encrypt and authenticate a burst of RTP packets.
+     *
+     * Works like <code>zsrtp_protect</code> but processes a whole vector
+     * of RTP packets that belong to the same SRTP crypto context, for
+     * example all packets of one video frame. The function fetches the
+     * crypto context data (tag length, ROC) only once and keeps it across
+     * the burst.
+     *
+     * The packets must be in sending order because the function tracks
+     * the Roll-Over-Counter while it walks through the vector. Each packet
+     * buffer must be large enough to hold the authentication code.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     *
+     * @param pkts
+     *     Array of pointers to the RTP packet data. SRTP encrypts each packet
+     *     in place and appends the authentication code.
+     *
+     * @param lens
+     *     Array of the RTP packet lengths.
+     *
+     * @param n
+     *     Number of packets in the arrays.
+     *
+     * @param newLens
+     *     Array that receives the new length of each packet including the
+     *     authentication code. If a packet is not a valid RTP packet the
+     *     function leaves it untouched and sets its new length to 0.
+     *
+     * @returns
+     *     0 if no active SRTP crypto context, otherwise the number of
+     *     encrypted packets.
+     */
+    int32_t zsrtp_protect_batch(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                                const int32_t lens[], int32_t n,
+                                int32_t newLens[]);
+
+    /**
+     * Encrypt and authenticate RTP packets of several SRTP crypto contexts.
+     *
+     * Works like <code>zsrtp_protect</code> for each packet, packet
+     * <code>i</code> uses crypto context <code>ctxs[i]</code>. This suits
+     * a conference bridge that sends one packet on each of many streams per
+     * mixer tick. A single short packet cannot fill the AES pipeline of the
+     * CPU, thus the function encrypts the AES-CM packets of all contexts
+     * together: eight lanes compute counter blocks of eight packets with
+     * their own keys in an interleaved way. Packets longer than 512 bytes,
+     * packets of other ciphers, and all packets if the CPU has no AES
+     * instructions are encrypted one by one. The function then computes the authentication codes packet by
+     * packet.
+     *
+     * A crypto context may appear several times, its packets must be in
+     * sending order.
+     *
+     * @param ctxs
+     *     Array of the ZsrtpContexts, one per packet.
+     *
+     * @param pkts
+     *     Array of pointers to the RTP packet data. SRTP encrypts each packet
+     *     in place and appends the authentication code.
+     *
+     * @param lens
+     *     Array of the RTP packet lengths.
+     *
+     * @param n
+     *     Number of packets in the arrays.
+     *
+     * @param newLens
+     *     Array that receives the new length of each packet including the
+     *     authentication code, or 0 if the packet was not protected.
+     *
+     * @returns
+     *     The number of encrypted packets.
+     */
+    int32_t zsrtp_protect_multi(ZsrtpContext* ctxs[], pj_uint8_t* pkts[],
+                                const int32_t lens[], int32_t n,
+                                int32_t newLens[]);
+
     /**
      * Decrypt the RTP payload and check authentication code.
      *
@@ -216,6 +359,144 @@ extern "C"
     int32_t zsrtp_unprotect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
                             int32_t* newLength);
 
+    /**
+     * Check and decrypt a burst of received SRTP packets.
+     *
+     * Works like <code>zsrtp_unprotect</code> but processes a vector of
+     * SRTP packets that belong to the same SRTP crypto context. The function
+     * first performs the replay check and estimates the packet index for all
+     * packets, then it authenticates and decrypts the packets in one loop.
+     * Packets that repeat a sequence number of an earlier packet of the same
+     * burst fail the replay check.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     *
+     * @param pkts
+     *     Array of pointers to the SRTP packet data. SRTP decrypts each
+     *     packet in place.
+     *
+     * @param lens
+     *     Array of the SRTP packet lengths.
+     *
+     * @param n
+     *     Number of packets in the arrays.
+     *
+     * @param newLens
+     *     Array that receives the new length of each packet excluding the
+     *     authentication code.
+     *
+     * @param results
+     *     Array that receives the result for each packet: 1 if data is
+     *     decrypted, -1 if data authentication failed or the packet is not
+     *     a valid SRTP packet, -2 if SRTP replay check failed.
+     *
+     * @returns
+     *     0 if no active SRTP crypto context, otherwise the number of
+     *     decrypted packets.
+     */
+    int32_t zsrtp_unprotect_batch(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                                  const int32_t lens[], int32_t n,
+                                  int32_t newLens[], int32_t results[]);
+
+    /**
+     * Per packet data of a burst that several threads check and decrypt.
+     */
+    typedef struct zsrtpUnprotectJob
+    {
+        pj_uint8_t* pkt;        /* the SRTP packet, decrypted in place */
+        int32_t length;         /* packet length without tag and MKI, -1: invalid */
+        int32_t payload;        /* offset of the payload */
+        int32_t payloadlen;
+        uint32_t ssrc;
+        uint16_t seqnum;
+        int64_t index;          /* the estimated packet index */
+        int32_t result;         /* 0: to do, 1: decrypted, -1, -2: see zsrtp_unprotect */
+    } ZsrtpUnprotectJob;
+
+    /**
+     * Prepare a burst of received SRTP packets for parallel decryption.
+     *
+     * A burst is processed in three steps: this function decodes the
+     * packets, performs the replay check and estimates the packet index
+     * from the current ROC state. Then any number of threads call
+     * <code>zsrtp_unprotect_run</code> for the jobs, in any order. Finally
+     * <code>zsrtp_unprotect_commit</code> updates the replay and ROC state
+     * in arrival order. Only the run step may use several threads.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     *
+     * @param pkts
+     *     Array of pointers to the SRTP packet data.
+     *
+     * @param lens
+     *     Array of the SRTP packet lengths.
+     *
+     * @param n
+     *     Number of packets in the arrays.
+     *
+     * @param jobs
+     *     Array of n jobs that receives the per packet data.
+     *
+     * @returns
+     *     The number of jobs to run, or -1 if the crypto algorithms of the
+     *     context cannot run on several threads. Use
+     *     <code>zsrtp_unprotect_batch</code> in this case.
+     */
+    int32_t zsrtp_unprotect_prepare(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                                    const int32_t lens[], int32_t n,
+                                    ZsrtpUnprotectJob jobs[]);
+
+    /**
+     * Authenticate and decrypt the packet of one job.
+     *
+     * Several threads may call this function for different jobs of the
+     * same burst at the same time. The function does not change the state
+     * of the context. Jobs that failed in the prepare step are skipped.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     *
+     * @param job
+     *     The job, receives the result.
+     */
+    void zsrtp_unprotect_run(ZsrtpContext* ctx, ZsrtpUnprotectJob* job);
+
+    /**
+     * Update the replay and ROC state with the results of a burst.
+     *
+     * Processes the jobs in arrival order. A packet that repeats the
+     * sequence number of an earlier packet of the burst fails the replay
+     * check. If the estimate of the index changed because of an earlier
+     * packet of the burst the function checks the packet again. An AEAD
+     * context cannot do this, the run step decrypted the packet in place
+     * before it checked the tag. Such a packet fails with -1, this happens
+     * only if the burst holds reordered packets around a ROC change.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     *
+     * @param jobs
+     *     The jobs of the burst.
+     *
+     * @param n
+     *     Number of jobs.
+     *
+     * @param newLens
+     *     Array that receives the new length of each packet excluding the
+     *     authentication code.
+     *
+     * @param results
+     *     Array that receives the result for each packet, see
+     *     <code>zsrtp_unprotect_batch</code>.
+     *
+     * @returns
+     *     The number of decrypted packets.
+     */
+    int32_t zsrtp_unprotect_commit(ZsrtpContext* ctx, ZsrtpUnprotectJob jobs[], int32_t n,
+                                   int32_t newLens[], int32_t results[]);
+
     /**
      * Derive a new Crypto Context for use with a new SSRC
      *
@@ -228,6 +509,12 @@ extern "C"
      * Before the application can use this crypto context it must call
      * the <code>deriveSrtpKeys</code> method.
      *
+     * The new crypto context replaces the current one of @c ctx. The
+     * packet index state starts over with @c roc and an empty replay
+     * window of the same size. If a stream table is enabled the received
+     * streams keep their state in the table, see
+     * <code>zsrtp_enableStreamTable</code>.
+     *
      * @param ctx
      *     The ZsrtpContext
      * @param ssrc
@@ -255,6 +542,87 @@ extern "C"
      */                                    
     void zsrtp_deriveSrtpKeys(ZsrtpContext* ctx, uint64_t index);
 
+    /**
+     * Set the size of the replay window of a receiving SRTP context.
+     *
+     * Packets that arrive later than this number of packets behind the
+     * newest packet are rejected as replayed. Large windows help video
+     * streams on networks that reorder bursts of packets. The cost per
+     * packet does not depend on the window size.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     * @param size
+     *     Window size in packets, <code>ZSRTP_REPLAY_WINDOW_MIN</code> to
+     *     <code>ZSRTP_REPLAY_WINDOW_MAX</code>.
+     * @return
+     *     1 if the size was set, 0 if the size is out of range.
+     */
+    int32_t zsrtp_setReplayWindow(ZsrtpContext* ctx, int32_t size);
+
+    /**
+     * Enable separate ROC and replay state per SSRC for a receiving SRTP
+     * context.
+     *
+     * Without the table all packets share the state of the context, thus
+     * packets of a second SSRC, for example simulcast, FEC or RTX streams
+     * or a SSRC change, fail the replay check or the authentication. The
+     * streams share the session keys of the context, a new SSRC needs no
+     * key derivation. If more SSRCs than <code>maxStreams</code> show up
+     * the context evicts the stream that was idle the longest. An evicted
+     * stream that comes back keeps its ROC and accepts only packets newer
+     * than the last one it received.
+     *
+     * Call this after <code>zsrtp_setReplayWindow</code>, the streams use
+     * the replay window size of the context.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     * @param maxStreams
+     *     Maximum number of streams, 1 to 64.
+     * @return
+     *     1 if the table was enabled, 0 otherwise.
+     */
+    int32_t zsrtp_enableStreamTable(ZsrtpContext* ctx, int32_t maxStreams);
+
+    /**
+     * Enable the keystream cache of a sending SRTP context.
+     *
+     * RTP sequence numbers are predictable on the sending side, thus the
+     * AES-CM keystream of the next packets can be computed before the
+     * packets exist. With the cache enabled <code>zsrtp_protect</code>
+     * only XORs the payload with the cached keystream and computes the MAC.
+     *
+     * Call this after <code>zsrtp_deriveSrtpKeys</code> and before the first
+     * packet is protected. Only AES-CM contexts support the cache.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     * @param packets
+     *     Number of packets to compute in advance.
+     * @param maxLength
+     *     Keystream length per packet. Packets with longer payloads are
+     *     encrypted as usual.
+     * @return
+     *     1 if the cache was enabled, 0 otherwise.
+     */
+    int32_t zsrtp_enableKeystreamCache(ZsrtpContext* ctx, int32_t packets, int32_t maxLength);
+
+    /**
+     * Compute the keystream for the packets that follow the last protected
+     * packet.
+     *
+     * Applications call this during idle time, for example from a worker
+     * thread after a packet was sent. The function may run concurrently
+     * to <code>zsrtp_protect</code>.
+     *
+     * @param ctx
+     *     The ZsrtpContext
+     * @return
+     *     Number of packets the function computed the keystream for.
+     */
+    int32_t zsrtp_precomputeKeystream(ZsrtpContext* ctx);
+
 #ifdef __cplusplus
     typedef class CryptoContextCtrl CryptoContextCtrl;
 #else
@@ -266,6 +634,12 @@ extern "C"
         CryptoContextCtrl* srtcp;
         void* userData;
         uint32_t srtcpIndex;
+        SrtpAeadGcm* aead;          /* AEAD transform, used instead of srtcp */
+        SrtpReplayWindow* replay;   /* replay state, used instead of srtcp */
+        SrtpMac* mac;               /* pre-keyed HMAC-SHA1 or Skein, replaces the MAC of srtcp */
+        SrtpAesCm* cipher;          /* keyed AES-CM, replaces the cipher of srtcp */
+        SrtpTwofishCm* twofish;     /* Twofish-CM, replaces the cipher of srtcp */
+        SrtpCtrlStreamTable* streams; /* per SSRC state of a receiver, replaces replay */
     } ZsrtpContextCtrl;
 
     /**
@@ -280,9 +654,10 @@ extern "C"
      *
      * @param ealg
      *    The encryption algorithm to use. Possible values are <code>
-     *    SrtpEncryptionNull, SrtpEncryptionAESCM, SrtpEncryptionAESF8
-     *    </code>. See chapter 4.1.1 for AESCM (Counter mode) and 4.1.2
-     *    for AES F8 mode.
+     *    SrtpEncryptionNull, SrtpEncryptionAESCM, SrtpEncryptionAESF8,
+     *    SrtpEncryptionAESGCM</code>. See chapter 4.1.1 for AESCM (Counter
+     *    mode) and 4.1.2 for AES F8 mode. AES-GCM is specified in RFC 7714,
+     *    it ignores the authentication parameters.
      *
      * @param aalg
      *    The authentication algorithm to use. Possible values are <code>
@@ -363,6 +738,9 @@ extern "C"
      * buffer and computes a new length. The RTCP packet buffer must be large
      * enough to hold this authentication code.
      *
+     * Several threads may protect packets of the same context at the same
+     * time, the SRTCP index is incremented atomically.
+     *
      * @param ctx
      *     The ZsrtpContextCtrl
      *
@@ -382,6 +760,17 @@ extern "C"
     int32_t zsrtp_protectCtrl(ZsrtpContextCtrl* ctx, pj_uint8_t* buffer, int32_t length,
                           int32_t* newLength);
 
+    /**
+     * Return the number of bytes <code>zsrtp_protectCtrl</code> appends to
+     * a packet.
+     *
+     * @param ctx
+     *     The ZsrtpContextCtrl
+     * @return
+     *     Length of SRTCP index, MKI and authentication tag in bytes.
+     */
+    int32_t zsrtp_getTrailerLengthCtrl(ZsrtpContextCtrl* ctx);
+
     /**
      * Decrypt the RTCP payload and check authentication code.
      *
@@ -424,6 +813,9 @@ extern "C"
      * Before the application can use this crypto context it must call
      * the <code>deriveSrtpKeys</code> method.
      *
+     * The new crypto context replaces the current one of @c ctx, the
+     * replay window starts empty and keeps its size.
+     *
      * @param ctx
      *     The ZsrtpContextCtrl
      * @param ssrc
@@ -442,8 +834,77 @@ extern "C"
      *     The ZsrtpContextCtrl
      */                                    
     void zsrtp_deriveSrtpKeysCtrl(ZsrtpContextCtrl* ctx);
-    
-    
+
+    /**
+     * Set the size of the replay window of a receiving SRTCP context.
+     *
+     * See <code>zsrtp_setReplayWindow</code>.
+     *
+     * @param ctx
+     *     The ZsrtpContextCtrl
+     * @param size
+     *     Window size in packets.
+     * @return
+     *     1 if the size was set, 0 if the size is out of range.
+     */
+    int32_t zsrtp_setReplayWindowCtrl(ZsrtpContextCtrl* ctx, int32_t size);
+
+    /**
+     * Enable separate replay state per SSRC for a receiving SRTCP context.
+     *
+     * See <code>zsrtp_enableStreamTable</code>.
+     *
+     * @param ctx
+     *     The ZsrtpContextCtrl
+     * @param maxStreams
+     *     Maximum number of streams, 1 to 64.
+     * @return
+     *     1 if the table was enabled, 0 otherwise.
+     */
+    int32_t zsrtp_enableStreamTableCtrl(ZsrtpContextCtrl* ctx, int32_t maxStreams);
+
+    /**
+     * Set the number of threads that may protect or unprotect packets of
+     * one context at the same time.
+     *
+     * The AES transforms keep one keyed OpenSSL context per thread, the
+     * packet path does not allocate one. If more threads than that use a
+     * context at once, a surplus thread creates a context of its own the
+     * first time and keeps it for the life of the SRTP context. The
+     * setting applies to all contexts that derive their keys afterwards.
+     *
+     * @param threads
+     *     Number of threads, 1 to <code>ZSRTP_CONCURRENCY_MAX</code>. The
+     *     default is <code>ZSRTP_CONCURRENCY_DEFAULT</code>.
+     * @return
+     *     1 if the number was set, 0 if it is out of range.
+     */
+    int32_t zsrtp_setConcurrency(int32_t threads);
+
+#ifdef ZSRTP_ALLOC_CHECK
+    /**
+     * Get the number of SRTP/SRTCP packet operations that allocated heap memory.
+     *
+     * Available only if the library was compiled with
+     * <code>ZSRTP_ALLOC_CHECK</code>. In this mode the wrapper hooks the
+     * heap allocation functions and counts the allocations of the calling
+     * thread while it protects or unprotects a packet. Each protect or
+     * unprotect call that performed at least one allocation counts as a
+     * violation. Benchmarks and tests shall fail if this number is not 0.
+     *
+     * @returns
+     *     Number of violations since program start or the last reset.
+     */
+    uint64_t zsrtp_getAllocViolations(void);
+
+    /**
+     * Reset the allocation violation counter.
+     *
+     * Benchmarks may call this after a warm-up phase.
+     */
+    void zsrtp_resetAllocViolations(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
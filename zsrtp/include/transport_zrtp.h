@@ -169,6 +169,62 @@
 #define MAX_RTP_BUFFER_LEN   (PJMEDIA_MAX_MTU-30)
 #define MAX_RTCP_BUFFER_LEN  (PJMEDIA_MAX_MTU-30)
 
+/* Number of RTP packets that pjmedia_transport_zrtp_send_rtp_batch protects in one go */
+#ifndef MAX_RTP_SEND_BATCH
+#define MAX_RTP_SEND_BATCH   16
+#endif
+
+/* Number of SRTP packets that pjmedia_transport_zrtp_rtp_batch_cb checks in one go */
+#ifndef MAX_RTP_RECV_BATCH
+#define MAX_RTP_RECV_BATCH   32
+#endif
+
+/*
+ * Room after the packet data that buffers for pjmedia_transport_zrtp_send_rtp_inplace
+ * and pjmedia_transport_zrtp_send_rtcp_inplace should reserve: SRTCP index and
+ * the longest SRTP authentication tag.
+ */
+#ifndef ZRTP_SEND_TAILROOM
+#define ZRTP_SEND_TAILROOM   32
+#endif
+
+/* Number of SSRCs the SRTP receiver keeps separate ROC and replay state for */
+#ifndef MAX_RTP_RECV_STREAMS
+#define MAX_RTP_RECV_STREAMS 8
+#endif
+
+/* Packets each SRTP worker can queue, a power of 2 */
+#ifndef ZRTP_WORKER_QUEUE
+#define ZRTP_WORKER_QUEUE    256
+#endif
+
+/* Maximum number of SRTP worker threads */
+#ifndef MAX_ZRTP_WORKERS
+#define MAX_ZRTP_WORKERS     64
+#endif
+
+/* Application threads that may send or receive on one transport while the
+   SRTP workers process its packets */
+#ifndef ZRTP_MEDIA_THREADS
+#define ZRTP_MEDIA_THREADS   4
+#endif
+
+/* ZRTP timer threads, 0 starts one per CPU */
+#ifndef ZRTP_TIMER_THREADS
+#define ZRTP_TIMER_THREADS   1
+#endif
+
+/* Maximum number of ZRTP timer threads */
+#ifndef MAX_ZRTP_TIMER_THREADS
+#define MAX_ZRTP_TIMER_THREADS  64
+#endif
+
+/* Milliseconds the SRTP receiver keeps the contexts of the previous key,
+   0: off, see pjmedia_transport_zrtp_setRekeyWindow() */
+#ifndef ZRTP_REKEY_WINDOW
+#define ZRTP_REKEY_WINDOW    0
+#endif
+
 #define PJMEDIA_TRANSPORT_TYPE_ZRTP PJMEDIA_TRANSPORT_TYPE_USER+2
 
 PJ_BEGIN_DECL
@@ -202,6 +258,36 @@ typedef struct pjmedia_zrtp_info
 
 } pjmedia_zrtp_info;
 
+/* Maximum number of algorithms per type in a ZRTP profile */
+#define PJMEDIA_ZRTP_MAX_ALGOS  7
+
+/**
+ * The ZRTP algorithms a transport offers, see
+ * @c pjmedia_transport_zrtp_setCustomProfile.
+ *
+ * Each list holds the ZRTP names of the algorithms in order of preference,
+ * for example "E255" or "DH3k". A NULL entry ends a list, an empty list
+ * keeps the standard algorithms of the type.
+ */
+typedef struct pjmedia_zrtp_profile
+{
+    /** Hash algorithms: S256, S384, SKN2, SKN3 */
+    const char *hash[PJMEDIA_ZRTP_MAX_ALGOS];
+
+    /** Symmetric ciphers: AES1, AES3, 2FS1, 2FS3 */
+    const char *cipher[PJMEDIA_ZRTP_MAX_ALGOS];
+
+    /** Key agreement: DH2k, DH3k, EC25, EC38, E255, E414 */
+    const char *pubKey[PJMEDIA_ZRTP_MAX_ALGOS];
+
+    /** SAS types: "B32 ", B256, B32E */
+    const char *sas[PJMEDIA_ZRTP_MAX_ALGOS];
+
+    /** SRTP authentication tags: HS32, HS80, SK32, SK64 */
+    const char *authLength[PJMEDIA_ZRTP_MAX_ALGOS];
+
+} pjmedia_zrtp_profile;
+
 /**
  * Application callback methods.
  *
@@ -471,6 +557,50 @@ PJ_DECL(pj_status_t) pjmedia_transport_zrtp_create( pjmedia_endpt *endpt,
 PJ_DECL(pj_status_t) pjmedia_transport_zrtp_initialize(pjmedia_transport *tp,
         const char *zidFilename,
         pj_bool_t autoEnable);
+/**
+ * Select the ZRTP algorithms by a named profile.
+ *
+ * The profile applies to all transports that call
+ * @c pjmedia_transport_zrtp_initialize afterwards. The profiles are:
+ * - "default": the standard algorithms of the ZRTP library.
+ * - "low-latency": X25519 and P-256 key agreement before DH3k, SHA-256,
+ *   AES-128.
+ * - "low-cpu": like "low-latency", prefers 32 bit HMAC-SHA1 SRTP tags.
+ * - "max-security": Curve41417, P-384, SHA-384 and Skein-384, 256 bit
+ *   ciphers, 64 bit Skein and 80 bit HMAC-SHA1 tags, 256 bit SAS.
+ *
+ * Each profile keeps the mandatory ZRTP algorithms at the end of its
+ * lists, thus it negotiates with every ZRTP peer.
+ *
+ * @param name
+ *      Name of the profile, NULL selects "default".
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_ENOTFOUND if the profile is not known.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setProfile(const char *name);
+
+/**
+ * Select the ZRTP algorithms by lists.
+ *
+ * Like @c pjmedia_transport_zrtp_setProfile with lists of the
+ * application. The function copies the lists.
+ *
+ * Each name must be one of the names listed in @c pjmedia_zrtp_profile
+ * for its type. A list that is not empty must contain the algorithms
+ * RFC 6189 makes mandatory: S256, AES1, DH3k, "B32 ", and both HS32 and
+ * HS80. If the ZRTP library was built without an algorithm of the
+ * profile, the transport logs this and offers the others.
+ *
+ * @param profile
+ *      The algorithm lists, NULL selects the standard algorithms.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVAL if a name is unknown or a list misses a
+ *      mandatory algorithm.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setCustomProfile(const pjmedia_zrtp_profile *profile);
+
 /**
  * Enable or disable ZRTP processing.
  *
@@ -519,6 +649,374 @@ PJ_DECL(void) pjmedia_transport_zrtp_setEnableZrtp(pjmedia_transport *tp, pj_boo
  */
 PJ_DECL(pj_bool_t) pjmedia_transport_zrtp_isEnableZrtp(pjmedia_transport *tp);
 
+/**
+ * Offer AES-GCM instead of AES-CM plus HMAC for SRTP and SRTCP.
+ *
+ * ZRTP does not negotiate AEAD SRTP transforms, the ZRTP transport
+ * negotiates it in SDP instead. With this setting enabled the transport
+ * adds the media attribute <code>a=zrtp-srtp-aead</code> to an SDP offer,
+ * and to an SDP answer if the offer contained it. Only if the local and
+ * the remote SDP of the call contain the attribute and ZRTP selects AES as
+ * symmetric cipher the transport uses the ZRTP generated SRTP keys with
+ * AES-GCM and a 16 byte tag instead of AES-CM and a HMAC. Otherwise it
+ * uses AES-CM and HMAC as usual. Without SDP negotiation, for example if
+ * the application does not call the media transport SDP functions, the
+ * transport never uses AES-GCM.
+ *
+ * AES-GCM encrypts and authenticates a packet in one pass and is
+ * considerably faster on CPUs with AES and carry-less multiply
+ * instructions.
+ *
+ * The keying is not the keying of RFC 7714: the transport derives the
+ * AES-GCM key and salt with the RFC 3711 key derivation from the ZRTP
+ * master key and 14 byte master salt and truncates the salt to 12 bytes.
+ * This mode thus interoperates only with peers that use this ZRTP
+ * transport implementation.
+ *
+ * Set it before the SDP offer or answer is created, the setting has no
+ * effect on SRTP contexts that already exist.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param onOff
+ *     @c 1 to offer AES-GCM, @c 0 to use AES-CM and HMAC only (default)
+ */
+PJ_DECL(void) pjmedia_transport_zrtp_setSrtpAead(pjmedia_transport *tp, pj_bool_t onOff);
+
+/**
+ * Return the state of the AES-GCM setting.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @return @c true if ZRTP transport offers AES-GCM, @c false otherwise.
+ */
+PJ_DECL(pj_bool_t) pjmedia_transport_zrtp_isSrtpAead(pjmedia_transport *tp);
+
+/**
+ * Enable the keystream cache for sent SRTP packets.
+ *
+ * With the cache enabled the application can compute the AES-CM keystream
+ * of the next RTP packets in advance, see
+ * @c pjmedia_transport_zrtp_precomputeKeystream. Sending a packet then
+ * requires only XOR and the MAC computation. This smooths the load if many
+ * streams send their packets at the same time, for example at each 20 ms
+ * audio tick.
+ *
+ * Set it before ZRTP starts, the setting takes effect when ZRTP creates
+ * the SRTP sender context. Only AES-CM supports the cache.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param packets
+ *      Number of packets to compute in advance, @c 0 disables the cache.
+ *
+ * @param maxLength
+ *      Payload length the cache covers per packet, for example 160 for
+ *      20 ms G.711. Longer payloads are encrypted as usual.
+ */
+PJ_DECL(void) pjmedia_transport_zrtp_setKeystreamCache(pjmedia_transport *tp,
+                                                       unsigned packets,
+                                                       unsigned maxLength);
+
+/**
+ * Compute the keystream of the next RTP packets to send.
+ *
+ * Call this during idle time, for example from a worker thread or after
+ * a packet was sent. The function may run concurrently to sending RTP
+ * packets. It does nothing if SRTP is not active or the keystream cache
+ * is not enabled.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @return
+ *      Number of packets the function computed the keystream for.
+ */
+PJ_DECL(unsigned) pjmedia_transport_zrtp_precomputeKeystream(pjmedia_transport *tp);
+
+/**
+ * Set the size of the SRTP and SRTCP replay windows of the receiver.
+ *
+ * SRTP rejects a packet that arrives more than the window size packets
+ * behind the newest received packet. The default window of 64 packets
+ * is too small for video streams on networks that reorder bursts of
+ * packets, for example Wi-Fi or LTE. The dropped packets then trigger
+ * keyframe requests. A larger window does not increase the processing
+ * cost per packet.
+ *
+ * Set it before ZRTP starts, the setting takes effect when ZRTP creates
+ * the SRTP receiver contexts.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param size
+ *      Window size in packets, 64 to 4096.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVAL if the size is out of range.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setReplayWindow(pjmedia_transport *tp,
+                                                            unsigned size);
+
+/**
+ * Set the number of RTP streams the SRTP receiver can handle.
+ *
+ * Each SSRC the peer sends, for example simulcast layers, FEC or RTX
+ * streams, needs its own ROC and replay state. The SRTP receiver creates
+ * this state when the first authenticated packet of a SSRC arrives, the
+ * streams share the SRTP session keys. If more SSRCs show up the receiver
+ * drops the state of the stream that was idle the longest. The default is
+ * @c MAX_RTP_RECV_STREAMS.
+ *
+ * Set it before ZRTP starts, the setting takes effect when ZRTP creates
+ * the SRTP receiver contexts.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param maxStreams
+ *      Number of streams, 1 to 64.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVAL if the number is out of range.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setReceiveStreams(pjmedia_transport *tp,
+                                                              unsigned maxStreams);
+
+/**
+ * Set how long the SRTP receiver keeps the previous key after a key change.
+ *
+ * If ZRTP negotiates new keys, for example after GoClear or a new handshake,
+ * packets the peer protected with the old key may still be on the way.
+ * During this window the receiver tries each packet with the newest
+ * contexts first and then with the previous ones. It remembers per SSRC
+ * which contexts authenticated the last packet and tries these first.
+ *
+ * The window is off unless the application sets it or builds with a
+ * non-zero @c ZRTP_REKEY_WINDOW: without the window a transport behaves
+ * as before and drops packets protected with the old key. During the
+ * window a packet that fails authentication costs one more MAC check,
+ * and a forged packet costs two. A window of 2000 milliseconds covers
+ * the usual network delay and jitter buffers.
+ *
+ * The setting takes effect at the next key change.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param msec
+ *      The window in milliseconds, 0 destroys the previous contexts at once.
+ */
+PJ_DECL(void) pjmedia_transport_zrtp_setRekeyWindow(pjmedia_transport *tp,
+                                                   unsigned msec);
+
+/**
+ * Start the SRTP worker threads.
+ *
+ * Transports in async mode, see @c pjmedia_transport_zrtp_setAsync, hand
+ * SRTP and SRTCP packets to these threads instead of protecting and
+ * checking them on the calling media thread. The workers are shared by all
+ * ZRTP transports of the process.
+ *
+ * The SRTP contexts of a transport keep a keyed cipher context for each
+ * thread that may use them at the same time, that is @c count plus
+ * @c ZRTP_MEDIA_THREADS. Start the workers before the transports go
+ * secure, contexts created earlier have fewer cipher contexts and the
+ * workers may wait for each other.
+ *
+ * @param endpt
+ *      The media endpoint, provides the memory pool.
+ *
+ * @param count
+ *      Number of worker threads, 1 to @c MAX_ZRTP_WORKERS.
+ *
+ * @param cpus
+ *      CPU number for each worker thread, or NULL to let the OS schedule
+ *      them. Supported on Linux and Windows.
+ *
+ * @return
+ *      PJ_SUCCESS, PJ_EEXISTS if the workers run already, or the error
+ *      that stopped the thread creation.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_workers_create(pjmedia_endpt *endpt,
+                                                           unsigned count,
+                                                           const int cpus[]);
+
+/**
+ * Stop the SRTP worker threads.
+ *
+ * The workers process their queued packets before they stop. Switch off
+ * async mode, ZRTP offload and parallel decryption of all transports, or
+ * destroy them, before calling this.
+ */
+PJ_DECL(void) pjmedia_transport_zrtp_workers_destroy(void);
+
+/**
+ * Set the number of ZRTP timer threads.
+ *
+ * The ZRTP timers of the transports are spread over several timer
+ * threads, each with its own timer wheel. A transport always uses the
+ * same thread, the timeouts of different transports run in parallel.
+ * The threads start with the first transport and stop when the media
+ * endpoint shuts down, call this function before.
+ *
+ * @param count
+ *      Number of timer threads, 0 starts one per CPU. The default is
+ *      @c ZRTP_TIMER_THREADS.
+ *
+ * @return
+ *      PJ_SUCCESS, PJ_EBUSY if the timer threads run already, or
+ *      PJ_ENOTSUP if the transports use DYNAMIC_TIMER.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setTimerThreads(unsigned count);
+
+/**
+ * Put the ZRTP timers into a timer heap of the application.
+ *
+ * Only if the library is built with DYNAMIC_TIMER. Without this call the
+ * transports share a timer heap of their own, the application runs it
+ * with @c pjmedia_transport_zrtp_poll_timers. With this call the ZRTP
+ * timers go into the given heap, for example the heap the event loop of
+ * the application polls already. Call it before creating the first
+ * transport.
+ *
+ * @param ht
+ *      The timer heap, it must exist as long as ZRTP transports exist.
+ *
+ * @return
+ *      PJ_SUCCESS, PJ_EBUSY if the transports use another heap already,
+ *      or PJ_ENOTSUP if the library uses timer threads.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setTimerHeap(pj_timer_heap_t *ht);
+
+/**
+ * Get the expiry time of the earliest ZRTP timer.
+ *
+ * Only if the library is built with DYNAMIC_TIMER. An event loop uses it
+ * to compute its poll timeout.
+ *
+ * @param deadline
+ *      Receives the expiry time, on the clock of @c pj_gettickcount.
+ *
+ * @return
+ *      PJ_SUCCESS, PJ_ENOTFOUND if no timer is active, or PJ_ENOTSUP if
+ *      the library uses timer threads.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_next_deadline(pj_time_val *deadline);
+
+/**
+ * Run the expired ZRTP timers.
+ *
+ * Only if the library is built with DYNAMIC_TIMER, the timeouts run on
+ * the calling thread. Call it from the event loop of the application when
+ * the deadline passed, or at least every few milliseconds during ZRTP
+ * handshakes.
+ *
+ * @param next_delay
+ *      Receives the time until the next timer expires, PJ_MAXINT32
+ *      seconds if no timer is active. May be NULL.
+ *
+ * @return
+ *      The number of timeouts that ran.
+ */
+PJ_DECL(unsigned) pjmedia_transport_zrtp_poll_timers(pj_time_val *next_delay);
+
+/**
+ * Switch async mode of a transport on or off.
+ *
+ * In async mode the transport copies each SRTP and SRTCP packet into the
+ * queue of a worker and returns. One worker handles the send direction,
+ * one the receive direction of a transport, thus the packets of each SSRC
+ * keep their order. The workers send through the slave transport and
+ * call the stream callbacks. ZRTP packets stay on the calling thread, see
+ * @c pjmedia_transport_zrtp_setZrtpOffload, the tick collector protects
+ * on the calling thread as well.
+ *
+ * If a queue is full the packet is dropped, the send functions then return
+ * PJ_ETOOMANY. Switching async mode off waits until the workers processed
+ * the queued packets of the transport. Do not switch it off or destroy the
+ * transport in a stream callback that runs on a worker.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param enable
+ *      PJ_TRUE to queue packets to the workers.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVALIDOP if the workers do not run.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setAsync(pjmedia_transport *tp,
+                                                    pj_bool_t enable);
+
+/**
+ * Process received ZRTP packets on a worker.
+ *
+ * The DHPart and Commit messages of a handshake run the DH or ECDH key
+ * agreement, it takes milliseconds. Without offload this runs on the
+ * thread of the slave transport and delays the other streams of this
+ * thread. With offload the transport copies each received ZRTP packet
+ * into the queue of one worker, thus the packets keep their order. The
+ * ZRTP engine serializes the worker and the timer thread with its
+ * mutex as before. The ZRTP user callbacks, for example the SAS display,
+ * then run on the worker.
+ *
+ * If the queue is full the ZRTP packet is dropped, the peer repeats it.
+ * Switching offload off waits until the worker processed the queued
+ * packets. Do not switch it off from a ZRTP user callback.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param enable
+ *      PJ_TRUE to process ZRTP packets on a worker.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVALIDOP if the workers do not run.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setZrtpOffload(pjmedia_transport *tp,
+                                                         pj_bool_t enable);
+
+/**
+ * Decrypt bursts of received SRTP packets on several workers.
+ *
+ * A slave transport that delivers several packets at once through
+ * @c pjmedia_transport_zrtp_rtp_batch_cb, for example the packets of a
+ * video frame, may have them decrypted in parallel. The receive thread
+ * checks the packets for replays, then it and the workers authenticate
+ * and decrypt them. The receive thread updates the replay and ROC state
+ * and calls the stream callback in arrival order.
+ *
+ * Bursts smaller than @c minBurst, contexts whose algorithms cannot run on
+ * several threads, and transports in async mode decrypt on one thread.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param minBurst
+ *      Minimum number of packets to decrypt in parallel, 0 switches
+ *      parallel decryption off.
+ *
+ * @return
+ *      PJ_SUCCESS, or PJ_EINVALIDOP if the workers do not run.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_setParallelDecrypt(pjmedia_transport *tp,
+                                                             unsigned minBurst);
+
 /**
  * Set the application's callback structure.
  *
@@ -650,6 +1148,216 @@ PJ_DECL(void) pjmedia_transport_zrtp_setMitmMode(pjmedia_transport *tp, pj_bool_
  */
 PJ_DECL(ZrtpContext*) pjmedia_transport_zrtp_getZrtpContext(pjmedia_transport *tp);
 
+/**
+ * Send a RTP packet and protect it in the caller's buffer.
+ *
+ * @c pjmedia_transport_send_rtp copies each packet into a buffer of the
+ * transport because SRTP appends the authentication tag and the packet
+ * data is const. This function instead encrypts the packet in place and
+ * appends the tag to it, then hands the same buffer to the slave
+ * transport. This saves one copy of each packet and there is no limit on
+ * the packet size, for example for large video packets.
+ *
+ * The buffer must have @c ZRTP_SEND_TAILROOM bytes of room after the
+ * packet data. If the room is smaller than the tag the function falls back
+ * to the copying send. The buffer contains the SRTP packet after the
+ * call, the application must not send it again as RTP.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param pkt
+ *      The RTP packet.
+ *
+ * @param size
+ *      Length of the RTP packet.
+ *
+ * @param capacity
+ *      Size of the buffer, at least @c size.
+ *
+ * @return
+ *      PJ_SUCCESS on success, or the appropriate error code.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_send_rtp_inplace(pjmedia_transport *tp,
+                                                             void *pkt,
+                                                             pj_size_t size,
+                                                             pj_size_t capacity);
+
+/**
+ * Send a RTCP packet and protect it in the caller's buffer.
+ *
+ * Works like @c pjmedia_transport_zrtp_send_rtp_inplace, SRTCP appends
+ * the SRTCP index and the authentication tag.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param pkt
+ *      The RTCP packet.
+ *
+ * @param size
+ *      Length of the RTCP packet.
+ *
+ * @param capacity
+ *      Size of the buffer, at least @c size.
+ *
+ * @return
+ *      PJ_SUCCESS on success, or the appropriate error code.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_send_rtcp_inplace(pjmedia_transport *tp,
+                                                              void *pkt,
+                                                              pj_size_t size,
+                                                              pj_size_t capacity);
+
+/**
+ * Send a burst of RTP packets.
+ *
+ * Applications that produce several RTP packets at once, for example all
+ * packets of a video frame, may use this function instead of calling
+ * @c pjmedia_transport_send_rtp for each packet. If SRTP is active the
+ * ZRTP transport encrypts and authenticates the packets in chunks of
+ * @c MAX_RTP_SEND_BATCH packets and then hands them to the slave transport
+ * in the given order.
+ *
+ * The packets must belong to the same RTP stream and must be in sending
+ * order. The function does not modify the packet data.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param pkts
+ *      Array of pointers to the RTP packets, each containing RTP header
+ *      and payload.
+ *
+ * @param sizes
+ *      Array of the RTP packet sizes.
+ *
+ * @param count
+ *      Number of packets to send.
+ *
+ * @return
+ *      PJ_SUCCESS if all packets were sent, otherwise the status of the
+ *      first failing packet. The function continues to send the remaining
+ *      packets in this case.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_send_rtp_batch(pjmedia_transport *tp,
+        const void *pkts[],
+        const pj_size_t sizes[],
+        unsigned count);
+
+/**
+ * Collects RTP packets of many ZRTP transports during one mixer tick.
+ */
+typedef struct pjmedia_zrtp_tick pjmedia_zrtp_tick;
+
+/**
+ * Create a tick collector.
+ *
+ * A conference bridge sends one RTP packet on each of its streams per
+ * mixer tick. Instead of calling @c pjmedia_transport_send_rtp for each
+ * stream the bridge may queue the packets in a tick collector and then
+ * flush the collector once per tick. The flush protects the packets of
+ * all streams together, see @c zsrtp_protect_multi, and hands them to the
+ * slave transports.
+ *
+ * A tick collector is not thread safe, usually the mixer thread owns it.
+ * The collector keeps pointers to the transports of the queued packets
+ * and does not hold a reference, see @c pjmedia_transport_zrtp_tick_send_rtp.
+ *
+ * @param pool
+ *      The pool to allocate the collector and its packet buffers from.
+ *
+ * @param max_packets
+ *      Maximum number of packets per tick. If more packets are queued
+ *      the collector flushes the packets queued so far.
+ *
+ * @param p_tick
+ *      Receives the tick collector.
+ *
+ * @return
+ *      PJ_SUCCESS on success.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_tick_create(pj_pool_t *pool,
+        unsigned max_packets,
+        pjmedia_zrtp_tick **p_tick);
+
+/**
+ * Queue a RTP packet for the next flush of the tick collector.
+ *
+ * The function copies the packet. If SRTP is not active for the transport
+ * it sends the packet immediately.
+ *
+ * The collector stores the transport pointer until the next flush. The
+ * application must flush the collector before it destroys a transport
+ * that has queued packets.
+ *
+ * @param tick
+ *      The tick collector.
+ *
+ * @param tp
+ *      Pointer to the ZRTP transport data as returned by
+ *      @c pjmedia_transport_zrtp_create.
+ *
+ * @param pkt
+ *      The RTP packet, containing RTP header and payload.
+ *
+ * @param size
+ *      The RTP packet size.
+ *
+ * @return
+ *      PJ_SUCCESS if the packet was queued or sent.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_tick_send_rtp(pjmedia_zrtp_tick *tick,
+        pjmedia_transport *tp,
+        const void *pkt,
+        pj_size_t size);
+
+/**
+ * Protect and send all packets queued in the tick collector.
+ *
+ * @param tick
+ *      The tick collector.
+ *
+ * @return
+ *      PJ_SUCCESS if all packets were sent, otherwise the status of the
+ *      first failing packet. The function sends the remaining packets in
+ *      this case.
+ */
+PJ_DECL(pj_status_t) pjmedia_transport_zrtp_tick_flush(pjmedia_zrtp_tick *tick);
+
+/**
+ * Receive a burst of RTP packets.
+ *
+ * A slave transport that reads several datagrams at once, for example via
+ * @c recvmmsg, may call this function instead of calling the RTP callback
+ * that ZRTP transport registered during attach for each packet. The
+ * function checks and decrypts the SRTP packets of the burst in chunks of
+ * @c MAX_RTP_RECV_BATCH packets and delivers them to the stream in
+ * arrival order. ZRTP packets of the burst are processed as usual.
+ *
+ * @param user_data
+ *      The user data that ZRTP transport registered with the slave
+ *      transport, the same as the first parameter of the RTP callback.
+ *
+ * @param pkts
+ *      Array of pointers to the received packets. The function decrypts
+ *      the packets in place.
+ *
+ * @param sizes
+ *      Array of the received packet sizes. A negative size signals an error,
+ *      the function forwards such entries to the stream unchanged.
+ *
+ * @param count
+ *      Number of received packets.
+ */
+PJ_DECL(void) pjmedia_transport_zrtp_rtp_batch_cb(void *user_data,
+        void *pkts[],
+        const pj_ssize_t sizes[],
+        unsigned count);
+
 PJ_END_DECL
 
 
@@ -0,0 +1,220 @@
+/*
+    This file implements the multi-buffer AES counter mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+#include "ZsrtpAesMb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZSRTP_AES_NI
+#include <immintrin.h>
+#endif
+
+#ifdef ZSRTP_AES_NI
+
+#define LANES 8
+
+static bool haveAesNi()
+{
+    static const bool aes = __builtin_cpu_supports("aes") != 0;
+    return aes;
+}
+
+/*
+ * Key expansion step, the assist word comes from aeskeygenassist
+ */
+__attribute__((target("aes")))
+static inline __m128i expandStep(__m128i key, __m128i assist)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+/* aeskeygenassist needs the round constant as immediate */
+#define EXPAND128(rk, i, rcon) \
+    rk[i] = expandStep(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+
+#define EXPAND256(rk, i, rcon)                                                                     \
+    do {                                                                                           \
+        rk[i] = expandStep(rk[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff)); \
+        if (i + 1 < 15)                                                                            \
+            rk[i + 1] = expandStep(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa)); \
+    } while (0)
+
+__attribute__((target("aes")))
+static void expandKey(const uint8_t* key, int32_t keyLength, ZsrtpAesKey* akey)
+{
+    __m128i rk[15];
+
+    rk[0] = _mm_loadu_si128((const __m128i*)key);
+    if (keyLength == 16) {
+        EXPAND128(rk, 1, 0x01);
+        EXPAND128(rk, 2, 0x02);
+        EXPAND128(rk, 3, 0x04);
+        EXPAND128(rk, 4, 0x08);
+        EXPAND128(rk, 5, 0x10);
+        EXPAND128(rk, 6, 0x20);
+        EXPAND128(rk, 7, 0x40);
+        EXPAND128(rk, 8, 0x80);
+        EXPAND128(rk, 9, 0x1b);
+        EXPAND128(rk, 10, 0x36);
+        akey->rounds = 10;
+    }
+    else {
+        rk[1] = _mm_loadu_si128((const __m128i*)(key + 16));
+        EXPAND256(rk, 2, 0x01);
+        EXPAND256(rk, 4, 0x02);
+        EXPAND256(rk, 6, 0x04);
+        EXPAND256(rk, 8, 0x08);
+        EXPAND256(rk, 10, 0x10);
+        EXPAND256(rk, 12, 0x20);
+        EXPAND256(rk, 14, 0x40);
+        akey->rounds = 14;
+    }
+    for (int i = 0; i <= akey->rounds; i++)
+        _mm_storeu_si128((__m128i*)akey->roundKeys[i], rk[i]);
+
+    // Do not leave key material in the stack frame
+    memset(rk, 0, sizeof(rk));
+    __asm__ __volatile__("" : : "r"(rk) : "memory");
+}
+
+/*
+ * Find the next job with the given number of rounds and some data.
+ */
+static inline int32_t nextJob(const ZsrtpAesCtrJob* jobs, int32_t n, int32_t from, int32_t rounds)
+{
+    for (; from < n; from++) {
+        if (jobs[from].key->rounds == rounds && jobs[from].length > 0)
+            break;
+    }
+    return from;
+}
+
+/*
+ * Run all jobs whose key has the given number of rounds through the eight
+ * lanes. An idle lane encrypts a dummy block, its result is not used.
+ */
+template <int Rounds>
+__attribute__((target("aes")))
+static void ctrLanes(const ZsrtpAesCtrJob* jobs, int32_t n)
+{
+    const uint8_t* keys[LANES];
+    const ZsrtpAesCtrJob* lane[LANES];
+    __m128i iv[LANES];
+    int32_t block[LANES];
+    __m128i s[LANES];
+    uint8_t tail[16];
+    int32_t active = 0;
+
+    int32_t next = nextJob(jobs, n, 0, Rounds);
+    if (next >= n)
+        return;
+
+    for (int l = 0; l < LANES; l++) {
+        keys[l] = jobs[next].key->roundKeys[0];
+        lane[l] = NULL;
+        iv[l] = _mm_setzero_si128();
+        block[l] = 0;
+    }
+    for (int l = 0; l < LANES && next < n; l++) {
+        lane[l] = &jobs[next];
+        keys[l] = jobs[next].key->roundKeys[0];
+        iv[l] = _mm_loadu_si128((const __m128i*)jobs[next].iv);
+        active++;
+        next = nextJob(jobs, n, next + 1, Rounds);
+    }
+
+    while (active > 0) {
+        // Counter block: the 16 bit block counter big endian in the last IV
+        // bytes. The lane loops must unroll to keep the states in registers.
+#pragma GCC unroll 8
+        for (int l = 0; l < LANES; l++) {
+            int ctr = ((block[l] >> 8) & 0xff) | ((block[l] & 0xff) << 8);
+            s[l] = _mm_xor_si128(_mm_insert_epi16(iv[l], ctr, 7),
+                                 _mm_loadu_si128((const __m128i*)keys[l]));
+        }
+#pragma GCC unroll 14
+        for (int r = 1; r < Rounds; r++) {
+#pragma GCC unroll 8
+            for (int l = 0; l < LANES; l++)
+                s[l] = _mm_aesenc_si128(s[l], _mm_loadu_si128((const __m128i*)(keys[l] + 16 * r)));
+        }
+#pragma GCC unroll 8
+        for (int l = 0; l < LANES; l++)
+            s[l] = _mm_aesenclast_si128(s[l], _mm_loadu_si128((const __m128i*)(keys[l] + 16 * Rounds)));
+
+        for (int l = 0; l < LANES; l++) {
+            const ZsrtpAesCtrJob* job = lane[l];
+            if (job == NULL)
+                continue;
+
+            int32_t offset = 16 * block[l];
+            int32_t remain = job->length - offset;
+            if (remain >= 16) {
+                __m128i d = _mm_loadu_si128((const __m128i*)(job->data + offset));
+                _mm_storeu_si128((__m128i*)(job->data + offset), _mm_xor_si128(d, s[l]));
+            }
+            else {
+                _mm_storeu_si128((__m128i*)tail, s[l]);
+                for (int32_t i = 0; i < remain; i++)
+                    job->data[offset + i] ^= tail[i];
+            }
+            block[l]++;
+            if (remain > 16)
+                continue;
+
+            // Packet done, the lane takes the next one
+            if (next < n) {
+                lane[l] = &jobs[next];
+                keys[l] = jobs[next].key->roundKeys[0];
+                iv[l] = _mm_loadu_si128((const __m128i*)jobs[next].iv);
+                block[l] = 0;
+                next = nextJob(jobs, n, next + 1, Rounds);
+            }
+            else {
+                lane[l] = NULL;
+                active--;
+            }
+        }
+    }
+    memset(tail, 0, sizeof(tail));
+}
+#endif
+
+bool zsrtpAesPrepareKey(const uint8_t* key, int32_t keyLength, ZsrtpAesKey* akey)
+{
+    akey->rounds = 0;
+#ifdef ZSRTP_AES_NI
+    if ((keyLength == 16 || keyLength == 32) && haveAesNi()) {
+        expandKey(key, keyLength, akey);
+        return true;
+    }
+#endif
+    return false;
+}
+
+void zsrtpAesCtrMulti(const ZsrtpAesCtrJob* jobs, int32_t n)
+{
+#ifdef ZSRTP_AES_NI
+    ctrLanes<10>(jobs, n);
+    ctrLanes<14>(jobs, n);
+#endif
+}
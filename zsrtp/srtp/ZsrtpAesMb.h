@@ -0,0 +1,81 @@
+/*
+    This file defines the multi-buffer AES counter mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPAESMB_H
+#define ZSRTPAESMB_H
+
+/*
+ * AES counter mode over many short packets at once. A single short packet
+ * has only a few counter blocks, the AES-NI pipeline stays mostly empty.
+ * The multi-buffer code runs eight lanes, each lane works on the blocks of
+ * one packet with the key of that packet. A step encrypts one counter
+ * block in every lane, the rounds of the eight blocks interleave, then the
+ * step XORs the eight keystream blocks into their packets. A lane takes
+ * the next packet as soon as its packet is done.
+ */
+
+#include <stdint.h>
+
+/*
+ * Longer packets have enough blocks of their own to fill the pipeline, the
+ * regular AES code is faster for them.
+ */
+#define ZSRTP_AES_MB_MAX_LENGTH 512
+
+typedef struct zsrtpAesKey
+{
+    uint8_t roundKeys[15][16];
+    int32_t rounds;         /* 10 or 14, 0 if the multi-buffer code is not available */
+} ZsrtpAesKey;
+
+/**
+ * One packet for zsrtpAesCtrMulti().
+ */
+typedef struct zsrtpAesCtrJob
+{
+    const ZsrtpAesKey* key;
+    uint8_t iv[16];         /* counter mode IV, the last two bytes are ignored */
+    uint8_t* data;          /* encrypted or decrypted in place */
+    int32_t length;
+} ZsrtpAesCtrJob;
+
+/**
+ * Compute the AES key schedule for the multi-buffer code.
+ *
+ * @param key       the key, 16 or 32 bytes
+ * @param keyLength length of the key in bytes
+ * @param akey      receives the key schedule
+ * @return false if the key length is not supported or the CPU has no
+ *         AES instructions. The caller uses its regular AES code then.
+ */
+bool zsrtpAesPrepareKey(const uint8_t* key, int32_t keyLength, ZsrtpAesKey* akey);
+
+/**
+ * XOR the data of all jobs with their SRTP counter mode keystream, RFC 3711
+ * chapter 4.1.1.
+ *
+ * The block counter of each job starts at 0 and occupies the last two
+ * bytes of its IV. The jobs may use different keys.
+ *
+ * @param jobs the jobs, their keys must come from zsrtpAesPrepareKey()
+ * @param n    number of jobs
+ */
+void zsrtpAesCtrMulti(const ZsrtpAesCtrJob* jobs, int32_t n);
+
+#endif
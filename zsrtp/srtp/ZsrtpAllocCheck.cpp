@@ -0,0 +1,150 @@
+/*
+    This file implements the allocation check mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifdef ZSRTP_ALLOC_CHECK
+
+#include <stdlib.h>
+#include <errno.h>
+#include <new>
+#include <atomic>
+#include <pjlib.h>
+#include <ZsrtpCWrapper.h>
+#include "ZsrtpAllocCheck.h"
+
+#define THIS_FILE "ZsrtpAllocCheck.cpp"
+
+#if defined(__GNUC__)
+/*
+ * The hooks run inside malloc. Initial-exec TLS is a fixed offset from the
+ * thread pointer, other models may call __tls_get_addr in a shared object,
+ * which may allocate and recurse into the hook.
+ */
+static __thread uint64_t allocCount __attribute__((tls_model("initial-exec")));
+#else
+static thread_local uint64_t allocCount = 0;
+#endif
+static std::atomic<uint64_t> violations(0);
+
+#if defined(__GLIBC__)
+/*
+ * With glibc replace the malloc family, this also catches operator new
+ * and the allocations inside the crypto library.
+ */
+extern "C"
+{
+    extern void* __libc_malloc(size_t size);
+    extern void* __libc_calloc(size_t n, size_t size);
+    extern void* __libc_realloc(void* ptr, size_t size);
+    extern void* __libc_memalign(size_t alignment, size_t size);
+
+    void* malloc(size_t size)
+    {
+        allocCount++;
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t n, size_t size)
+    {
+        allocCount++;
+        return __libc_calloc(n, size);
+    }
+
+    void* realloc(void* ptr, size_t size)
+    {
+        allocCount++;
+        return __libc_realloc(ptr, size);
+    }
+
+    void* memalign(size_t alignment, size_t size)
+    {
+        allocCount++;
+        return __libc_memalign(alignment, size);
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size)
+    {
+        allocCount++;
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void** ptr, size_t alignment, size_t size)
+    {
+        allocCount++;
+        if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+            return EINVAL;
+
+        void* p = __libc_memalign(alignment, size);
+        if (p == NULL)
+            return ENOMEM;
+        *ptr = p;
+        return 0;
+    }
+}
+#else
+/*
+ * Other C libraries: replace the global operator new only.
+ */
+void* operator new(std::size_t size)
+{
+    allocCount++;
+    void* p = malloc(size);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+#endif
+
+ZsrtpAllocGuard::ZsrtpAllocGuard(const char* where) : where(where), start(allocCount)
+{
+}
+
+ZsrtpAllocGuard::~ZsrtpAllocGuard()
+{
+    if (allocCount != start) {
+        violations++;
+        PJ_LOG(1, (THIS_FILE, "Heap allocation in SRTP packet path: %s", where));
+    }
+}
+
+uint64_t zsrtp_getAllocViolations(void)
+{
+    return violations.load();
+}
+
+void zsrtp_resetAllocViolations(void)
+{
+    violations.store(0);
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+    This file defines the allocation check mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPALLOCCHECK_H
+#define ZSRTPALLOCCHECK_H
+
+/*
+ * The SRTP packet path must not allocate heap memory after the crypto
+ * contexts are set up. If ZSRTP_ALLOC_CHECK is defined the wrapper counts
+ * the heap allocations of the current thread and each protect/unprotect
+ * function checks that its packet processing did not allocate. Without
+ * ZSRTP_ALLOC_CHECK the guard compiles to nothing.
+ */
+#ifdef ZSRTP_ALLOC_CHECK
+
+#include <stdint.h>
+
+class ZsrtpAllocGuard
+{
+public:
+    ZsrtpAllocGuard(const char* where);
+    ~ZsrtpAllocGuard();
+
+private:
+    const char* where;
+    uint64_t start;
+};
+
+#define ZSRTP_ALLOC_GUARD(where) ZsrtpAllocGuard allocGuard_(where)
+#else
+#define ZSRTP_ALLOC_GUARD(where)
+#endif
+
+#endif
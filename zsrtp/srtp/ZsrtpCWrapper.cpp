@@ -23,6 +23,8 @@
 #include <pjmedia/errno.h>
 #include <pj/string.h>
 #include <ZsrtpCWrapper.h>
+#include "ZsrtpAllocCheck.h"
+#include "ZsrtpTransforms.h"
 
 #ifdef _MSC_VER
 #include <winsock2.h>
@@ -30,6 +32,26 @@
 #include <arpa/inet.h>
 #endif
 
+/*
+ * Create the MAC transform, it derives its key with the PRF of the cipher.
+ * Returns NULL for algorithm combinations that CryptoContext handles.
+ */
+static SrtpMac* newMac(int32_t ealg, int32_t aalg, uint8_t* masterKey, int32_t masterKeyLength,
+                       uint8_t* masterSalt, int32_t masterSaltLength,
+                       int32_t akeyl, int32_t tagLength, bool rtcp)
+{
+    if (ealg != SrtpEncryptionAESCM && ealg != SrtpEncryptionTWOCM)
+        return NULL;
+
+    bool twofishPrf = ealg == SrtpEncryptionTWOCM;
+    if (aalg == SrtpAuthenticationSha1Hmac)
+        return new SrtpHmacSha1(masterKey, masterKeyLength, masterSalt, masterSaltLength,
+                                akeyl, tagLength, rtcp, twofishPrf);
+    if (aalg == SrtpAuthenticationSkeinHmac)
+        return new SrtpSkeinMac(masterKey, masterKeyLength, masterSalt, masterSaltLength,
+                                akeyl, tagLength, rtcp, twofishPrf);
+    return NULL;
+}
 
 ZsrtpContext* zsrtp_CreateWrapper(uint32_t ssrc, int32_t roc,
                                   int64_t  keyDerivRate,
@@ -45,10 +67,35 @@ ZsrtpContext* zsrtp_CreateWrapper(uint32_t ssrc, int32_t roc,
                                   int32_t  tagLength)
 {
     ZsrtpContext* zc = new ZsrtpContext;
+    zc->srtp = NULL;
+    zc->aead = NULL;
+    zc->index = NULL;
+    zc->mac = NULL;
+    zc->cipher = NULL;
+    zc->twofish = NULL;
+    zc->streams = NULL;
+
+    if (ealg == SrtpEncryptionAESGCM) {
+        zc->aead = new SrtpAeadGcm(masterKey, masterKeyLength, masterSalt,
+                                   masterSaltLength, false);
+        zc->index = new SrtpIndexState(roc);
+        return zc;
+    }
     zc->srtp = new CryptoContext(ssrc, roc, keyDerivRate, ealg, aalg,
                                  masterKey, masterKeyLength, masterSalt,
                                  masterSaltLength, ekeyl, akeyl, skeyl,
                                  tagLength);
+    zc->index = new SrtpIndexState(roc);
+    zc->mac = newMac(ealg, aalg, masterKey, masterKeyLength, masterSalt,
+                     masterSaltLength, akeyl, tagLength, false);
+    if (ealg == SrtpEncryptionAESCM) {
+        zc->cipher = new SrtpAesCm(masterKey, masterKeyLength, masterSalt,
+                                   masterSaltLength, false);
+    }
+    if (ealg == SrtpEncryptionTWOCM) {
+        zc->twofish = new SrtpTwofishCm(masterKey, masterKeyLength, masterSalt,
+                                        masterSaltLength, false);
+    }
     return zc;
 }
 
@@ -60,6 +107,18 @@ void zsrtp_DestroyWrapper (ZsrtpContext* ctx)
 
     delete ctx->srtp;
     ctx->srtp = NULL;
+    delete ctx->aead;
+    ctx->aead = NULL;
+    delete ctx->index;
+    ctx->index = NULL;
+    delete ctx->mac;
+    ctx->mac = NULL;
+    delete ctx->cipher;
+    ctx->cipher = NULL;
+    delete ctx->twofish;
+    ctx->twofish = NULL;
+    delete ctx->streams;
+    ctx->streams = NULL;
 
     delete ctx;
 }
@@ -106,6 +165,119 @@ static pj_status_t zsrtp_decode_rtp(uint8_t* pkt, int32_t pkt_len,
     return PJ_SUCCESS;
 }
 
+/*
+ * Encrypt or decrypt the SRTP payload, prefer the wrapper's counter mode
+ * implementations.
+ */
+static inline void srtpEncrypt(ZsrtpContext* ctx, CryptoContext* pcc, uint8_t* pkt,
+                               uint8_t* payload, int32_t payloadlen, uint64_t index,
+                               uint32_t ssrc)
+{
+    if (ctx->cipher != NULL)
+        ctx->cipher->crypt(payload, payloadlen, index, ssrc);
+    else if (ctx->twofish != NULL)
+        ctx->twofish->crypt(payload, payloadlen, index, ssrc);
+    else
+        pcc->srtpEncrypt(pkt, payload, payloadlen, index, ssrc);
+}
+
+/*
+ * Compute the SRTP authentication tag, prefer the pre-keyed MAC state.
+ */
+static inline void srtpAuthenticate(ZsrtpContext* ctx, CryptoContext* pcc, uint8_t* pkt,
+                                    int32_t length, uint32_t roc, uint8_t* tag)
+{
+    if (ctx->mac != NULL)
+        ctx->mac->authenticate(pkt, length, roc, tag);
+    else
+        pcc->srtpAuthenticate(pkt, length, roc, tag);
+}
+
+/*
+ * Find the ROC and replay state of the stream that sent a packet. Without
+ * a stream table all packets share the state of the context. For an
+ * unknown SSRC this returns the spare state of the table, the caller
+ * inserts it after the packet was authenticated.
+ */
+static inline SrtpIndexState* streamState(ZsrtpContext* ctx, uint32_t ssrc, bool* isNew)
+{
+    *isNew = false;
+    if (ctx->streams == NULL)
+        return ctx->index;
+
+    SrtpIndexState* state = ctx->streams->lookup(ssrc);
+    if (state == NULL) {
+        *isNew = true;
+        state = ctx->streams->spare(ssrc);
+    }
+    return state;
+}
+
+/*
+ * Protect and unprotect with the AEAD transform. AEAD encrypts and
+ * authenticates in one pass.
+ */
+static int32_t aeadProtect(ZsrtpContext* ctx, uint8_t* buffer, int32_t length,
+                           int32_t* newLength)
+{
+    const pjmedia_rtp_hdr *hdr;
+    uint8_t* payload;
+    int32_t payloadlen;
+
+    ZSRTP_ALLOC_GUARD("zsrtp_protect");
+
+    if (zsrtp_decode_rtp(buffer, length, &hdr, &payload, &payloadlen) != PJ_SUCCESS) {
+        return 0;
+    }
+    uint16_t seqnum = ntohs(hdr->seq);
+    uint32_t roc = (uint32_t)(ctx->index->sendIndex(seqnum) >> 16);
+
+    if (!ctx->aead->sealRtp(buffer, (int32_t)(payload - buffer), length,
+                            ntohl(hdr->ssrc), roc, seqnum)) {
+        return 0;
+    }
+    *newLength = length + ctx->aead->getTagLength();
+    return 1;
+}
+
+static int32_t aeadUnprotect(ZsrtpContext* ctx, uint8_t* buffer, int32_t length,
+                             int32_t* newLength)
+{
+    const pjmedia_rtp_hdr *hdr;
+    uint8_t* payload;
+    int32_t payloadlen;
+    int32_t tagLength = ctx->aead->getTagLength();
+
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect");
+
+    // The tag is not part of the RTP data, exclude it when decoding
+    if (length < tagLength ||
+        zsrtp_decode_rtp(buffer, length - tagLength, &hdr, &payload, &payloadlen) != PJ_SUCCESS) {
+        return -1;
+    }
+    length -= tagLength;
+    *newLength = length;
+
+    uint16_t seqnum = ntohs(hdr->seq);
+    uint32_t ssrc = ntohl(hdr->ssrc);
+    bool isNew;
+    SrtpIndexState* state = streamState(ctx, ssrc, &isNew);
+
+    if (!state->checkReplay(seqnum)) {
+        return -2;
+    }
+    int64_t index = state->guessIndex(seqnum);
+
+    if (!ctx->aead->openRtp(buffer, (int32_t)(payload - buffer), length,
+                            ssrc, (uint32_t)(index >> 16), seqnum)) {
+        return -1;
+    }
+    state->update(seqnum);
+    if (isNew)
+        ctx->streams->insert(ssrc);
+    return 1;
+}
+
 int32_t zsrtp_protect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
                       int32_t* newLength)
 {
@@ -117,36 +289,175 @@ int32_t zsrtp_protect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
     uint32_t ssrc;
 
 
+    if (ctx->aead != NULL) {
+        return aeadProtect(ctx, buffer, length, newLength);
+    }
     if (pcc == NULL) {
         return 0;
     }
+    ZSRTP_ALLOC_GUARD("zsrtp_protect");
     zsrtp_decode_rtp(buffer, length, &hdr, &payload, &payloadlen);
 
     seqnum = hdr->seq;
     seqnum = ntohs(seqnum);
 
     /* Encrypt the packet */
-    uint64_t index = ((uint64_t)pcc->getRoc() << 16) | (uint64_t)seqnum;
+    uint64_t index = ctx->index->sendIndex(seqnum);
+    uint32_t roc = (uint32_t)(index >> 16);
 
     ssrc = hdr->ssrc;
     ssrc = ntohl(ssrc);
-    pcc->srtpEncrypt(buffer, payload, payloadlen, index, ssrc);
+    srtpEncrypt(ctx, pcc, buffer, payload, payloadlen, index, ssrc);
 
     // NO MKI support yet - here we assume MKI is zero. To build in MKI
     // take MKI length into account when storing the authentication tag.
 
     /* Compute MAC and store at end of RTP packet data */
-    pcc->srtpAuthenticate(buffer, length, pcc->getRoc(), buffer+length);
+    srtpAuthenticate(ctx, pcc, buffer, length, roc, buffer+length);
 
     *newLength = length + pcc->getTagLength();
-    
-    /* Update the ROC if necessary */
-    if (seqnum == 0xFFFF ) {
-        pcc->setRoc(pcc->getRoc() + 1);
-    }
     return 1;
 }
 
+int32_t zsrtp_getTrailerLength(ZsrtpContext* ctx)
+{
+    if (ctx->aead != NULL)
+        return ctx->aead->getTagLength();
+    if (ctx->srtp == NULL)
+        return 0;
+    return ctx->srtp->getTagLength() + ctx->srtp->getMkiLength();
+}
+
+int32_t zsrtp_protect_batch(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                            const int32_t lens[], int32_t n,
+                            int32_t newLens[])
+{
+    CryptoContext* pcc = ctx->srtp;
+    const pjmedia_rtp_hdr *hdr;
+    uint8_t* payload;
+    int32_t payloadlen;
+    uint16_t seqnum;
+    uint32_t ssrc;
+    int32_t done = 0;
+
+    if (ctx->aead != NULL) {
+        for (int32_t i = 0; i < n; i++) {
+            if (aeadProtect(ctx, pkts[i], lens[i], &newLens[i]) == 1)
+                done++;
+            else
+                newLens[i] = 0;
+        }
+        return done;
+    }
+    if (pcc == NULL) {
+        return 0;
+    }
+    ZSRTP_ALLOC_GUARD("zsrtp_protect_batch");
+
+    int32_t tagLength = pcc->getTagLength();
+
+    for (int32_t i = 0; i < n; i++) {
+        uint8_t* buffer = pkts[i];
+        int32_t length = lens[i];
+
+        if (zsrtp_decode_rtp(buffer, length, &hdr, &payload, &payloadlen) != PJ_SUCCESS) {
+            newLens[i] = 0;
+            continue;
+        }
+        seqnum = ntohs(hdr->seq);
+        ssrc = ntohl(hdr->ssrc);
+
+        /* Encrypt the packet and store the MAC at end of RTP packet data */
+        uint64_t index = ctx->index->sendIndex(seqnum);
+        srtpEncrypt(ctx, pcc, buffer, payload, payloadlen, index, ssrc);
+        srtpAuthenticate(ctx, pcc, buffer, length, (uint32_t)(index >> 16), buffer+length);
+
+        newLens[i] = length + tagLength;
+        done++;
+    }
+    return done;
+}
+
+/*
+ * zsrtp_protect_multi works on chunks of packets. The first pass computes
+ * the packet indices and turns the AES-CM payloads into jobs of the
+ * multi-buffer AES code, other ciphers encrypt right away. Then the
+ * multi-buffer code encrypts all jobs of the chunk, its lanes interleave
+ * the packets of the different contexts. The last pass computes the MACs
+ * packet by packet. The first pass stores the ROC that the last pass uses,
+ * a ROC of -1 marks packets that need no MAC.
+ */
+#define PROTECT_MULTI_CHUNK 32
+
+int32_t zsrtp_protect_multi(ZsrtpContext* ctxs[], pj_uint8_t* pkts[],
+                            const int32_t lens[], int32_t n,
+                            int32_t newLens[])
+{
+    const pjmedia_rtp_hdr *hdr;
+    uint8_t* payload;
+    int32_t payloadlen;
+    int64_t rocs[PROTECT_MULTI_CHUNK];
+    ZsrtpAesCtrJob jobs[PROTECT_MULTI_CHUNK];
+    int32_t done = 0;
+
+    ZSRTP_ALLOC_GUARD("zsrtp_protect_multi");
+
+    for (int32_t base = 0; base < n; base += PROTECT_MULTI_CHUNK) {
+        int32_t chunk = n - base;
+        int32_t numJobs = 0;
+        if (chunk > PROTECT_MULTI_CHUNK)
+            chunk = PROTECT_MULTI_CHUNK;
+
+        /* First pass: packet index and AES-CM jobs, the AEAD transform does
+           everything in one go */
+        for (int32_t j = 0; j < chunk; j++) {
+            int32_t i = base + j;
+            ZsrtpContext* ctx = ctxs[i];
+            CryptoContext* pcc = ctx->srtp;
+
+            rocs[j] = -1;
+            newLens[i] = 0;
+
+            if (ctx->aead != NULL) {
+                if (aeadProtect(ctx, pkts[i], lens[i], &newLens[i]) == 1)
+                    done++;
+                else
+                    newLens[i] = 0;
+                continue;
+            }
+            if (pcc == NULL ||
+                zsrtp_decode_rtp(pkts[i], lens[i], &hdr, &payload, &payloadlen) != PJ_SUCCESS) {
+                continue;
+            }
+            uint64_t index = ctx->index->sendIndex(ntohs(hdr->seq));
+            uint32_t ssrc = ntohl(hdr->ssrc);
+
+            if (ctx->cipher != NULL &&
+                ctx->cipher->multiJob(&jobs[numJobs], payload, payloadlen, index, ssrc))
+                numJobs++;
+            else
+                srtpEncrypt(ctx, pcc, pkts[i], payload, payloadlen, index, ssrc);
+            rocs[j] = (int64_t)(index >> 16);
+        }
+
+        /* Second pass: encrypt the AES-CM packets of all contexts */
+        zsrtpAesCtrMulti(jobs, numJobs);
+
+        /* Third pass: compute the MACs and store them at end of RTP packet data */
+        for (int32_t j = 0; j < chunk; j++) {
+            int32_t i = base + j;
+            ZsrtpContext* ctx = ctxs[i];
+
+            if (rocs[j] < 0)
+                continue;
+            srtpAuthenticate(ctx, ctx->srtp, pkts[i], lens[i], (uint32_t)rocs[j], pkts[i] + lens[i]);
+            newLens[i] = lens[i] + ctx->srtp->getTagLength();
+            done++;
+        }
+    }
+    return done;
+}
+
 int32_t zsrtp_unprotect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
                         int32_t* newLength)
 {
@@ -157,9 +468,13 @@ int32_t zsrtp_unprotect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
     uint16_t seqnum;
     uint32_t ssrc;
 
+    if (ctx->aead != NULL) {
+        return aeadUnprotect(ctx, buffer, length, newLength);
+    }
     if (pcc == NULL) {
         return 0;
     }
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect");
 
     zsrtp_decode_rtp(buffer, length, &hdr, &payload, &payloadlen);
 
@@ -194,43 +509,328 @@ int32_t zsrtp_unprotect(ZsrtpContext* ctx, pj_uint8_t* buffer, int32_t length,
     /* Replay control */
     seqnum = hdr->seq;
     seqnum = ntohs(seqnum);
-    if (!pcc->checkReplay(seqnum)) {
+    ssrc = hdr->ssrc;
+    ssrc = ntohl(ssrc);
+
+    bool isNew;
+    SrtpIndexState* state = streamState(ctx, ssrc, &isNew);
+    if (!state->checkReplay(seqnum)) {
         return -2;
     }
     /* Guess the index */
-    uint64_t guessedIndex = pcc->guessIndex(seqnum);
+    uint64_t guessedIndex = state->guessIndex(seqnum);
 
     uint32_t guessedRoc = (uint32_t)(guessedIndex >> 16);
-    uint8_t* mac = new uint8_t[pcc->getTagLength()];
+    uint8_t mac[64];
 
-    pcc->srtpAuthenticate(buffer, length, guessedRoc, mac);
+    srtpAuthenticate(ctx, pcc, buffer, length, guessedRoc, mac);
     if (pj_memcmp(tag, mac, pcc->getTagLength()) != 0) {
-        delete[] mac;
         return -1;
     }
-    delete[] mac;
 
     /* Decrypt the content */
-    ssrc = hdr->ssrc;
-    ssrc = ntohl(ssrc);
-    pcc->srtpEncrypt(buffer, payload, payloadlen, guessedIndex, ssrc);
+    srtpEncrypt(ctx, pcc, buffer, payload, payloadlen, guessedIndex, ssrc);
 
-    /* Update the Crypto-context */
-    pcc->update(seqnum);
+    /* Update the replay window and the ROC */
+    state->update(seqnum);
+    if (isNew)
+        ctx->streams->insert(ssrc);
 
     return 1;
 }
 
+/*
+ * Per packet data that the batch unprotect computes in its first pass and
+ * uses in the second pass. The batch is processed in chunks to keep this
+ * data on the stack.
+ */
+#define UNPROTECT_CHUNK 32
+
+typedef struct unprotectState
+{
+    uint8_t* payload;
+    int32_t payloadlen;
+    uint32_t ssrc;
+    uint16_t seqnum;
+} UnprotectState;
+
+int32_t zsrtp_unprotect_batch(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                              const int32_t lens[], int32_t n,
+                              int32_t newLens[], int32_t results[])
+{
+    CryptoContext* pcc = ctx->srtp;
+    const pjmedia_rtp_hdr *hdr;
+    UnprotectState state[UNPROTECT_CHUNK];
+    uint8_t mac[64];
+    int32_t done = 0;
+    bool isNew;
+
+    if (ctx->aead != NULL) {
+        for (int32_t i = 0; i < n; i++) {
+            newLens[i] = 0;
+            results[i] = aeadUnprotect(ctx, pkts[i], lens[i], &newLens[i]);
+            if (results[i] == 1)
+                done++;
+        }
+        return done;
+    }
+    if (pcc == NULL) {
+        return 0;
+    }
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect_batch");
+
+    int32_t tagLength = pcc->getTagLength();
+    int32_t mkiLength = pcc->getMkiLength();
+    int32_t srtpLength = tagLength + mkiLength;
+
+    for (int32_t base = 0; base < n; base += UNPROTECT_CHUNK) {
+        int32_t chunk = (n - base < UNPROTECT_CHUNK) ? n - base : UNPROTECT_CHUNK;
+
+        /* First pass: decoding and replay control for all packets */
+        for (int32_t j = 0; j < chunk; j++) {
+            int32_t i = base + j;
+            UnprotectState* st = &state[j];
+
+            newLens[i] = 0;
+            results[i] = -1;
+            if (lens[i] < srtpLength ||
+                zsrtp_decode_rtp(pkts[i], lens[i] - srtpLength, &hdr,
+                                 &st->payload, &st->payloadlen) != PJ_SUCCESS) {
+                continue;
+            }
+            st->seqnum = ntohs(hdr->seq);
+            st->ssrc = ntohl(hdr->ssrc);
+            if (!streamState(ctx, st->ssrc, &isNew)->checkReplay(st->seqnum)) {
+                results[i] = -2;
+                continue;
+            }
+            results[i] = 0;             /* candidate for second pass */
+        }
+
+        /* Second pass: authenticate and decrypt the remaining packets */
+        for (int32_t j = 0; j < chunk; j++) {
+            int32_t i = base + j;
+            UnprotectState* st = &state[j];
+            int32_t length = lens[i] - srtpLength;
+
+            if (results[i] != 0) {
+                continue;
+            }
+            // An earlier packet of this burst may have used the same sequence
+            // number or added the stream, thus check again and guess the index
+            SrtpIndexState* stream = streamState(ctx, st->ssrc, &isNew);
+            if (!stream->checkReplay(st->seqnum)) {
+                results[i] = -2;
+                continue;
+            }
+            uint64_t index = stream->guessIndex(st->seqnum);
+
+            srtpAuthenticate(ctx, pcc, pkts[i], length, (uint32_t)(index >> 16), mac);
+            if (pj_memcmp(pkts[i] + length + mkiLength, mac, tagLength) != 0) {
+                results[i] = -1;
+                continue;
+            }
+            srtpEncrypt(ctx, pcc, pkts[i], st->payload, st->payloadlen, index, st->ssrc);
+            stream->update(st->seqnum);
+            if (isNew)
+                ctx->streams->insert(st->ssrc);
+
+            newLens[i] = length;
+            results[i] = 1;
+            done++;
+        }
+    }
+    return done;
+}
+
+int32_t zsrtp_unprotect_prepare(ZsrtpContext* ctx, pj_uint8_t* pkts[],
+                                const int32_t lens[], int32_t n,
+                                ZsrtpUnprotectJob jobs[])
+{
+    const pjmedia_rtp_hdr *hdr;
+    uint8_t* payload;
+    int32_t trailer;
+    int32_t todo = 0;
+    bool isNew;
+
+    // CryptoContext keeps per call state in its crypto objects, only the
+    // wrapper's transforms can run on several threads
+    if (ctx->aead != NULL) {
+        trailer = ctx->aead->getTagLength();
+    }
+    else if (ctx->srtp != NULL && ctx->mac != NULL &&
+             (ctx->cipher != NULL || ctx->twofish != NULL)) {
+        trailer = ctx->srtp->getTagLength() + ctx->srtp->getMkiLength();
+    }
+    else {
+        return -1;
+    }
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect_prepare");
+
+    for (int32_t i = 0; i < n; i++) {
+        ZsrtpUnprotectJob* job = &jobs[i];
+
+        job->pkt = pkts[i];
+        job->length = -1;               /* not a valid SRTP packet */
+        job->result = -1;
+        if (lens[i] < trailer ||
+            zsrtp_decode_rtp(pkts[i], lens[i] - trailer, &hdr, &payload,
+                             &job->payloadlen) != PJ_SUCCESS) {
+            continue;
+        }
+        job->length = lens[i] - trailer;
+        job->payload = (int32_t)(payload - pkts[i]);
+        job->seqnum = ntohs(hdr->seq);
+        job->ssrc = ntohl(hdr->ssrc);
+
+        SrtpIndexState* stream = streamState(ctx, job->ssrc, &isNew);
+        if (!stream->checkReplay(job->seqnum)) {
+            job->result = -2;
+            continue;
+        }
+        job->index = stream->guessIndex(job->seqnum);
+        job->result = 0;
+        todo++;
+    }
+    return todo;
+}
+
+void zsrtp_unprotect_run(ZsrtpContext* ctx, ZsrtpUnprotectJob* job)
+{
+    uint8_t mac[64];
+
+    if (job->result != 0)
+        return;
+
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect_run");
+
+    if (ctx->aead != NULL) {
+        job->result = ctx->aead->openRtp(job->pkt, job->payload, job->length, job->ssrc,
+                                         (uint32_t)(job->index >> 16), job->seqnum) ? 1 : -1;
+        return;
+    }
+    CryptoContext* pcc = ctx->srtp;
+    int32_t tagLength = pcc->getTagLength();
+
+    srtpAuthenticate(ctx, pcc, job->pkt, job->length, (uint32_t)(job->index >> 16), mac);
+    if (pj_memcmp(job->pkt + job->length + pcc->getMkiLength(), mac, tagLength) != 0) {
+        job->result = -1;
+        return;
+    }
+    srtpEncrypt(ctx, pcc, job->pkt, job->pkt + job->payload, job->payloadlen,
+                job->index, job->ssrc);
+    job->result = 1;
+}
+
+int32_t zsrtp_unprotect_commit(ZsrtpContext* ctx, ZsrtpUnprotectJob jobs[], int32_t n,
+                               int32_t newLens[], int32_t results[])
+{
+    int32_t done = 0;
+    bool isNew;
+
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotect_commit");
+
+    for (int32_t i = 0; i < n; i++) {
+        ZsrtpUnprotectJob* job = &jobs[i];
+
+        newLens[i] = 0;
+        results[i] = job->result;
+        if (job->result == -2 || job->length < 0) {
+            continue;
+        }
+        // An earlier packet of this burst may have used the same sequence
+        // number, added the stream or moved the ROC estimate
+        SrtpIndexState* stream = streamState(ctx, job->ssrc, &isNew);
+        if (!stream->checkReplay(job->seqnum)) {
+            results[i] = -2;
+            continue;
+        }
+        int64_t index = stream->guessIndex(job->seqnum);
+        if (index != job->index) {
+            // A packet that authenticated with the other ROC does not fit
+            // the state, a packet that failed gets a second chance. Not
+            // with AEAD: GCM decrypted the packet in place before it
+            // checked the tag, the ciphertext is gone.
+            if (job->result == 1 || ctx->aead != NULL) {
+                results[i] = -1;
+                continue;
+            }
+            job->index = index;
+            job->result = 0;
+            zsrtp_unprotect_run(ctx, job);
+            results[i] = job->result;
+        }
+        if (results[i] != 1) {
+            continue;
+        }
+        stream->update(job->seqnum);
+        if (isNew)
+            ctx->streams->insert(job->ssrc);
+
+        newLens[i] = job->length;
+        done++;
+    }
+    return done;
+}
+
 void zsrtp_newCryptoContextForSSRC(ZsrtpContext* ctx, uint32_t ssrc,
                                    int32_t roc, int64_t keyDerivRate)
 {
-    CryptoContext* newCrypto = ctx->srtp->newCryptoContextForSSRC(ssrc, 0, 0L);
-    ctx->srtp = newCrypto;
+    // The AEAD transform takes the SSRC from the packet, nothing to clone
+    if (ctx->aead == NULL) {
+        CryptoContext* newCrypto = ctx->srtp->newCryptoContextForSSRC(ssrc, roc, keyDerivRate);
+        delete ctx->srtp;
+        ctx->srtp = newCrypto;
+    }
+
+    // The new stream starts with the given ROC and an empty replay window,
+    // the window keeps its size. The stream table keeps its streams.
+    ctx->index->reset();
+    ctx->index->setRoc((uint32_t)roc);
 }
 
 void zsrtp_deriveSrtpKeys(ZsrtpContext* ctx, uint64_t index)
 {
+    if (ctx->aead != NULL) {
+        ctx->aead->deriveKeys();
+        return;
+    }
     ctx->srtp->deriveSrtpKeys(index);
+    if (ctx->mac != NULL)
+        ctx->mac->deriveKeys();
+    if (ctx->cipher != NULL)
+        ctx->cipher->deriveKeys();
+    if (ctx->twofish != NULL)
+        ctx->twofish->deriveKeys();
+}
+
+int32_t zsrtp_setReplayWindow(ZsrtpContext* ctx, int32_t size)
+{
+    if (size < ZSRTP_REPLAY_WINDOW_MIN || size > ZSRTP_REPLAY_WINDOW_MAX)
+        return 0;
+    return ctx->index->setReplayWindow(size) ? 1 : 0;
+}
+
+int32_t zsrtp_enableStreamTable(ZsrtpContext* ctx, int32_t maxStreams)
+{
+    if (maxStreams < 1 || maxStreams > 64 || ctx->streams != NULL)
+        return 0;
+    ctx->streams = new SrtpStreamTable(maxStreams, ctx->index->getReplayWindow());
+    return 1;
+}
+
+int32_t zsrtp_enableKeystreamCache(ZsrtpContext* ctx, int32_t packets, int32_t maxLength)
+{
+    if (ctx->cipher == NULL)
+        return 0;
+    return ctx->cipher->enableCache(packets, maxLength) ? 1 : 0;
+}
+
+int32_t zsrtp_precomputeKeystream(ZsrtpContext* ctx)
+{
+    if (ctx->cipher == NULL)
+        return 0;
+    return ctx->cipher->precompute();
 }
 
 
@@ -250,10 +850,34 @@ ZsrtpContextCtrl* zsrtp_CreateWrapperCtrl( uint32_t ssrc,
                                            int32_t  tagLength )
 {
     ZsrtpContextCtrl* zc = new ZsrtpContextCtrl;
+    zc->srtcp = NULL;
+    zc->aead = NULL;
+    zc->replay = NULL;
+    zc->mac = NULL;
+    zc->cipher = NULL;
+    zc->twofish = NULL;
+    zc->streams = NULL;
+    zc->srtcpIndex = 0;
+
+    if (ealg == SrtpEncryptionAESGCM) {
+        zc->aead = new SrtpAeadGcm(masterKey, masterKeyLength, masterSalt,
+                                   masterSaltLength, true);
+        zc->replay = new SrtpReplayWindow();
+        return zc;
+    }
     zc->srtcp = new CryptoContextCtrl(ssrc, ealg, aalg, masterKey, masterKeyLength, masterSalt,
                                       masterSaltLength, ekeyl, akeyl, skeyl, tagLength );
-    
-    zc->srtcpIndex = 0;
+    zc->replay = new SrtpReplayWindow();
+    zc->mac = newMac(ealg, aalg, masterKey, masterKeyLength, masterSalt,
+                     masterSaltLength, akeyl, tagLength, true);
+    if (ealg == SrtpEncryptionAESCM) {
+        zc->cipher = new SrtpAesCm(masterKey, masterKeyLength, masterSalt,
+                                   masterSaltLength, true);
+    }
+    if (ealg == SrtpEncryptionTWOCM) {
+        zc->twofish = new SrtpTwofishCm(masterKey, masterKeyLength, masterSalt,
+                                        masterSaltLength, true);
+    }
     return zc;
 }
 
@@ -265,25 +889,158 @@ void zsrtp_DestroyWrapperCtrl (ZsrtpContextCtrl* ctx)
 
     delete ctx->srtcp;
     ctx->srtcp = NULL;
+    delete ctx->aead;
+    ctx->aead = NULL;
+    delete ctx->replay;
+    ctx->replay = NULL;
+    delete ctx->mac;
+    ctx->mac = NULL;
+    delete ctx->cipher;
+    ctx->cipher = NULL;
+    delete ctx->twofish;
+    ctx->twofish = NULL;
+    delete ctx->streams;
+    ctx->streams = NULL;
 
     delete ctx;
 }
 
+/*
+ * Encrypt or decrypt the SRTCP packet after the fixed header, prefer the
+ * wrapper's counter mode implementations.
+ */
+static inline void srtcpEncrypt(ZsrtpContextCtrl* ctx, CryptoContextCtrl* pcc, uint8_t* data,
+                                int32_t length, uint32_t index, uint32_t ssrc)
+{
+    if (ctx->cipher != NULL)
+        ctx->cipher->crypt(data, length, index, ssrc);
+    else if (ctx->twofish != NULL)
+        ctx->twofish->crypt(data, length, index, ssrc);
+    else
+        pcc->srtcpEncrypt(data, length, index, ssrc);
+}
+
+/*
+ * Compute the SRTCP authentication tag, prefer the pre-keyed MAC state.
+ */
+static inline void srtcpAuthenticate(ZsrtpContextCtrl* ctx, CryptoContextCtrl* pcc, uint8_t* pkt,
+                                     int32_t length, uint32_t encIndex, uint8_t* tag)
+{
+    if (ctx->mac != NULL)
+        ctx->mac->authenticate(pkt, length, encIndex, tag);
+    else
+        pcc->srtcpAuthenticate(pkt, length, encIndex, tag);
+}
+
+/*
+ * Find the replay state of the stream that sent a SRTCP packet, see
+ * streamState().
+ */
+static inline SrtpReplayWindow* streamStateCtrl(ZsrtpContextCtrl* ctx, uint32_t ssrc, bool* isNew)
+{
+    *isNew = false;
+    if (ctx->streams == NULL)
+        return ctx->replay;
+
+    SrtpReplayWindow* state = ctx->streams->lookup(ssrc);
+    if (state == NULL) {
+        *isNew = true;
+        state = ctx->streams->spare(ssrc);
+    }
+    return state;
+}
+
+/*
+ * Return the next SRTCP index of a sender. Several threads may send, thus
+ * the counter is incremented atomically. It wraps at 2^32, a multiple of
+ * the 2^31 SRTCP index range.
+ */
+static inline uint32_t nextSrtcpIndex(ZsrtpContextCtrl* ctx)
+{
+#ifdef _MSC_VER
+    uint32_t index = (uint32_t)InterlockedExchangeAdd((volatile LONG*)&ctx->srtcpIndex, 1);
+#else
+    uint32_t index = __atomic_fetch_add(&ctx->srtcpIndex, 1, __ATOMIC_RELAXED);
+#endif
+    return index & ~0x80000000;
+}
+
+/*
+ * SRTCP with the AEAD transform, the index word follows the tag.
+ */
+static int32_t aeadProtectCtrl(ZsrtpContextCtrl* ctx, uint8_t* buffer, int32_t length,
+                               int32_t* newLength)
+{
+    ZSRTP_ALLOC_GUARD("zsrtp_protectCtrl");
+
+    if (length < 8) {
+        return 0;
+    }
+    uint32_t ssrc = *(reinterpret_cast<uint32_t*>(buffer + 4)); // always SSRC of sender
+    ssrc = ntohl(ssrc);
+
+    if (!ctx->aead->sealRtcp(buffer, length, ssrc, nextSrtcpIndex(ctx))) {
+        return 0;
+    }
+    *newLength = length + ctx->aead->getTagLength() + sizeof(uint32_t);
+
+    return 1;
+}
+
+static int32_t aeadUnprotectCtrl(ZsrtpContextCtrl* ctx, uint8_t* buffer, int32_t length,
+                                 int32_t* newLength)
+{
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotectCtrl");
+
+    int32_t payloadLen = length - (ctx->aead->getTagLength() + 4);
+    if (payloadLen < 8) {
+        return -1;
+    }
+    *newLength = payloadLen;
+
+    // the SRTCP index field is the last word of the packet
+    const uint32_t* index = reinterpret_cast<uint32_t*>(buffer + length - 4);
+    uint32_t encIndex = ntohl(*index);
+    uint32_t remoteIndex = encIndex & ~0x80000000;    // index without Encryption flag
+
+    uint32_t ssrc = *(reinterpret_cast<uint32_t*>(buffer + 4)); // always SSRC of sender
+    ssrc = ntohl(ssrc);
+
+    bool isNew;
+    SrtpReplayWindow* replay = streamStateCtrl(ctx, ssrc, &isNew);
+    if (!replay->check(remoteIndex)) {
+        return -2;
+    }
+    if (!ctx->aead->openRtcp(buffer, payloadLen, ssrc, encIndex)) {
+        return -1;
+    }
+    replay->update(remoteIndex);
+    if (isNew)
+        ctx->streams->insert(ssrc);
+
+    return 1;
+}
+
 int32_t zsrtp_protectCtrl(ZsrtpContextCtrl* ctx, pj_uint8_t* buffer, int32_t length,
                       int32_t* newLength)
 {
     CryptoContextCtrl* pcc = ctx->srtcp;
 
+    if (ctx->aead != NULL) {
+        return aeadProtectCtrl(ctx, buffer, length, newLength);
+    }
     if (pcc == NULL) {
         return 0;
     }
+    ZSRTP_ALLOC_GUARD("zsrtp_protectCtrl");
     /* Encrypt the packet */
     uint32_t ssrc = *(reinterpret_cast<uint32_t*>(buffer + 4)); // always SSRC of sender
     ssrc = ntohl(ssrc);
 
-    pcc->srtcpEncrypt(buffer + 8, length - 8, ctx->srtcpIndex, ssrc);
+    uint32_t srtcpIndex = nextSrtcpIndex(ctx);
+    srtcpEncrypt(ctx, pcc, buffer + 8, length - 8, srtcpIndex, ssrc);
 
-    uint32_t encIndex = ctx->srtcpIndex | 0x80000000;  // set the E flag
+    uint32_t encIndex = srtcpIndex | 0x80000000;  // set the E flag
 
     // Fill SRTCP index as last word
     uint32_t* ip = reinterpret_cast<uint32_t*>(buffer+length);
@@ -293,23 +1050,34 @@ int32_t zsrtp_protectCtrl(ZsrtpContextCtrl* ctx, pj_uint8_t* buffer, int32_t len
     // take MKI length into account when storing the authentication tag.
 
     // Compute MAC and store in packet after the SRTCP index field
-    pcc->srtcpAuthenticate(buffer, length, encIndex, buffer + length + sizeof(uint32_t));
+    srtcpAuthenticate(ctx, pcc, buffer, length, encIndex, buffer + length + sizeof(uint32_t));
 
-    ctx->srtcpIndex++;
-    ctx->srtcpIndex &= ~0x80000000;       // clear possible overflow
     *newLength = length + pcc->getTagLength() + sizeof(uint32_t);
     
     return 1;
 }
 
+int32_t zsrtp_getTrailerLengthCtrl(ZsrtpContextCtrl* ctx)
+{
+    if (ctx->aead != NULL)
+        return ctx->aead->getTagLength() + sizeof(uint32_t);
+    if (ctx->srtcp == NULL)
+        return 0;
+    return ctx->srtcp->getTagLength() + ctx->srtcp->getMkiLength() + sizeof(uint32_t);
+}
+
 int32_t zsrtp_unprotectCtrl(ZsrtpContextCtrl* ctx, pj_uint8_t* buffer, int32_t length,
                             int32_t* newLength)
 {
     CryptoContextCtrl* pcc = ctx->srtcp;
 
+    if (ctx->aead != NULL) {
+        return aeadUnprotectCtrl(ctx, buffer, length, newLength);
+    }
     if (pcc == NULL) {
         return 0;
     }
+    ZSRTP_ALLOC_GUARD("zsrtp_unprotectCtrl");
 
     // Compute the total length of the payload
     int32_t payloadLen = length - (pcc->getTagLength() + pcc->getMkiLength() + 4);
@@ -321,44 +1089,80 @@ int32_t zsrtp_unprotectCtrl(ZsrtpContextCtrl* ctx, pj_uint8_t* buffer, int32_t l
     uint32_t encIndex = ntohl(*index);
     uint32_t remoteIndex = encIndex & ~0x80000000;    // index without Encryption flag
     
-    if (!pcc->checkReplay(remoteIndex)) {
+    uint32_t ssrc = *(reinterpret_cast<uint32_t*>(buffer + 4)); // always SSRC of sender
+    ssrc = ntohl(ssrc);
+
+    bool isNew;
+    SrtpReplayWindow* replay = streamStateCtrl(ctx, ssrc, &isNew);
+    if (!replay->check(remoteIndex)) {
        return -2;
     }
     
-    uint8_t mac[20];
+    uint8_t mac[64];
 
     // Now get a pointer to the authentication tag field
     const uint8_t* tag = buffer + (length - pcc->getTagLength());
     
     // Authenticate includes the index, but not MKI and not (obviously) the tag itself
-    pcc->srtcpAuthenticate(buffer, payloadLen, encIndex, mac);
+    srtcpAuthenticate(ctx, pcc, buffer, payloadLen, encIndex, mac);
     if (memcmp(tag, mac, pcc->getTagLength()) != 0) {
         return -1;
     }
 
-    uint32_t ssrc = *(reinterpret_cast<uint32_t*>(buffer + 4)); // always SSRC of sender
-    ssrc = ntohl(ssrc);
-
     // Decrypt the content, exclude the very first SRTCP header (fixed, 8 bytes)
     if (encIndex & 0x80000000)
-        pcc->srtcpEncrypt(buffer + 8, payloadLen - 8, remoteIndex, ssrc);
+        srtcpEncrypt(ctx, pcc, buffer + 8, payloadLen - 8, remoteIndex, ssrc);
 
-    // Update the Crypto-context
-    pcc->update(remoteIndex);
+    // Update the replay window
+    replay->update(remoteIndex);
+    if (isNew)
+        ctx->streams->insert(ssrc);
 
     return 1;
 }
 
 void zsrtp_newCryptoContextForSSRCCtrl(ZsrtpContextCtrl* ctx, uint32_t ssrc)
 {
+    if (ctx->aead != NULL)
+        return;
     CryptoContextCtrl* newCrypto = ctx->srtcp->newCryptoContextForSSRC(ssrc);
+    delete ctx->srtcp;
     ctx->srtcp = newCrypto;
+
+    ctx->replay->reset();
 }
 
 void zsrtp_deriveSrtpKeysCtrl(ZsrtpContextCtrl* ctx)
 {
+    if (ctx->aead != NULL) {
+        ctx->aead->deriveKeys();
+        return;
+    }
     ctx->srtcp->deriveSrtcpKeys();
+    if (ctx->mac != NULL)
+        ctx->mac->deriveKeys();
+    if (ctx->cipher != NULL)
+        ctx->cipher->deriveKeys();
+    if (ctx->twofish != NULL)
+        ctx->twofish->deriveKeys();
 }
 
+int32_t zsrtp_setReplayWindowCtrl(ZsrtpContextCtrl* ctx, int32_t size)
+{
+    if (size < ZSRTP_REPLAY_WINDOW_MIN || size > ZSRTP_REPLAY_WINDOW_MAX)
+        return 0;
+    return ctx->replay->setSize(size) ? 1 : 0;
+}
 
+int32_t zsrtp_enableStreamTableCtrl(ZsrtpContextCtrl* ctx, int32_t maxStreams)
+{
+    if (maxStreams < 1 || maxStreams > 64 || ctx->streams != NULL)
+        return 0;
+    ctx->streams = new SrtpCtrlStreamTable(maxStreams, ctx->replay->getSize());
+    return 1;
+}
 
+int32_t zsrtp_setConcurrency(int32_t threads)
+{
+    return SrtpEvpPool::setConcurrency(threads) ? 1 : 0;
+}
@@ -0,0 +1,327 @@
+/*
+    This file implements the Skein-512 MAC of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+#include "ZsrtpSkein.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZSRTP_SKEIN_AVX2
+#include <immintrin.h>
+#endif
+
+/* UBI block types */
+#define SKEIN_TYPE_KEY  0
+#define SKEIN_TYPE_CFG  4
+#define SKEIN_TYPE_MSG  48
+#define SKEIN_TYPE_OUT  63
+
+#define SKEIN_FLAG_FIRST    ((uint64_t)1 << 62)
+#define SKEIN_FLAG_FINAL    ((uint64_t)1 << 63)
+
+#define SKEIN_KS_PARITY     0x1BD11BDAA9FC1A22ULL
+
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/* Threefish-512 rotation constants, the rounds repeat them every 8 rounds */
+static const int rot[8][4] = {
+    { 46, 36, 19, 37 },
+    { 33, 27, 14, 42 },
+    { 17, 49, 36, 39 },
+    { 44,  9, 54, 56 },
+    { 39, 30, 34, 24 },
+    { 13, 50, 10, 17 },
+    { 25, 29, 39, 43 },
+    {  8, 35, 56, 22 }
+};
+
+/* Word permutation after each round: 2, 1, 4, 7, 6, 5, 0, 3 */
+
+static inline uint64_t loadLe64(const uint8_t* p)
+{
+    uint64_t v = 0;
+
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void storeLe64(uint8_t* p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8)
+        p[i] = (uint8_t)v;
+}
+
+/*
+ * The key schedule words, ks[8] is the parity word
+ */
+static inline void keySchedule(const uint64_t key[8], const uint64_t tweak[2],
+                               uint64_t ks[9], uint64_t ts[3])
+{
+    ks[8] = SKEIN_KS_PARITY;
+    for (int i = 0; i < 8; i++) {
+        ks[i] = key[i];
+        ks[8] ^= key[i];
+    }
+    ts[0] = tweak[0];
+    ts[1] = tweak[1];
+    ts[2] = tweak[0] ^ tweak[1];
+}
+
+static inline void subkey(const uint64_t ks[9], const uint64_t ts[3], int s, uint64_t k[8])
+{
+    for (int i = 0; i < 8; i++)
+        k[i] = ks[(s + i) % 9];
+    k[5] += ts[s % 3];
+    k[6] += ts[(s + 1) % 3];
+    k[7] += s;
+}
+
+/*
+ * The permutation has order 4. The scalar code renames the words instead
+ * of moving them, after four rounds they are in their original places.
+ */
+#define MIX(a, b, r) \
+    v[a] += v[b]; \
+    v[b] = ROL64(v[b], r) ^ v[a];
+
+#define FOUR_ROUNDS(R) \
+    MIX(0, 1, R[0][0]) MIX(2, 3, R[0][1]) MIX(4, 5, R[0][2]) MIX(6, 7, R[0][3]) \
+    MIX(2, 1, R[1][0]) MIX(4, 7, R[1][1]) MIX(6, 5, R[1][2]) MIX(0, 3, R[1][3]) \
+    MIX(4, 1, R[2][0]) MIX(6, 3, R[2][1]) MIX(0, 5, R[2][2]) MIX(2, 7, R[2][3]) \
+    MIX(6, 1, R[3][0]) MIX(0, 7, R[3][1]) MIX(2, 5, R[3][2]) MIX(4, 3, R[3][3])
+
+static void threefishScalar(const uint64_t key[8], const uint64_t tweak[2],
+                            const uint64_t in[8], uint64_t out[8])
+{
+    uint64_t ks[9], ts[3], k[8], v[8];
+
+    keySchedule(key, tweak, ks, ts);
+    memcpy(v, in, sizeof(v));
+
+    for (int s = 0; s < 18; s += 2) {
+        subkey(ks, ts, s, k);
+        for (int i = 0; i < 8; i++)
+            v[i] += k[i];
+        FOUR_ROUNDS(rot)
+
+        subkey(ks, ts, s + 1, k);
+        for (int i = 0; i < 8; i++)
+            v[i] += k[i];
+        FOUR_ROUNDS((rot + 4))
+    }
+    subkey(ks, ts, 18, k);
+    for (int i = 0; i < 8; i++)
+        out[i] = v[i] + k[i];
+}
+
+#ifdef ZSRTP_SKEIN_AVX2
+
+/*
+ * The AVX2 code keeps the even words in one vector and the odd words in
+ * another. The four MIX functions of a round then are one vector add, one
+ * variable rotate and one XOR, the word permutation is one lane permute
+ * per vector.
+ */
+__attribute__((target("avx2")))
+static void threefishAvx2(const uint64_t key[8], const uint64_t tweak[2],
+                          const uint64_t in[8], uint64_t out[8])
+{
+    uint64_t ks[9], ts[3], k[8];
+    __m256i rl[8], rr[8];
+
+    keySchedule(key, tweak, ks, ts);
+
+    for (int d = 0; d < 8; d++) {
+        rl[d] = _mm256_setr_epi64x(rot[d][0], rot[d][1], rot[d][2], rot[d][3]);
+        rr[d] = _mm256_sub_epi64(_mm256_set1_epi64x(64), rl[d]);
+    }
+    __m256i x = _mm256_setr_epi64x(in[0], in[2], in[4], in[6]);
+    __m256i y = _mm256_setr_epi64x(in[1], in[3], in[5], in[7]);
+
+    for (int d = 0; d < 72; d++) {
+        if ((d & 3) == 0) {
+            subkey(ks, ts, d / 4, k);
+            x = _mm256_add_epi64(x, _mm256_setr_epi64x(k[0], k[2], k[4], k[6]));
+            y = _mm256_add_epi64(y, _mm256_setr_epi64x(k[1], k[3], k[5], k[7]));
+        }
+        x = _mm256_add_epi64(x, y);
+        y = _mm256_or_si256(_mm256_sllv_epi64(y, rl[d & 7]), _mm256_srlv_epi64(y, rr[d & 7]));
+        y = _mm256_xor_si256(y, x);
+
+        // even words: 0 2 4 6 <- 2 4 6 0, odd words: 1 3 5 7 <- 1 7 5 3
+        x = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(0, 3, 2, 1));
+        y = _mm256_permute4x64_epi64(y, _MM_SHUFFLE(1, 2, 3, 0));
+    }
+    subkey(ks, ts, 18, k);
+    x = _mm256_add_epi64(x, _mm256_setr_epi64x(k[0], k[2], k[4], k[6]));
+    y = _mm256_add_epi64(y, _mm256_setr_epi64x(k[1], k[3], k[5], k[7]));
+
+    uint64_t e[4], o[4];
+    _mm256_storeu_si256((__m256i*)e, x);
+    _mm256_storeu_si256((__m256i*)o, y);
+    for (int i = 0; i < 4; i++) {
+        out[2 * i] = e[i];
+        out[2 * i + 1] = o[i];
+    }
+}
+
+static bool haveAvx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2") != 0;
+    return avx2;
+}
+#endif
+
+static inline void threefish512(const uint64_t key[8], const uint64_t tweak[2],
+                                const uint64_t in[8], uint64_t out[8])
+{
+#ifdef ZSRTP_SKEIN_AVX2
+    if (haveAvx2()) {
+        threefishAvx2(key, tweak, in, out);
+        return;
+    }
+#endif
+    threefishScalar(key, tweak, in, out);
+}
+
+/*
+ * Unique Block Iteration, the chaining value is the Threefish key
+ */
+typedef struct ubi
+{
+    uint64_t chain[8];
+    uint8_t buffer[64];
+    int32_t bufferLength;
+    uint64_t position;
+    uint64_t type;
+    bool first;
+} Ubi;
+
+static void ubiBlock(Ubi* u, bool final)
+{
+    uint64_t m[8], tweak[2];
+
+    for (int i = 0; i < 8; i++)
+        m[i] = loadLe64(u->buffer + 8 * i);
+
+    u->position += u->bufferLength;
+    tweak[0] = u->position;
+    tweak[1] = (u->type << 56) | (u->first ? SKEIN_FLAG_FIRST : 0) | (final ? SKEIN_FLAG_FINAL : 0);
+
+    threefish512(u->chain, tweak, m, u->chain);
+    for (int i = 0; i < 8; i++)
+        u->chain[i] ^= m[i];
+
+    u->first = false;
+    u->bufferLength = 0;
+}
+
+static void ubiInit(Ubi* u, const uint64_t chain[8], int type)
+{
+    memcpy(u->chain, chain, sizeof(u->chain));
+    u->bufferLength = 0;
+    u->position = 0;
+    u->type = (uint64_t)type;
+    u->first = true;
+}
+
+static void ubiUpdate(Ubi* u, const uint8_t* data, int32_t length)
+{
+    while (length > 0) {
+        // Process a full block only if more data follows, the last block is final
+        if (u->bufferLength == 64)
+            ubiBlock(u, false);
+
+        int32_t n = 64 - u->bufferLength;
+        if (n > length)
+            n = length;
+        memcpy(u->buffer + u->bufferLength, data, n);
+        u->bufferLength += n;
+        data += n;
+        length -= n;
+    }
+}
+
+static void ubiFinal(Ubi* u, uint64_t chain[8])
+{
+    memset(u->buffer + u->bufferLength, 0, 64 - u->bufferLength);
+    ubiBlock(u, true);
+    memcpy(chain, u->chain, sizeof(u->chain));
+}
+
+bool zsrtpSkeinMacInit(const uint8_t* key, int32_t keyLength, int32_t macLength,
+                       ZsrtpSkeinMacKey* mkey)
+{
+    uint64_t chain[8];
+    uint8_t config[32];
+    Ubi u;
+
+    if (macLength < 1 || macLength > 64 || keyLength < 0)
+        return false;
+
+    memset(chain, 0, sizeof(chain));
+    if (keyLength > 0) {
+        ubiInit(&u, chain, SKEIN_TYPE_KEY);
+        ubiUpdate(&u, key, keyLength);
+        ubiFinal(&u, chain);
+    }
+
+    // Schema "SHA3", version 1, output length in bits, no tree hashing
+    memset(config, 0, sizeof(config));
+    config[0] = 'S';
+    config[1] = 'H';
+    config[2] = 'A';
+    config[3] = '3';
+    config[4] = 1;
+    storeLe64(config + 8, (uint64_t)macLength * 8);
+
+    ubiInit(&u, chain, SKEIN_TYPE_CFG);
+    ubiUpdate(&u, config, sizeof(config));
+    ubiFinal(&u, mkey->chain);
+    mkey->macLength = macLength;
+
+    memset(&u, 0, sizeof(u));
+    memset(chain, 0, sizeof(chain));
+    return true;
+}
+
+void zsrtpSkeinMac(const ZsrtpSkeinMacKey* mkey, const uint8_t* data, int32_t length,
+                   const uint8_t* trailer, int32_t trailerLength, uint8_t* mac)
+{
+    uint64_t chain[8];
+    uint8_t out[64];
+    uint8_t counter[8];
+    Ubi u;
+
+    ubiInit(&u, mkey->chain, SKEIN_TYPE_MSG);
+    ubiUpdate(&u, data, length);
+    if (trailer != NULL)
+        ubiUpdate(&u, trailer, trailerLength);
+    ubiFinal(&u, chain);
+
+    // Output transform with counter 0, one block covers up to 512 bits
+    memset(counter, 0, sizeof(counter));
+    ubiInit(&u, chain, SKEIN_TYPE_OUT);
+    ubiUpdate(&u, counter, sizeof(counter));
+    ubiFinal(&u, chain);
+
+    for (int i = 0; i < 8; i++)
+        storeLe64(out + 8 * i, chain[i]);
+    memcpy(mac, out, mkey->macLength);
+}
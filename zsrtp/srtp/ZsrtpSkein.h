@@ -0,0 +1,68 @@
+/*
+    This file defines the Skein-512 MAC of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPSKEIN_H
+#define ZSRTPSKEIN_H
+
+/*
+ * Skein-512 MAC, Skein specification version 1.3.
+ *
+ * The MAC key and the configuration block do not depend on the data. The
+ * key setup processes both once and keeps the resulting chaining value,
+ * a MAC computation then starts with the message blocks. The Threefish-512
+ * block function uses AVX2 if the CPU supports it.
+ */
+
+#include <stdint.h>
+
+typedef struct zsrtpSkeinMacKey
+{
+    uint64_t chain[8];      /* chaining value after key and config block */
+    int32_t macLength;      /* MAC length in bytes */
+} ZsrtpSkeinMacKey;
+
+/**
+ * Process the MAC key and the configuration block.
+ *
+ * @param key       the MAC key, a key length of 0 gives plain Skein-512
+ * @param keyLength length of the key in bytes
+ * @param macLength length of the MAC in bytes, 1 to 64
+ * @param mkey      receives the precomputed key state
+ * @return false if the MAC length is not supported.
+ */
+bool zsrtpSkeinMacInit(const uint8_t* key, int32_t keyLength, int32_t macLength,
+                       ZsrtpSkeinMacKey* mkey);
+
+/**
+ * Compute the MAC over data followed by a trailer.
+ *
+ * SRTP appends the ROC, SRTCP the E flag plus index to the packet data
+ * before computing the MAC. The trailer avoids copying the packet.
+ *
+ * @param mkey      the precomputed key state
+ * @param data      the data
+ * @param length    length of the data
+ * @param trailer   data that follows, may be NULL
+ * @param trailerLength length of the trailer, at most 64 bytes
+ * @param mac       receives the MAC, macLength bytes
+ */
+void zsrtpSkeinMac(const ZsrtpSkeinMacKey* mkey, const uint8_t* data, int32_t length,
+                   const uint8_t* trailer, int32_t trailerLength, uint8_t* mac);
+
+#endif
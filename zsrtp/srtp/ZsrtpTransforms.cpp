@@ -0,0 +1,1306 @@
+/*
+    This file implements the SRTP transforms that the ZRTP SRTP wrapper
+    implements itself.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* HMAC-SHA1 uses the low level SHA-1 functions, they work on a plain
+   struct that can be copied without allocating memory */
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <string.h>
+#include <thread>
+#include <openssl/crypto.h>
+#include "ZsrtpTransforms.h"
+
+static const EVP_CIPHER* aesCtrCipher(int32_t keyLength)
+{
+    switch (keyLength) {
+    case 16:
+        return EVP_aes_128_ctr();
+    case 24:
+        return EVP_aes_192_ctr();
+    case 32:
+        return EVP_aes_256_ctr();
+    }
+    return NULL;
+}
+
+static const EVP_CIPHER* aesGcmCipher(int32_t keyLength)
+{
+    switch (keyLength) {
+    case 16:
+        return EVP_aes_128_gcm();
+    case 24:
+        return EVP_aes_192_gcm();
+    case 32:
+        return EVP_aes_256_gcm();
+    }
+    return NULL;
+}
+
+static inline void storeBe32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/*
+ * Counter mode IV, RFC 3711 chapter 4.1.1:
+ * IV = (salt * 2^16) XOR (SSRC * 2^64) XOR (index * 2^16)
+ */
+static void counterIv(uint8_t* iv, const uint8_t* salt, uint64_t index, uint32_t ssrc)
+{
+    memcpy(iv, salt, 14);
+    iv[14] = iv[15] = 0;
+
+    iv[4] ^= (uint8_t)(ssrc >> 24);
+    iv[5] ^= (uint8_t)(ssrc >> 16);
+    iv[6] ^= (uint8_t)(ssrc >> 8);
+    iv[7] ^= (uint8_t)ssrc;
+
+    for (int i = 0; i < 6; i++)
+        iv[8 + i] ^= (uint8_t)(index >> (40 - 8 * i));
+}
+
+bool zsrtpDeriveKey(const uint8_t* masterKey, int32_t masterKeyLength,
+                    const uint8_t* masterSalt, uint8_t label,
+                    uint8_t* out, int32_t outLength)
+{
+    const EVP_CIPHER* cipher = aesCtrCipher(masterKeyLength);
+    uint8_t iv[16];
+    int outl;
+
+    if (cipher == NULL)
+        return false;
+
+    // x = key_id XOR master_salt, key_id = label || r with r = 0 because
+    // the key derivation rate is 0. The label is the 8th byte of the salt.
+    memcpy(iv, masterSalt, 14);
+    iv[7] ^= label;
+    iv[14] = iv[15] = 0;
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return false;
+
+    // The AES-CM key stream is the encrypted zero string
+    memset(out, 0, outLength);
+    bool ok = EVP_EncryptInit_ex(ctx, cipher, NULL, masterKey, iv) == 1 &&
+              EVP_EncryptUpdate(ctx, out, &outl, out, outLength) == 1;
+
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+bool zsrtpDeriveKeyTwofish(const uint8_t* masterKey, int32_t masterKeyLength,
+                           const uint8_t* masterSalt, uint8_t label,
+                           uint8_t* out, int32_t outLength)
+{
+    ZsrtpTwofishKey* key = new ZsrtpTwofishKey;
+    uint8_t iv[16];
+
+    bool ok = zsrtpTwofishPrepareKey(masterKey, masterKeyLength, key);
+    if (ok) {
+        memcpy(iv, masterSalt, 14);
+        iv[7] ^= label;
+        memset(out, 0, outLength);
+        zsrtpTwofishCtr(key, iv, out, outLength);
+    }
+    OPENSSL_cleanse(key, sizeof(*key));
+    delete key;
+    return ok;
+}
+
+static inline bool deriveKey(bool twofishPrf, const uint8_t* masterKey, int32_t masterKeyLength,
+                             const uint8_t* masterSalt, uint8_t label,
+                             uint8_t* out, int32_t outLength)
+{
+    if (twofishPrf)
+        return zsrtpDeriveKeyTwofish(masterKey, masterKeyLength, masterSalt, label, out, outLength);
+    return zsrtpDeriveKey(masterKey, masterKeyLength, masterSalt, label, out, outLength);
+}
+
+/*
+ * Replay window
+ */
+SrtpReplayWindow::SrtpReplayWindow(int32_t size) :
+    words(NULL), bitMask(0), size(0), highest(0), initialized(false)
+{
+    if (!setSize(size))
+        setSize(64);
+}
+
+SrtpReplayWindow::~SrtpReplayWindow()
+{
+    delete[] words;
+}
+
+bool SrtpReplayWindow::setSize(int32_t newSize)
+{
+    if (newSize < 64)
+        return false;
+
+    // The ring needs one spare word: the word of the highest index is
+    // only partly inside the window.
+    uint64_t wordCount = 1;
+    while (wordCount < (uint64_t)(newSize + 63) / 64 + 1)
+        wordCount <<= 1;
+
+    uint64_t* newWords = new uint64_t[wordCount];
+    memset(newWords, 0, wordCount * sizeof(uint64_t));
+
+    uint64_t* oldWords = words;
+    uint64_t oldMask = bitMask;
+    int32_t keep = (size < newSize) ? size : newSize;
+
+    words = newWords;
+    bitMask = wordCount * 64 - 1;
+
+    if (initialized) {
+        for (int32_t delta = 0; delta < keep && delta <= highest; delta++) {
+            uint64_t bit = (uint64_t)(highest - delta) & oldMask;
+            if ((oldWords[bit >> 6] >> (bit & 63)) & 1)
+                set(highest - delta);
+        }
+    }
+    size = newSize;
+    delete[] oldWords;
+    return true;
+}
+
+inline bool SrtpReplayWindow::isSet(int64_t index) const
+{
+    uint64_t bit = (uint64_t)index & bitMask;
+    return ((words[bit >> 6] >> (bit & 63)) & 1) != 0;
+}
+
+inline void SrtpReplayWindow::set(int64_t index)
+{
+    uint64_t bit = (uint64_t)index & bitMask;
+    words[bit >> 6] |= (uint64_t)1 << (bit & 63);
+}
+
+void SrtpReplayWindow::restore(int64_t index)
+{
+    if (index < 0) {
+        initialized = false;
+        return;
+    }
+    memset(words, 0xff, (bitMask + 1) / 8);
+    highest = index;
+    initialized = true;
+}
+
+bool SrtpReplayWindow::check(int64_t index) const
+{
+    if (index < 0)
+        return false;
+    if (!initialized || index > highest)
+        return true;
+
+    if (highest - index >= size)
+        return false;                           /* Packet too old */
+    return !isSet(index);                       /* Packet already received? */
+}
+
+void SrtpReplayWindow::update(int64_t index)
+{
+    if (!initialized) {
+        memset(words, 0, (bitMask + 1) / 8);
+        highest = index;
+        initialized = true;
+    }
+    else if (index > highest) {
+        // Clear the words the window moves into, at most the whole ring
+        uint64_t wordMask = bitMask >> 6;
+        uint64_t from = (uint64_t)highest >> 6;
+        uint64_t steps = ((uint64_t)index >> 6) - from;
+        if (steps > wordMask + 1)
+            steps = wordMask + 1;
+        for (uint64_t i = 1; i <= steps; i++)
+            words[(from + i) & wordMask] = 0;
+        highest = index;
+    }
+    else if (highest - index >= size) {
+        return;
+    }
+    set(index);
+}
+
+/*
+ * Packet index state
+ */
+SrtpIndexState::SrtpIndexState(uint32_t roc) : roc(roc), s_l(0), seqNumSet(false), sent(0)
+{
+}
+
+/*
+ * Index estimation of RFC 3711 appendix A relative to the highest index
+ */
+static inline int64_t estimateIndex(uint32_t roc, uint16_t s_l, uint16_t seq)
+{
+    int64_t guessedRoc = roc;
+
+    if (s_l < 32768) {
+        if ((int32_t)seq - (int32_t)s_l > 32768)
+            guessedRoc = (int64_t)roc - 1;
+    }
+    else {
+        if ((int32_t)s_l - 32768 > (int32_t)seq)
+            guessedRoc = (int64_t)roc + 1;
+    }
+    if (guessedRoc < 0)
+        return -1;
+    return (guessedRoc << 16) | seq;
+}
+
+int64_t SrtpIndexState::guessIndex(uint16_t seq) const
+{
+    if (!seqNumSet)
+        return ((int64_t)roc << 16) | seq;
+    return estimateIndex(roc, s_l, seq);
+}
+
+uint64_t SrtpIndexState::sendIndex(uint16_t seq)
+{
+    uint64_t current = sent.load(std::memory_order_relaxed);
+    int64_t index;
+
+    do {
+        if (current == 0) {
+            index = ((int64_t)roc << 16) | seq;
+        }
+        else {
+            uint64_t highest = current - 1;
+            index = estimateIndex((uint32_t)(highest >> 16), (uint16_t)highest, seq);
+            if (index < 0)
+                index = seq;
+            if ((uint64_t)index <= highest)
+                break;                  /* an older packet, nothing to record */
+        }
+    } while (!sent.compare_exchange_weak(current, (uint64_t)index + 1, std::memory_order_relaxed));
+
+    return (uint64_t)index;
+}
+
+bool SrtpIndexState::checkReplay(uint16_t seq) const
+{
+    return replay.check(guessIndex(seq));
+}
+
+void SrtpIndexState::update(uint16_t seq)
+{
+    int64_t index = guessIndex(seq);
+
+    replay.update(index);
+    if (!seqNumSet || index > ((((int64_t)roc) << 16) | s_l)) {
+        roc = (uint32_t)(index >> 16);
+        s_l = seq;
+        seqNumSet = true;
+    }
+}
+
+void SrtpIndexState::reset()
+{
+    roc = 0;
+    s_l = 0;
+    seqNumSet = false;
+    replay.reset();
+    sent.store(0, std::memory_order_relaxed);
+}
+
+int64_t SrtpIndexState::getHighest() const
+{
+    return seqNumSet ? ((((int64_t)roc) << 16) | s_l) : -1;
+}
+
+void SrtpIndexState::restore(int64_t index)
+{
+    reset();
+    if (index < 0)
+        return;
+    roc = (uint32_t)(index >> 16);
+    s_l = (uint16_t)index;
+    seqNumSet = true;
+    replay.restore(index);
+}
+
+/*
+ * Stream table
+ */
+static inline void setWindow(SrtpIndexState* state, int32_t window)
+{
+    state->setReplayWindow(window);
+}
+
+static inline void setWindow(SrtpReplayWindow* state, int32_t window)
+{
+    state->setSize(window);
+}
+
+template <class State>
+SrtpSsrcTable<State>::SrtpSsrcTable(int32_t streams, int32_t window) :
+    useCounter(0), spareState(0), maxStreams(streams), count(0)
+{
+    if (maxStreams < 1)
+        maxStreams = 1;
+    if (maxStreams > 64)
+        maxStreams = 64;
+
+    uint32_t slotCount = 2;
+    while (slotCount < 2 * (uint32_t)maxStreams)
+        slotCount <<= 1;
+    slotMask = slotCount - 1;
+
+    slots = new Slot[slotCount];
+    for (uint32_t i = 0; i < slotCount; i++) {
+        slots[i].ssrc = 0;
+        slots[i].state = -1;
+    }
+    states = new State*[maxStreams + 1];
+    lastUse = new uint64_t[maxStreams + 1];
+    for (int32_t i = 0; i <= maxStreams; i++) {
+        states[i] = new State();
+        setWindow(states[i], window);
+        lastUse[i] = 0;
+    }
+    history = new Evicted[HistorySize];
+    for (int32_t i = 0; i < HistorySize; i++) {
+        history[i].ssrc = 0;
+        history[i].highest = -1;
+        history[i].when = 0;
+    }
+}
+
+template <class State>
+SrtpSsrcTable<State>::~SrtpSsrcTable()
+{
+    for (int32_t i = 0; i <= maxStreams; i++)
+        delete states[i];
+    delete[] states;
+    delete[] lastUse;
+    delete[] slots;
+    delete[] history;
+}
+
+template <class State>
+inline uint32_t SrtpSsrcTable<State>::slotOf(uint32_t ssrc) const
+{
+    // SSRCs are random, the multiplication spreads sequential test values
+    return ((ssrc * 0x9E3779B1u) >> 16) & slotMask;
+}
+
+template <class State>
+State* SrtpSsrcTable<State>::lookup(uint32_t ssrc)
+{
+    for (uint32_t i = slotOf(ssrc); slots[i].state >= 0; i = (i + 1) & slotMask) {
+        if (slots[i].ssrc == ssrc) {
+            lastUse[slots[i].state] = ++useCounter;
+            return states[slots[i].state];
+        }
+    }
+    return NULL;
+}
+
+template <class State>
+int32_t SrtpSsrcTable<State>::findEvicted(uint32_t ssrc) const
+{
+    for (int32_t i = 0; i < HistorySize; i++) {
+        if (history[i].highest >= 0 && history[i].ssrc == ssrc)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Use an empty entry, else drop the stream that was idle the longest. A
+ * SSRC has one entry at most, insert() clears it when the stream is back.
+ */
+template <class State>
+void SrtpSsrcTable<State>::addEvicted(uint32_t ssrc, int64_t highest, uint64_t when)
+{
+    int32_t e = 0;
+
+    for (int32_t i = 1; i < HistorySize && history[e].highest >= 0; i++) {
+        if (history[i].highest < 0 || history[i].when < history[e].when)
+            e = i;
+    }
+    history[e].ssrc = ssrc;
+    history[e].highest = highest;
+    history[e].when = when;
+}
+
+template <class State>
+State* SrtpSsrcTable<State>::spare(uint32_t ssrc)
+{
+    int32_t e = findEvicted(ssrc);
+
+    if (e < 0)
+        states[spareState]->reset();
+    else
+        states[spareState]->restore(history[e].highest);
+    return states[spareState];
+}
+
+/*
+ * Linear probing deletion: move later entries of the probe sequence back
+ * into the gap, no tombstones needed.
+ */
+template <class State>
+void SrtpSsrcTable<State>::remove(uint32_t slot)
+{
+    uint32_t gap = slot;
+
+    slots[gap].state = -1;
+    for (uint32_t i = (gap + 1) & slotMask; slots[i].state >= 0; i = (i + 1) & slotMask) {
+        uint32_t home = slotOf(slots[i].ssrc);
+
+        // Move the entry if its home slot is not in the range (gap, i]
+        if (((i - home) & slotMask) >= ((i - gap) & slotMask)) {
+            slots[gap] = slots[i];
+            slots[i].state = -1;
+            gap = i;
+        }
+    }
+    count--;
+}
+
+template <class State>
+void SrtpSsrcTable<State>::insert(uint32_t ssrc)
+{
+    int32_t newState = spareState;
+
+    if (lookup(ssrc) != NULL)
+        return;
+
+    if (count == maxStreams) {
+        uint32_t victim = 0;
+        uint64_t oldest = ~(uint64_t)0;
+
+        for (uint32_t i = 0; i <= slotMask; i++) {
+            if (slots[i].state >= 0 && lastUse[slots[i].state] < oldest) {
+                oldest = lastUse[slots[i].state];
+                victim = i;
+            }
+        }
+        spareState = slots[victim].state;
+
+        int64_t highest = states[spareState]->getHighest();
+        if (highest >= 0)
+            addEvicted(slots[victim].ssrc, highest, oldest);
+        remove(victim);
+    }
+    else {
+        // The states of a table that is not full are 0 to count, count is
+        // the spare until it is used
+        spareState = count + 1;
+    }
+
+    // The stream is back, its state is in the table again
+    int32_t e = findEvicted(ssrc);
+    if (e >= 0)
+        history[e].highest = -1;
+
+    uint32_t i = slotOf(ssrc);
+    while (slots[i].state >= 0)
+        i = (i + 1) & slotMask;
+    slots[i].ssrc = ssrc;
+    slots[i].state = newState;
+    lastUse[newState] = ++useCounter;
+    count++;
+}
+
+template class SrtpSsrcTable<SrtpIndexState>;
+template class SrtpSsrcTable<SrtpReplayWindow>;
+
+/*
+ * EVP context pool
+ */
+static std::atomic<int32_t> evpConcurrency(SrtpEvpPool::DefaultConcurrency);
+
+bool SrtpEvpPool::setConcurrency(int32_t threads)
+{
+    if (threads < 1 || threads > MaxConcurrency)
+        return false;
+    evpConcurrency.store(threads, std::memory_order_relaxed);
+    return true;
+}
+
+int32_t SrtpEvpPool::getConcurrency()
+{
+    return evpConcurrency.load(std::memory_order_relaxed);
+}
+
+SrtpEvpPool::SrtpEvpPool() : keyed(NULL), ctxs(NULL), busy(NULL), slots(0), threadCopies(NULL)
+{
+}
+
+SrtpEvpPool::~SrtpEvpPool()
+{
+    clear();
+}
+
+void SrtpEvpPool::clear()
+{
+    for (int32_t i = 0; i < slots; i++) {
+        if (ctxs[i] != NULL)
+            EVP_CIPHER_CTX_free(ctxs[i]);
+    }
+    delete[] ctxs;
+    delete[] busy;
+    ctxs = NULL;
+    busy = NULL;
+    slots = 0;
+
+    ThreadCopy* tc = threadCopies.exchange(NULL, std::memory_order_acquire);
+    while (tc != NULL) {
+        ThreadCopy* next = tc->next;
+        EVP_CIPHER_CTX_free(tc->ctx);
+        delete tc;
+        tc = next;
+    }
+    if (keyed != NULL)
+        EVP_CIPHER_CTX_free(keyed);
+    keyed = NULL;
+}
+
+bool SrtpEvpPool::init(EVP_CIPHER_CTX* ctx)
+{
+    clear();
+    keyed = ctx;
+
+    int32_t count = getConcurrency();
+    ctxs = new EVP_CIPHER_CTX*[count];
+    busy = new std::atomic_flag[count];
+    for (int32_t i = 0; i < count; i++) {
+        ctxs[i] = NULL;
+        busy[i].clear();
+    }
+    slots = count;
+
+    for (int32_t i = 0; i < slots; i++) {
+        if ((ctxs[i] = copy()) == NULL)
+            return false;
+    }
+    return true;
+}
+
+EVP_CIPHER_CTX* SrtpEvpPool::copy() const
+{
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+    if (ctx != NULL && EVP_CIPHER_CTX_copy(ctx, keyed) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        ctx = NULL;
+    }
+    return ctx;
+}
+
+EVP_CIPHER_CTX* SrtpEvpPool::acquire(int32_t* slot)
+{
+    if (keyed == NULL)
+        return NULL;
+
+    for (int32_t tries = 0; tries < AcquireTries; tries++) {
+        if (tries > 0)
+            std::this_thread::yield();
+        for (int32_t i = 0; i < slots; i++) {
+            if (!busy[i].test_and_set(std::memory_order_acquire)) {
+                *slot = i;
+                return ctxs[i];
+            }
+        }
+    }
+    // More threads than copies only if setConcurrency() was too low
+    *slot = -1;
+    return threadCopy();
+}
+
+/*
+ * Only the owning thread uses a thread copy, thus it needs no busy flag.
+ * The list only grows until clear(), a push needs no lock.
+ */
+EVP_CIPHER_CTX* SrtpEvpPool::threadCopy()
+{
+    std::thread::id self = std::this_thread::get_id();
+    ThreadCopy* head = threadCopies.load(std::memory_order_acquire);
+
+    for (ThreadCopy* tc = head; tc != NULL; tc = tc->next) {
+        if (tc->thread == self)
+            return tc->ctx;
+    }
+
+    ThreadCopy* tc = new ThreadCopy;
+    tc->thread = self;
+    if ((tc->ctx = copy()) == NULL) {
+        delete tc;
+        return NULL;
+    }
+    tc->next = head;
+    while (!threadCopies.compare_exchange_weak(tc->next, tc, std::memory_order_release,
+                                               std::memory_order_relaxed))
+        ;
+    return tc->ctx;
+}
+
+void SrtpEvpPool::release(int32_t slot)
+{
+    if (slot >= 0)
+        busy[slot].clear(std::memory_order_release);
+}
+
+/*
+ * AES-CM, RFC 3711 chapter 4.1.1
+ */
+SrtpAesCm::SrtpAesCm(const uint8_t* key, int32_t keyLength,
+                     const uint8_t* mSalt, int32_t saltLength,
+                     bool rtcp) :
+    masterKeyLength(keyLength), rtcp(rtcp), derived(false),
+    cacheCtx(NULL), cache(NULL), cacheData(NULL), cacheSize(0), cacheLength(0),
+    nextIndex(0), nextSsrc(0), haveNext(false)
+{
+    precomputing.clear();
+    aesKey.rounds = 0;
+    memset(masterKey, 0, sizeof(masterKey));
+    memset(masterSalt, 0, sizeof(masterSalt));
+    memset(salt, 0, sizeof(salt));
+
+    if (keyLength > (int32_t)sizeof(masterKey))
+        masterKeyLength = keyLength = 0;
+    memcpy(masterKey, key, keyLength);
+
+    if (saltLength > (int32_t)sizeof(masterSalt))
+        saltLength = sizeof(masterSalt);
+    memcpy(masterSalt, mSalt, saltLength);
+}
+
+SrtpAesCm::~SrtpAesCm()
+{
+    OPENSSL_cleanse(&aesKey, sizeof(aesKey));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(salt, sizeof(salt));
+    if (cacheCtx != NULL)
+        EVP_CIPHER_CTX_free(cacheCtx);
+    if (cacheData != NULL) {
+        OPENSSL_cleanse(cacheData, (size_t)cacheSize * cacheLength);
+        delete[] cacheData;
+    }
+    delete[] cache;
+}
+
+bool SrtpAesCm::deriveKeys()
+{
+    const EVP_CIPHER* cipher = aesCtrCipher(masterKeyLength);
+    EVP_CIPHER_CTX* ctx;
+    uint8_t sessionKey[32];
+    bool ok = false;
+
+    if (derived)
+        return true;
+    if (cipher == NULL)
+        return false;
+
+    uint8_t keyLabel = rtcp ? SRTP_LABEL_RTCP_ENCRYPTION : SRTP_LABEL_RTP_ENCRYPTION;
+    uint8_t saltLabel = rtcp ? SRTP_LABEL_RTCP_SALT : SRTP_LABEL_RTP_SALT;
+
+    if (!zsrtpDeriveKey(masterKey, masterKeyLength, masterSalt, keyLabel, sessionKey, masterKeyLength) ||
+        !zsrtpDeriveKey(masterKey, masterKeyLength, masterSalt, saltLabel, salt, sizeof(salt)))
+        goto done;
+
+    // Key the context once, the packet function only sets the IV
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        goto done;
+    if (EVP_EncryptInit_ex(ctx, cipher, NULL, sessionKey, NULL) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        goto done;
+    }
+    ok = derived = pool.init(ctx);
+
+    // Without AES instructions the multi-buffer code is off, rounds is 0
+    zsrtpAesPrepareKey(sessionKey, masterKeyLength, &aesKey);
+
+done:
+    OPENSSL_cleanse(sessionKey, sizeof(sessionKey));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(masterSalt, sizeof(masterSalt));
+    return ok;
+}
+
+/*
+ * States of a keystream cache entry. precompute() owns an entry while
+ * FILLING, crypt() while USING.
+ */
+enum {
+    CacheEmpty = 0,
+    CacheFilling,
+    CacheReady,
+    CacheUsing
+};
+
+void SrtpAesCm::computeIv(uint8_t* iv, uint64_t index, uint32_t ssrc) const
+{
+    counterIv(iv, salt, index, ssrc);
+}
+
+bool SrtpAesCm::crypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc)
+{
+    uint8_t iv[16];
+    int outl;
+    int32_t slot;
+
+    if (!derived || length < 0)
+        return false;
+
+    if (cache != NULL) {
+        nextIndex.store(index + 1, std::memory_order_relaxed);
+        nextSsrc.store(ssrc, std::memory_order_relaxed);
+        haveNext.store(true, std::memory_order_release);
+        if (cachedCrypt(data, length, index, ssrc))
+            return true;
+    }
+    computeIv(iv, index, ssrc);
+
+    EVP_CIPHER_CTX* ctx = pool.acquire(&slot);
+    if (ctx == NULL)
+        return false;
+    bool ok = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) == 1 &&
+              (length == 0 || EVP_EncryptUpdate(ctx, data, &outl, data, length) == 1);
+    pool.release(slot);
+    return ok;
+}
+
+bool SrtpAesCm::multiJob(ZsrtpAesCtrJob* job, uint8_t* data, int32_t length,
+                         uint64_t index, uint32_t ssrc) const
+{
+    // The keystream cache tracks the packets in crypt()
+    if (!derived || aesKey.rounds == 0 || cache != NULL ||
+        length < 0 || length > ZSRTP_AES_MB_MAX_LENGTH)
+        return false;
+
+    job->key = &aesKey;
+    computeIv(job->iv, index, ssrc);
+    job->data = data;
+    job->length = length;
+    return true;
+}
+
+bool SrtpAesCm::cachedCrypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc)
+{
+    KeystreamEntry* entry = &cache[index % cacheSize];
+    int expected = CacheReady;
+
+    if (!entry->state.compare_exchange_strong(expected, CacheUsing, std::memory_order_acquire))
+        return false;
+
+    bool hit = entry->index == index && entry->ssrc == ssrc && length <= cacheLength;
+    if (hit) {
+        for (int32_t i = 0; i < length; i++)
+            data[i] ^= entry->keystream[i];
+    }
+    // Used keystream XORed with the captured packet gives the plaintext
+    OPENSSL_cleanse(entry->keystream, cacheLength);
+    entry->state.store(CacheEmpty, std::memory_order_release);
+    return hit;
+}
+
+bool SrtpAesCm::enableCache(int32_t packets, int32_t maxLength)
+{
+    if (!derived || cache != NULL || packets <= 0 || maxLength <= 0)
+        return false;
+
+    if ((cacheCtx = pool.copy()) == NULL)
+        return false;
+    cacheData = new uint8_t[(size_t)packets * maxLength];
+    cacheSize = packets;
+    cacheLength = maxLength;
+
+    KeystreamEntry* entries = new KeystreamEntry[packets];
+    for (int32_t i = 0; i < packets; i++) {
+        entries[i].state.store(CacheEmpty, std::memory_order_relaxed);
+        entries[i].index = 0;
+        entries[i].ssrc = 0;
+        entries[i].keystream = cacheData + (size_t)i * maxLength;
+    }
+    cache = entries;
+    return true;
+}
+
+int32_t SrtpAesCm::precompute()
+{
+    uint8_t iv[16];
+    int outl;
+    int32_t done = 0;
+
+    if (cache == NULL || !haveNext.load(std::memory_order_acquire))
+        return 0;
+
+    // Only one thread at a time uses the cache cipher context
+    if (precomputing.test_and_set(std::memory_order_acquire))
+        return 0;
+
+    uint64_t first = nextIndex.load(std::memory_order_relaxed);
+    uint32_t ssrc = nextSsrc.load(std::memory_order_relaxed);
+
+    for (uint64_t index = first; index < first + cacheSize; index++) {
+        KeystreamEntry* entry = &cache[index % cacheSize];
+        int state = entry->state.load(std::memory_order_acquire);
+
+        // Keep entries that are still valid, refill empty and stale ones
+        if (state == CacheReady && entry->index >= first && entry->ssrc == ssrc)
+            continue;
+        if ((state != CacheEmpty && state != CacheReady) ||
+            !entry->state.compare_exchange_strong(state, CacheFilling, std::memory_order_acquire))
+            continue;
+
+        computeIv(iv, index, ssrc);
+        memset(entry->keystream, 0, cacheLength);
+        if (EVP_EncryptInit_ex(cacheCtx, NULL, NULL, NULL, iv) != 1 ||
+            EVP_EncryptUpdate(cacheCtx, entry->keystream, &outl, entry->keystream, cacheLength) != 1) {
+            OPENSSL_cleanse(entry->keystream, cacheLength);
+            entry->state.store(CacheEmpty, std::memory_order_release);
+            break;
+        }
+        entry->index = index;
+        entry->ssrc = ssrc;
+        entry->state.store(CacheReady, std::memory_order_release);
+        done++;
+    }
+    precomputing.clear(std::memory_order_release);
+    return done;
+}
+
+/*
+ * Twofish-CM
+ */
+SrtpTwofishCm::SrtpTwofishCm(const uint8_t* mKey, int32_t keyLength,
+                             const uint8_t* mSalt, int32_t saltLength,
+                             bool rtcp) :
+    key(new ZsrtpTwofishKey), masterKeyLength(keyLength), rtcp(rtcp), derived(false)
+{
+    memset(key, 0, sizeof(*key));
+    memset(masterKey, 0, sizeof(masterKey));
+    memset(masterSalt, 0, sizeof(masterSalt));
+    memset(salt, 0, sizeof(salt));
+
+    if (keyLength > (int32_t)sizeof(masterKey))
+        masterKeyLength = keyLength = 0;
+    memcpy(masterKey, mKey, keyLength);
+
+    if (saltLength > (int32_t)sizeof(masterSalt))
+        saltLength = sizeof(masterSalt);
+    memcpy(masterSalt, mSalt, saltLength);
+}
+
+SrtpTwofishCm::~SrtpTwofishCm()
+{
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(salt, sizeof(salt));
+    OPENSSL_cleanse(key, sizeof(*key));
+    delete key;
+}
+
+bool SrtpTwofishCm::deriveKeys()
+{
+    uint8_t sessionKey[32];
+    uint8_t iv[16];
+    bool ok = false;
+
+    if (derived)
+        return true;
+
+    uint8_t keyLabel = rtcp ? SRTP_LABEL_RTCP_ENCRYPTION : SRTP_LABEL_RTP_ENCRYPTION;
+    uint8_t saltLabel = rtcp ? SRTP_LABEL_RTCP_SALT : SRTP_LABEL_RTP_SALT;
+
+    // The PRF is the Twofish keystream over zeros, keyed with the master key
+    if (!zsrtpTwofishPrepareKey(masterKey, masterKeyLength, key))
+        goto done;
+
+    memset(sessionKey, 0, sizeof(sessionKey));
+    memcpy(iv, masterSalt, 14);
+    iv[7] ^= keyLabel;
+    zsrtpTwofishCtr(key, iv, sessionKey, masterKeyLength);
+
+    memset(salt, 0, sizeof(salt));
+    memcpy(iv, masterSalt, 14);
+    iv[7] ^= saltLabel;
+    zsrtpTwofishCtr(key, iv, salt, sizeof(salt));
+
+    ok = derived = zsrtpTwofishPrepareKey(sessionKey, masterKeyLength, key);
+
+done:
+    OPENSSL_cleanse(sessionKey, sizeof(sessionKey));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(masterSalt, sizeof(masterSalt));
+    return ok;
+}
+
+bool SrtpTwofishCm::crypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc)
+{
+    uint8_t iv[16];
+
+    if (!derived || length < 0)
+        return false;
+
+    counterIv(iv, salt, index, ssrc);
+    zsrtpTwofishCtr(key, iv, data, length);
+    return true;
+}
+
+/*
+ * HMAC-SHA1, RFC 2104
+ */
+SrtpHmacSha1::SrtpHmacSha1(const uint8_t* key, int32_t keyLength,
+                           const uint8_t* mSalt, int32_t saltLength,
+                           int32_t authKeyLength, int32_t tagLength, bool rtcp,
+                           bool twofishPrf) :
+    masterKeyLength(keyLength), authKeyLength(authKeyLength),
+    tagLength(tagLength), rtcp(rtcp), twofishPrf(twofishPrf), derived(false)
+{
+    memset(&inner, 0, sizeof(inner));
+    memset(&outer, 0, sizeof(outer));
+    memset(masterKey, 0, sizeof(masterKey));
+    memset(masterSalt, 0, sizeof(masterSalt));
+
+    if (keyLength > (int32_t)sizeof(masterKey))
+        masterKeyLength = keyLength = 0;
+    memcpy(masterKey, key, keyLength);
+
+    if (saltLength > (int32_t)sizeof(masterSalt))
+        saltLength = sizeof(masterSalt);
+    memcpy(masterSalt, mSalt, saltLength);
+
+    if (this->authKeyLength > SHA_CBLOCK)
+        this->authKeyLength = SHA_CBLOCK;
+    if (this->tagLength > SHA_DIGEST_LENGTH)
+        this->tagLength = SHA_DIGEST_LENGTH;
+}
+
+SrtpHmacSha1::~SrtpHmacSha1()
+{
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(&inner, sizeof(inner));
+    OPENSSL_cleanse(&outer, sizeof(outer));
+}
+
+bool SrtpHmacSha1::deriveKeys()
+{
+    uint8_t authKey[SHA_CBLOCK];
+    uint8_t pad[SHA_CBLOCK];
+    bool ok = false;
+
+    if (derived)
+        return true;
+
+    memset(authKey, 0, sizeof(authKey));
+    uint8_t label = rtcp ? SRTP_LABEL_RTCP_AUTH : SRTP_LABEL_RTP_AUTH;
+    if (!deriveKey(twofishPrf, masterKey, masterKeyLength, masterSalt, label, authKey, authKeyLength))
+        goto done;
+
+    // The key is shorter than the block size, it is zero padded
+    for (int i = 0; i < SHA_CBLOCK; i++)
+        pad[i] = authKey[i] ^ 0x36;
+    SHA1_Init(&inner);
+    SHA1_Update(&inner, pad, SHA_CBLOCK);
+
+    for (int i = 0; i < SHA_CBLOCK; i++)
+        pad[i] = authKey[i] ^ 0x5c;
+    SHA1_Init(&outer);
+    SHA1_Update(&outer, pad, SHA_CBLOCK);
+
+    ok = derived = true;
+
+done:
+    OPENSSL_cleanse(authKey, sizeof(authKey));
+    OPENSSL_cleanse(pad, sizeof(pad));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(masterSalt, sizeof(masterSalt));
+    return ok;
+}
+
+void SrtpHmacSha1::authenticate(const uint8_t* data, int32_t length, uint32_t word,
+                                uint8_t* tag) const
+{
+    SHA_CTX ctx;
+    uint8_t be[4];
+    uint8_t digest[SHA_DIGEST_LENGTH];
+
+    storeBe32(be, word);
+
+    ctx = inner;
+    SHA1_Update(&ctx, data, length);
+    SHA1_Update(&ctx, be, sizeof(be));
+    SHA1_Final(digest, &ctx);
+
+    ctx = outer;
+    SHA1_Update(&ctx, digest, sizeof(digest));
+    SHA1_Final(digest, &ctx);
+
+    memcpy(tag, digest, tagLength);
+}
+
+/*
+ * Skein-512 MAC
+ */
+SrtpSkeinMac::SrtpSkeinMac(const uint8_t* mKey, int32_t keyLength,
+                           const uint8_t* mSalt, int32_t saltLength,
+                           int32_t authKeyLength, int32_t tagLength, bool rtcp,
+                           bool twofishPrf) :
+    masterKeyLength(keyLength), authKeyLength(authKeyLength),
+    tagLength(tagLength), rtcp(rtcp), twofishPrf(twofishPrf), derived(false)
+{
+    memset(&key, 0, sizeof(key));
+    memset(masterKey, 0, sizeof(masterKey));
+    memset(masterSalt, 0, sizeof(masterSalt));
+
+    if (keyLength > (int32_t)sizeof(masterKey))
+        masterKeyLength = keyLength = 0;
+    memcpy(masterKey, mKey, keyLength);
+
+    if (saltLength > (int32_t)sizeof(masterSalt))
+        saltLength = sizeof(masterSalt);
+    memcpy(masterSalt, mSalt, saltLength);
+
+    if (this->authKeyLength > 64)
+        this->authKeyLength = 64;
+    if (this->tagLength > 64)
+        this->tagLength = 64;
+}
+
+SrtpSkeinMac::~SrtpSkeinMac()
+{
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(&key, sizeof(key));
+}
+
+bool SrtpSkeinMac::deriveKeys()
+{
+    uint8_t authKey[64];
+    bool ok = false;
+
+    if (derived)
+        return true;
+
+    uint8_t label = rtcp ? SRTP_LABEL_RTCP_AUTH : SRTP_LABEL_RTP_AUTH;
+    if (!deriveKey(twofishPrf, masterKey, masterKeyLength, masterSalt, label, authKey, authKeyLength))
+        goto done;
+
+    ok = derived = zsrtpSkeinMacInit(authKey, authKeyLength, tagLength, &key);
+
+done:
+    OPENSSL_cleanse(authKey, sizeof(authKey));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(masterSalt, sizeof(masterSalt));
+    return ok;
+}
+
+void SrtpSkeinMac::authenticate(const uint8_t* data, int32_t length, uint32_t word,
+                                uint8_t* tag) const
+{
+    uint8_t be[4];
+
+    storeBe32(be, word);
+    zsrtpSkeinMac(&key, data, length, be, sizeof(be), tag);
+}
+
+/*
+ * AES-GCM, RFC 7714
+ */
+static bool gcmCrypt(EVP_CIPHER_CTX* ctx, const uint8_t* iv, const uint8_t* aad, int32_t aadLen,
+                     const uint8_t* aad2, int32_t aad2Len,
+                     uint8_t* data, int32_t dataLen, uint8_t* tag, int32_t tagLength, bool encrypt)
+{
+    int outl;
+
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, encrypt ? 1 : 0) != 1)
+        return false;
+    if (EVP_CipherUpdate(ctx, NULL, &outl, aad, aadLen) != 1)
+        return false;
+    if (aad2Len > 0 && EVP_CipherUpdate(ctx, NULL, &outl, aad2, aad2Len) != 1)
+        return false;
+    if (dataLen > 0 && EVP_CipherUpdate(ctx, data, &outl, data, dataLen) != 1)
+        return false;
+
+    if (encrypt) {
+        return EVP_CipherFinal_ex(ctx, data + dataLen, &outl) == 1 &&
+               EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, tagLength, tag) == 1;
+    }
+    return EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, tagLength, tag) == 1 &&
+           EVP_CipherFinal_ex(ctx, data + dataLen, &outl) == 1;
+}
+SrtpAeadGcm::SrtpAeadGcm(const uint8_t* key, int32_t keyLength,
+                         const uint8_t* mSalt, int32_t saltLength,
+                         bool rtcp) :
+    masterKeyLength(keyLength), tagLength(16), rtcp(rtcp), derived(false)
+{
+    memset(masterKey, 0, sizeof(masterKey));
+    memset(masterSalt, 0, sizeof(masterSalt));
+    memset(salt, 0, sizeof(salt));
+
+    if (keyLength > (int32_t)sizeof(masterKey))
+        masterKeyLength = keyLength = 0;
+    memcpy(masterKey, key, keyLength);
+
+    // RFC 7714 uses a 96 bit master salt, the KDF pads it with zeros
+    if (saltLength > 12)
+        saltLength = 12;
+    memcpy(masterSalt, mSalt, saltLength);
+}
+
+SrtpAeadGcm::~SrtpAeadGcm()
+{
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(salt, sizeof(salt));
+}
+
+bool SrtpAeadGcm::deriveKeys()
+{
+    const EVP_CIPHER* cipher = aesGcmCipher(masterKeyLength);
+    EVP_CIPHER_CTX* ctx;
+    uint8_t sessionKey[32];
+    bool ok = false;
+
+    if (derived)
+        return true;
+    if (cipher == NULL)
+        return false;
+
+    uint8_t keyLabel = rtcp ? SRTP_LABEL_RTCP_ENCRYPTION : SRTP_LABEL_RTP_ENCRYPTION;
+    uint8_t saltLabel = rtcp ? SRTP_LABEL_RTCP_SALT : SRTP_LABEL_RTP_SALT;
+
+    if (!zsrtpDeriveKey(masterKey, masterKeyLength, masterSalt, keyLabel, sessionKey, masterKeyLength) ||
+        !zsrtpDeriveKey(masterKey, masterKeyLength, masterSalt, saltLabel, salt, sizeof(salt)))
+        goto done;
+
+    // Key the context once, the packet functions only set the IV
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        goto done;
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, sessionKey, NULL, 1) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        goto done;
+    }
+    ok = derived = pool.init(ctx);
+
+done:
+    OPENSSL_cleanse(sessionKey, sizeof(sessionKey));
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(masterSalt, sizeof(masterSalt));
+    return ok;
+}
+
+bool SrtpAeadGcm::crypt(const uint8_t* iv, const uint8_t* aad, int32_t aadLen,
+                        const uint8_t* aad2, int32_t aad2Len,
+                        uint8_t* data, int32_t dataLen, uint8_t* tag, bool encrypt)
+{
+    int32_t slot;
+
+    if (!derived || dataLen < 0)
+        return false;
+
+    EVP_CIPHER_CTX* ctx = pool.acquire(&slot);
+    if (ctx == NULL)
+        return false;
+    bool ok = gcmCrypt(ctx, iv, aad, aadLen, aad2, aad2Len, data, dataLen, tag, tagLength, encrypt);
+    pool.release(slot);
+    return ok;
+}
+
+/*
+ * IV for SRTP, RFC 7714 chapter 8.1:
+ * (00 00 || SSRC || ROC || SEQ) XOR salt
+ */
+static inline void rtpIv(uint8_t* iv, const uint8_t* salt, uint32_t ssrc,
+                         uint32_t roc, uint16_t seq)
+{
+    iv[0] = iv[1] = 0;
+    storeBe32(iv + 2, ssrc);
+    storeBe32(iv + 6, roc);
+    iv[10] = (uint8_t)(seq >> 8);
+    iv[11] = (uint8_t)seq;
+    for (int i = 0; i < 12; i++)
+        iv[i] ^= salt[i];
+}
+
+/*
+ * IV for SRTCP, RFC 7714 chapter 9.1:
+ * (00 00 || SSRC || 00 00 || 0 + SRTCP index) XOR salt
+ */
+static inline void rtcpIv(uint8_t* iv, const uint8_t* salt, uint32_t ssrc,
+                          uint32_t index)
+{
+    iv[0] = iv[1] = 0;
+    storeBe32(iv + 2, ssrc);
+    iv[6] = iv[7] = 0;
+    storeBe32(iv + 8, index & ~0x80000000);
+    for (int i = 0; i < 12; i++)
+        iv[i] ^= salt[i];
+}
+
+bool SrtpAeadGcm::sealRtp(uint8_t* pkt, int32_t hdrLen, int32_t length,
+                          uint32_t ssrc, uint32_t roc, uint16_t seq)
+{
+    uint8_t iv[12];
+
+    rtpIv(iv, salt, ssrc, roc, seq);
+    return crypt(iv, pkt, hdrLen, NULL, 0, pkt + hdrLen, length - hdrLen,
+                 pkt + length, true);
+}
+
+bool SrtpAeadGcm::openRtp(uint8_t* pkt, int32_t hdrLen, int32_t length,
+                          uint32_t ssrc, uint32_t roc, uint16_t seq)
+{
+    uint8_t iv[12];
+
+    rtpIv(iv, salt, ssrc, roc, seq);
+    return crypt(iv, pkt, hdrLen, NULL, 0, pkt + hdrLen, length - hdrLen,
+                 pkt + length, false);
+}
+
+/*
+ * SRTCP packet layout, RFC 7714 chapter 9:
+ * header (8) || ciphertext || tag || E flag + SRTCP index (4)
+ * The AAD is the header followed by the index word.
+ */
+bool SrtpAeadGcm::sealRtcp(uint8_t* pkt, int32_t length, uint32_t ssrc, uint32_t index)
+{
+    uint8_t iv[12];
+    uint8_t* indexWord = pkt + length + tagLength;
+
+    storeBe32(indexWord, index | 0x80000000);   // always encrypted, set the E flag
+    rtcpIv(iv, salt, ssrc, index);
+    return crypt(iv, pkt, 8, indexWord, 4, pkt + 8, length - 8,
+                 pkt + length, true);
+}
+
+bool SrtpAeadGcm::openRtcp(uint8_t* pkt, int32_t length, uint32_t ssrc, uint32_t encIndex)
+{
+    uint8_t iv[12];
+    uint8_t indexWord[4];
+
+    // Unencrypted SRTCP is not supported, we always send with the E flag set
+    if ((encIndex & 0x80000000) == 0)
+        return false;
+
+    storeBe32(indexWord, encIndex);
+    rtcpIv(iv, salt, ssrc, encIndex);
+    return crypt(iv, pkt, 8, indexWord, 4, pkt + 8, length - 8,
+                 pkt + length, false);
+}
@@ -0,0 +1,710 @@
+/*
+    This file defines the SRTP transforms that the ZRTP SRTP wrapper
+    implements itself.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPTRANSFORMS_H
+#define ZSRTPTRANSFORMS_H
+
+/*
+ * The CryptoContext classes of the ZRTP library implement the classic
+ * SRTP transforms (AES-CM, Twofish-CM, HMAC-SHA1, Skein-MAC). The classes
+ * here implement additional transforms on top of OpenSSL's EVP interface
+ * and the bookkeeping (packet index, replay window) these transforms need.
+ *
+ * All packet functions work in place and do not allocate memory.
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include "ZsrtpTwofish.h"
+#include "ZsrtpSkein.h"
+#include "ZsrtpAesMb.h"
+
+/* Labels of the SRTP key derivation, RFC 3711 chapter 4.3.1 */
+#define SRTP_LABEL_RTP_ENCRYPTION   0x00
+#define SRTP_LABEL_RTP_AUTH         0x01
+#define SRTP_LABEL_RTP_SALT         0x02
+#define SRTP_LABEL_RTCP_ENCRYPTION  0x03
+#define SRTP_LABEL_RTCP_AUTH        0x04
+#define SRTP_LABEL_RTCP_SALT        0x05
+
+/**
+ * SRTP key derivation with the AES-CM PRF, RFC 3711 chapter 4.3.
+ *
+ * Computes a session key for the given label. The key derivation rate is
+ * always 0, this is the case for ZRTP.
+ *
+ * @param masterKey
+ *    The master key, 16, 24 or 32 bytes.
+ * @param masterKeyLength
+ *    Length of the master key in bytes.
+ * @param masterSalt
+ *    The master salt, 14 bytes. Shorter salts must be padded with zeros.
+ * @param label
+ *    The label of the key to derive.
+ * @param out
+ *    Buffer that receives the derived key.
+ * @param outLength
+ *    Length of the key to derive in bytes.
+ * @return
+ *    true if the key could be derived.
+ */
+bool zsrtpDeriveKey(const uint8_t* masterKey, int32_t masterKeyLength,
+                    const uint8_t* masterSalt, uint8_t label,
+                    uint8_t* out, int32_t outLength);
+
+/**
+ * SRTP key derivation with the Twofish PRF.
+ *
+ * Works like zsrtpDeriveKey() with Twofish as block cipher, the ZRTP
+ * library uses this PRF for Twofish contexts.
+ */
+bool zsrtpDeriveKeyTwofish(const uint8_t* masterKey, int32_t masterKeyLength,
+                           const uint8_t* masterSalt, uint8_t label,
+                           uint8_t* out, int32_t outLength);
+
+/**
+ * Sliding replay window over 48 bit SRTP or 31 bit SRTCP packet indices.
+ *
+ * The bitmap is a ring of 64 bit words addressed by the low bits of the
+ * index. Moving the window clears the words the new highest index enters,
+ * a test or update touches one word. Thus the cost per packet does not
+ * depend on the window size.
+ */
+class SrtpReplayWindow
+{
+public:
+    /**
+     * @param size number of packets the window covers, at least 64
+     */
+    SrtpReplayWindow(int32_t size = 64);
+    ~SrtpReplayWindow();
+
+    /**
+     * Change the window size, keeps the state of the packets that both
+     * windows cover.
+     *
+     * @return false if the size is smaller than 64.
+     */
+    bool setSize(int32_t size);
+
+    int32_t getSize() const { return size; }
+
+    /**
+     * Forget all received indices, keeps the window size.
+     */
+    void reset() { initialized = false; }
+
+    /**
+     * Return the highest received index, -1 if none was received.
+     */
+    int64_t getHighest() const { return initialized ? highest : -1; }
+
+    /**
+     * Start over as if all indices up to highest were received.
+     */
+    void restore(int64_t highest);
+
+    /**
+     * Check if a packet with this index may be accepted.
+     *
+     * @return false if the index is too old or was already seen.
+     */
+    bool check(int64_t index) const;
+
+    /**
+     * Mark the index as received, call after the packet was authenticated.
+     */
+    void update(int64_t index);
+
+private:
+    SrtpReplayWindow(const SrtpReplayWindow&);
+    SrtpReplayWindow& operator=(const SrtpReplayWindow&);
+
+    bool isSet(int64_t index) const;
+    void set(int64_t index);
+
+    uint64_t* words;        /* bit (index & bitMask) set: index was received */
+    uint64_t bitMask;       /* number of bits in words - 1, a power of 2 */
+    int32_t size;
+    int64_t highest;
+    bool initialized;
+};
+
+/**
+ * Packet index estimation and replay control of a SRTP stream, RFC 3711
+ * chapter 3.3.1 and appendix A.
+ *
+ * A receiver uses guessIndex(), checkReplay() and update(), these are not
+ * thread safe. A sender uses sendIndex() only, several threads may send
+ * packets of the stream at the same time.
+ */
+class SrtpIndexState
+{
+public:
+    SrtpIndexState(uint32_t roc = 0);
+
+    uint32_t getRoc() const { return roc; }
+    void setRoc(uint32_t r) { roc = r; }
+
+    /**
+     * Estimate the 48 bit packet index of a received packet.
+     *
+     * @return the index or -1 if the packet is older than index 0.
+     */
+    int64_t guessIndex(uint16_t seq) const;
+
+    bool checkReplay(uint16_t seq) const;
+
+    void update(uint16_t seq);
+
+    /**
+     * Return the 48 bit packet index of a packet to send.
+     *
+     * Estimates the ROC from the highest index sent so far like the
+     * receiver does and records the index with an atomic compare and
+     * swap. Thus packets that threads send out of order get the right ROC.
+     */
+    uint64_t sendIndex(uint16_t seq);
+
+    bool setReplayWindow(int32_t size) { return replay.setSize(size); }
+    int32_t getReplayWindow() const { return replay.getSize(); }
+
+    /**
+     * Start over with ROC 0 and an empty replay window.
+     */
+    void reset();
+
+    /**
+     * Return the highest received index, -1 if none was received.
+     */
+    int64_t getHighest() const;
+
+    /**
+     * Start over at the ROC of the index, all indices up to it count as
+     * received.
+     */
+    void restore(int64_t highest);
+
+private:
+    uint32_t roc;
+    uint16_t s_l;           /* highest received sequence number */
+    bool seqNumSet;
+    SrtpReplayWindow replay;
+    std::atomic<uint64_t> sent;     /* highest index sent + 1, 0: none */
+};
+
+/**
+ * Table of the streams a receiving context gets packets from, keyed by
+ * SSRC.
+ *
+ * SRTP session keys do not depend on the SSRC, thus all streams share the
+ * derived keys of the context. Only the ROC and the replay state belong to
+ * a stream, State is SrtpIndexState for SRTP and SrtpReplayWindow for
+ * SRTCP.
+ *
+ * The table uses open addressing with twice as many slots as streams. It
+ * keeps one spare state: a packet of an unknown SSRC uses the spare, and
+ * only after the packet was authenticated insert() assigns it to the
+ * SSRC. If the table is full insert() evicts the stream that was idle the
+ * longest and its state becomes the new spare. Forged packets thus cannot
+ * evict streams.
+ *
+ * The table remembers the highest index of the last HistorySize evicted
+ * streams. If such a SSRC comes back its spare starts at this index: the
+ * stream keeps its ROC, and its old packets count as received, thus a
+ * replayed packet neither gets in nor evicts another stream. Beyond the
+ * history a returning SSRC starts over like a new one.
+ *
+ * The table has no locks, the receive path of a context runs on one
+ * thread at a time.
+ */
+template <class State>
+class SrtpSsrcTable
+{
+public:
+    /**
+     * @param maxStreams number of streams, 1 to 64
+     * @param window     size of the replay window of each stream
+     */
+    SrtpSsrcTable(int32_t maxStreams, int32_t window);
+    ~SrtpSsrcTable();
+
+    /**
+     * Return the state of a stream, NULL if the SSRC is unknown.
+     */
+    State* lookup(uint32_t ssrc);
+
+    /**
+     * Return the spare state to check a packet of an unknown SSRC. The
+     * state is reset, or restored if the table evicted the SSRC before.
+     */
+    State* spare(uint32_t ssrc);
+
+    /**
+     * Assign the spare state to a SSRC, call after the packet was
+     * authenticated.
+     */
+    void insert(uint32_t ssrc);
+
+    int32_t getCount() const { return count; }
+
+    static const int32_t HistorySize = 256;
+
+private:
+    SrtpSsrcTable(const SrtpSsrcTable&);
+    SrtpSsrcTable& operator=(const SrtpSsrcTable&);
+
+    uint32_t slotOf(uint32_t ssrc) const;
+    void remove(uint32_t slot);
+    int32_t findEvicted(uint32_t ssrc) const;
+    void addEvicted(uint32_t ssrc, int64_t highest, uint64_t when);
+
+    struct Slot
+    {
+        uint32_t ssrc;
+        int32_t state;      /* index into states, -1: slot is empty */
+    };
+    Slot* slots;
+    uint32_t slotMask;
+    State** states;         /* maxStreams + 1 states, one is the spare */
+    uint64_t* lastUse;      /* use counter value of the last lookup per state */
+    uint64_t useCounter;
+
+    struct Evicted
+    {
+        uint32_t ssrc;
+        int64_t highest;    /* -1: entry is empty */
+        uint64_t when;      /* last use of the stream */
+    };
+    Evicted* history;       /* HistorySize entries */
+    int32_t spareState;
+    int32_t maxStreams;
+    int32_t count;
+};
+
+class SrtpStreamTable : public SrtpSsrcTable<SrtpIndexState>
+{
+public:
+    SrtpStreamTable(int32_t maxStreams, int32_t window) :
+        SrtpSsrcTable<SrtpIndexState>(maxStreams, window) {}
+};
+
+class SrtpCtrlStreamTable : public SrtpSsrcTable<SrtpReplayWindow>
+{
+public:
+    SrtpCtrlStreamTable(int32_t maxStreams, int32_t window) :
+        SrtpSsrcTable<SrtpReplayWindow>(maxStreams, window) {}
+};
+
+/**
+ * Keyed EVP cipher contexts for concurrent use.
+ *
+ * An EVP context keeps the state of the current operation, two threads
+ * must not use it at the same time. The pool keeps one copy of the keyed
+ * context for each thread that may use the transform at the same time,
+ * see setConcurrency(). acquire() claims a free copy with an atomic flag.
+ * If more threads than copies come at once, for example because the pool
+ * was keyed before setConcurrency() was raised, a thread tries a few times
+ * and then uses a copy of its own. The pool creates that copy the first
+ * time the thread needs it and keeps it until the pool is cleared, thus
+ * the packet path never waits unbounded and allocates at most once per
+ * thread. Keying is done once in init(), a copy does not repeat the key
+ * schedule.
+ */
+class SrtpEvpPool
+{
+public:
+    SrtpEvpPool();
+    ~SrtpEvpPool();
+
+    /**
+     * Set the number of threads that may use a transform at the same
+     * time. Pools keyed after the call get that many copies.
+     *
+     * @param threads 1 to MaxConcurrency, the default is
+     *        DefaultConcurrency
+     * @return false if the number is out of range.
+     */
+    static bool setConcurrency(int32_t threads);
+
+    static int32_t getConcurrency();
+
+    /**
+     * Take over a keyed context and create the copies.
+     */
+    bool init(EVP_CIPHER_CTX* keyed);
+
+    /**
+     * Return a new copy of the keyed context, the caller frees it.
+     */
+    EVP_CIPHER_CTX* copy() const;
+
+    /**
+     * Claim a context, give it back with release().
+     *
+     * @param slot receives the slot number that release() needs, -1 for
+     *        the copy of the thread
+     * @return the context or NULL if the pool is not keyed.
+     */
+    EVP_CIPHER_CTX* acquire(int32_t* slot);
+
+    void release(int32_t slot);
+
+    enum { DefaultConcurrency = 4, MaxConcurrency = 128, AcquireTries = 4 };
+
+private:
+    SrtpEvpPool(const SrtpEvpPool&);
+    SrtpEvpPool& operator=(const SrtpEvpPool&);
+
+    void clear();
+    EVP_CIPHER_CTX* threadCopy();
+
+    /* The copy of a thread that found no free slot */
+    struct ThreadCopy
+    {
+        std::thread::id thread;
+        EVP_CIPHER_CTX* ctx;
+        ThreadCopy* next;
+    };
+
+    EVP_CIPHER_CTX* keyed;  /* only copied, never used for an operation */
+    EVP_CIPHER_CTX** ctxs;
+    std::atomic_flag* busy;
+    int32_t slots;
+    std::atomic<ThreadCopy*> threadCopies;
+};
+
+/**
+ * AES counter mode encryption for SRTP and SRTCP, RFC 3711 chapter 4.1.1.
+ *
+ * The instance keeps EVP contexts keyed with the session key. A packet
+ * needs only the IV setup and a single EVP_EncryptUpdate() over the whole
+ * payload, this lets OpenSSL run its multi-block AES-NI counter mode code.
+ * Several threads may call crypt() at the same time.
+ */
+class SrtpAesCm
+{
+public:
+    SrtpAesCm(const uint8_t* masterKey, int32_t masterKeyLength,
+              const uint8_t* masterSalt, int32_t masterSaltLength,
+              bool rtcp);
+    ~SrtpAesCm();
+
+    /**
+     * Derive the session key and salt and set up the cipher context.
+     *
+     * Wipes the master key and salt afterwards, further calls do nothing.
+     */
+    bool deriveKeys();
+
+    /**
+     * Encrypt or decrypt data in place.
+     *
+     * @param data   the payload of a RTP packet or the RTCP packet after
+     *               the fixed header
+     * @param length length of the data
+     * @param index  the 48 bit SRTP or 31 bit SRTCP packet index
+     * @param ssrc   the SSRC of the packet, host order
+     */
+    bool crypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc);
+
+    /**
+     * Enable the keystream cache of a sending context.
+     *
+     * The cache holds the keystream of the next packets. precompute()
+     * fills it, crypt() uses a matching entry and XORs the data only.
+     * Call this after deriveKeys() and before the first packet.
+     *
+     * @param packets   number of packets to precompute
+     * @param maxLength keystream length per packet, longer payloads fall
+     *                  back to regular encryption
+     */
+    bool enableCache(int32_t packets, int32_t maxLength);
+
+    /**
+     * Generate the keystream of the packets that follow the last encrypted
+     * packet. May run in another thread than crypt().
+     *
+     * @return number of generated keystream entries.
+     */
+    int32_t precompute();
+
+    /**
+     * Set up a zsrtpAesCtrMulti() job that works like crypt().
+     *
+     * @return false if the multi-buffer code cannot handle this context or
+     *         the packet is longer than ZSRTP_AES_MB_MAX_LENGTH, use crypt()
+     *         in this case.
+     */
+    bool multiJob(ZsrtpAesCtrJob* job, uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc) const;
+
+private:
+    struct KeystreamEntry
+    {
+        std::atomic<int> state;
+        uint64_t index;
+        uint32_t ssrc;
+        uint8_t* keystream;
+    };
+
+    bool cachedCrypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc);
+    void computeIv(uint8_t* iv, uint64_t index, uint32_t ssrc) const;
+
+    SrtpEvpPool pool;
+    ZsrtpAesKey aesKey;     /* key schedule of the multi-buffer code */
+    uint8_t masterKey[32];
+    uint8_t masterSalt[14];
+    int32_t masterKeyLength;
+    uint8_t salt[14];
+    bool rtcp;
+    bool derived;
+
+    /* Keystream cache, precompute() uses its own cipher context */
+    EVP_CIPHER_CTX* cacheCtx;
+    KeystreamEntry* cache;
+    uint8_t* cacheData;
+    int32_t cacheSize;
+    int32_t cacheLength;
+    std::atomic_flag precomputing;
+    std::atomic<uint64_t> nextIndex;
+    std::atomic<uint32_t> nextSsrc;
+    std::atomic<bool> haveNext;
+};
+
+/**
+ * Twofish counter mode encryption for SRTP and SRTCP.
+ *
+ * Works like SrtpAesCm with Twofish as block cipher, the key derivation
+ * uses the Twofish PRF as the ZRTP library does for Twofish contexts.
+ */
+class SrtpTwofishCm
+{
+public:
+    SrtpTwofishCm(const uint8_t* masterKey, int32_t masterKeyLength,
+                  const uint8_t* masterSalt, int32_t masterSaltLength,
+                  bool rtcp);
+    ~SrtpTwofishCm();
+
+    /**
+     * Derive the session key and salt and compute the key schedule.
+     *
+     * Wipes the master key and salt afterwards, further calls do nothing.
+     */
+    bool deriveKeys();
+
+    /**
+     * Encrypt or decrypt data in place, see SrtpAesCm::crypt().
+     */
+    bool crypt(uint8_t* data, int32_t length, uint64_t index, uint32_t ssrc);
+
+private:
+    ZsrtpTwofishKey* key;
+    uint8_t masterKey[32];
+    uint8_t masterSalt[14];
+    int32_t masterKeyLength;
+    uint8_t salt[14];
+    bool rtcp;
+    bool derived;
+};
+
+/**
+ * Authentication transform for SRTP and SRTCP.
+ *
+ * The implementations derive the authentication key with the PRF of the
+ * cipher, AES or Twofish, as the ZRTP library does.
+ */
+class SrtpMac
+{
+public:
+    virtual ~SrtpMac() {}
+
+    /**
+     * Derive the authentication key and precompute the key state.
+     *
+     * Wipes the master key and salt afterwards, further calls do nothing.
+     */
+    virtual bool deriveKeys() = 0;
+
+    virtual int32_t getTagLength() const = 0;
+
+    /**
+     * Compute the tag over the packet data followed by a 32 bit word.
+     *
+     * The word is the ROC for SRTP and the E flag plus SRTCP index for
+     * SRTCP, both in host order.
+     *
+     * @param data   the packet data
+     * @param length length of the packet data
+     * @param word   the word to append
+     * @param tag    receives the truncated tag, getTagLength() bytes
+     */
+    virtual void authenticate(const uint8_t* data, int32_t length, uint32_t word, uint8_t* tag) const = 0;
+};
+
+/**
+ * HMAC-SHA1 authentication for SRTP and SRTCP with precomputed key state.
+ *
+ * The key setup of HMAC hashes the padded key into an inner and an outer
+ * SHA-1 state. The class does this once in deriveKeys() and copies the two
+ * states for each packet, thus a packet costs only the hashing of its data.
+ */
+class SrtpHmacSha1 : public SrtpMac
+{
+public:
+    SrtpHmacSha1(const uint8_t* masterKey, int32_t masterKeyLength,
+                 const uint8_t* masterSalt, int32_t masterSaltLength,
+                 int32_t authKeyLength, int32_t tagLength, bool rtcp,
+                 bool twofishPrf);
+    ~SrtpHmacSha1();
+
+    bool deriveKeys();
+
+    int32_t getTagLength() const { return tagLength; }
+
+    void authenticate(const uint8_t* data, int32_t length, uint32_t word, uint8_t* tag) const;
+
+private:
+    SHA_CTX inner;          /* state after hashing key XOR ipad */
+    SHA_CTX outer;          /* state after hashing key XOR opad */
+    uint8_t masterKey[32];
+    uint8_t masterSalt[14];
+    int32_t masterKeyLength;
+    int32_t authKeyLength;
+    int32_t tagLength;
+    bool rtcp;
+    bool twofishPrf;
+    bool derived;
+};
+
+/**
+ * Skein-512 MAC for SRTP and SRTCP with precomputed key state.
+ *
+ * The MAC length is the tag length, as in the ZRTP library. deriveKeys()
+ * processes the key and the configuration block, a packet then costs the
+ * message blocks and the output block only.
+ */
+class SrtpSkeinMac : public SrtpMac
+{
+public:
+    SrtpSkeinMac(const uint8_t* masterKey, int32_t masterKeyLength,
+                 const uint8_t* masterSalt, int32_t masterSaltLength,
+                 int32_t authKeyLength, int32_t tagLength, bool rtcp,
+                 bool twofishPrf);
+    ~SrtpSkeinMac();
+
+    bool deriveKeys();
+
+    int32_t getTagLength() const { return tagLength; }
+
+    void authenticate(const uint8_t* data, int32_t length, uint32_t word, uint8_t* tag) const;
+
+private:
+    ZsrtpSkeinMacKey key;
+    uint8_t masterKey[32];
+    uint8_t masterSalt[14];
+    int32_t masterKeyLength;
+    int32_t authKeyLength;
+    int32_t tagLength;
+    bool rtcp;
+    bool twofishPrf;
+    bool derived;
+};
+
+/**
+ * AES-GCM AEAD transform for SRTP and SRTCP, RFC 7714.
+ *
+ * One instance handles either SRTP or SRTCP packets of one direction. The
+ * instance keeps a keyed EVP context, thus a packet needs only the IV setup
+ * and one pass over the data to encrypt and authenticate it.
+ *
+ * The packet format follows RFC 7714, the keying does not: the session
+ * key and salt come from the RFC 3711 PRF over the 14 byte ZRTP master
+ * salt, the salt is truncated to the 96 bit salt that RFC 7714 uses. Only
+ * peers that use this code can decrypt the packets.
+ */
+class SrtpAeadGcm
+{
+public:
+    SrtpAeadGcm(const uint8_t* masterKey, int32_t masterKeyLength,
+                const uint8_t* masterSalt, int32_t masterSaltLength,
+                bool rtcp);
+    ~SrtpAeadGcm();
+
+    /**
+     * Derive the session key and salt and set up the cipher context.
+     *
+     * Wipes the master key and salt afterwards, further calls do nothing.
+     */
+    bool deriveKeys();
+
+    int32_t getTagLength() const { return tagLength; }
+
+    /**
+     * Encrypt the payload and append the tag to a RTP packet.
+     *
+     * @param pkt    the RTP packet, must have room for the tag
+     * @param hdrLen length of RTP header including CSRC and extension
+     * @param length length of the RTP packet
+     */
+    bool sealRtp(uint8_t* pkt, int32_t hdrLen, int32_t length,
+                 uint32_t ssrc, uint32_t roc, uint16_t seq);
+
+    /**
+     * Check the tag and decrypt the payload of a SRTP packet.
+     *
+     * @param length length of the SRTP packet without the tag
+     */
+    bool openRtp(uint8_t* pkt, int32_t hdrLen, int32_t length,
+                 uint32_t ssrc, uint32_t roc, uint16_t seq);
+
+    /**
+     * Encrypt a RTCP packet, append the tag and the E flag plus SRTCP index.
+     *
+     * @param length length of the RTCP packet
+     */
+    bool sealRtcp(uint8_t* pkt, int32_t length, uint32_t ssrc, uint32_t index);
+
+    /**
+     * Check the tag and decrypt a SRTCP packet.
+     *
+     * @param length length of the SRTCP packet without tag and index
+     * @param encIndex the SRTCP index word including the E flag, host order
+     */
+    bool openRtcp(uint8_t* pkt, int32_t length, uint32_t ssrc, uint32_t encIndex);
+
+private:
+    bool crypt(const uint8_t* iv, const uint8_t* aad, int32_t aadLen,
+               const uint8_t* aad2, int32_t aad2Len,
+               uint8_t* data, int32_t dataLen, uint8_t* tag, bool encrypt);
+
+    SrtpEvpPool pool;
+    uint8_t masterKey[32];
+    uint8_t masterSalt[14];
+    int32_t masterKeyLength;
+    uint8_t salt[12];
+    int32_t tagLength;
+    bool rtcp;
+    bool derived;
+};
+
+#endif
@@ -0,0 +1,369 @@
+/*
+    This file implements the Twofish counter mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <string.h>
+#include "ZsrtpTwofish.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZSRTP_TWOFISH_AVX2
+#include <immintrin.h>
+#endif
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * The 4 bit permutations that define q0 and q1, Twofish paper 4.3.5
+ */
+static const uint8_t qt[2][4][16] = {
+    {
+        { 0x8, 0x1, 0x7, 0xD, 0x6, 0xF, 0x3, 0x2, 0x0, 0xB, 0x5, 0x9, 0xE, 0xC, 0xA, 0x4 },
+        { 0xE, 0xC, 0xB, 0x8, 0x1, 0x2, 0x3, 0x5, 0xF, 0x4, 0xA, 0x6, 0x7, 0x0, 0x9, 0xD },
+        { 0xB, 0xA, 0x5, 0xE, 0x6, 0xD, 0x9, 0x0, 0xC, 0x8, 0xF, 0x3, 0x2, 0x4, 0x7, 0x1 },
+        { 0xD, 0x7, 0xF, 0x4, 0x1, 0x2, 0x6, 0xE, 0x9, 0xB, 0x3, 0x0, 0x8, 0x5, 0xC, 0xA }
+    },
+    {
+        { 0x2, 0x8, 0xB, 0xD, 0xF, 0x7, 0x6, 0xE, 0x3, 0x1, 0x9, 0x4, 0x0, 0xA, 0xC, 0x5 },
+        { 0x1, 0xE, 0x2, 0xB, 0x4, 0xC, 0x3, 0x7, 0x6, 0xD, 0xA, 0x5, 0xF, 0x9, 0x0, 0x8 },
+        { 0x4, 0xC, 0x7, 0x5, 0x1, 0x6, 0x9, 0xA, 0x0, 0xE, 0xD, 0x8, 0x2, 0xB, 0x3, 0xF },
+        { 0xB, 0x9, 0x5, 0x1, 0xC, 0x3, 0xD, 0xE, 0x6, 0x4, 0x7, 0xF, 0x2, 0x0, 0x8, 0xA }
+    }
+};
+
+static const uint8_t mds[4][4] = {
+    { 0x01, 0xEF, 0x5B, 0x5B },
+    { 0x5B, 0xEF, 0xEF, 0x01 },
+    { 0xEF, 0x5B, 0x01, 0xEF },
+    { 0xEF, 0x01, 0xEF, 0x5B }
+};
+
+static const uint8_t rs[4][8] = {
+    { 0x01, 0xA4, 0x55, 0x87, 0x5A, 0x58, 0xDB, 0x9E },
+    { 0xA4, 0x56, 0x82, 0xF3, 0x1E, 0xC6, 0x68, 0xE5 },
+    { 0x02, 0xA1, 0xFC, 0xC1, 0x47, 0xAE, 0x3D, 0x19 },
+    { 0xA4, 0x55, 0x87, 0x5A, 0x58, 0xDB, 0x9E, 0x03 }
+};
+
+static inline uint8_t ror4(uint8_t x)
+{
+    return (uint8_t)(((x >> 1) | (x << 3)) & 0xF);
+}
+
+static void buildQ(uint8_t q[2][256])
+{
+    for (int n = 0; n < 2; n++) {
+        for (int x = 0; x < 256; x++) {
+            uint8_t a = (uint8_t)(x >> 4), b = (uint8_t)(x & 0xF);
+            uint8_t a1 = a ^ b;
+            uint8_t b1 = (a ^ ror4(b) ^ (uint8_t)(a << 3)) & 0xF;
+            a = qt[n][0][a1];
+            b = qt[n][1][b1];
+            a1 = a ^ b;
+            b1 = (a ^ ror4(b) ^ (uint8_t)(a << 3)) & 0xF;
+            a = qt[n][2][a1];
+            b = qt[n][3][b1];
+            q[n][x] = (uint8_t)((b << 4) | a);
+        }
+    }
+}
+
+static uint8_t gfMul(uint8_t a, uint8_t b, uint32_t poly)
+{
+    uint32_t x = a, r = 0;
+
+    for (; b != 0; b >>= 1) {
+        if (b & 1)
+            r ^= x;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= poly;
+    }
+    return (uint8_t)r;
+}
+
+static inline uint8_t byteOf(uint32_t x, int n)
+{
+    return (uint8_t)(x >> (8 * n));
+}
+
+/*
+ * The permutation part of h for byte position j, L holds k words.
+ */
+static uint8_t hByte(const uint8_t q[2][256], int j, uint8_t y, const uint32_t* L, int k)
+{
+    /* q selection per byte position for the steps of h */
+    static const int q4[4] = { 1, 0, 0, 1 };
+    static const int q3[4] = { 1, 1, 0, 0 };
+    static const int q2[4] = { 0, 1, 0, 1 };
+    static const int q1[4] = { 0, 0, 1, 1 };
+    static const int q0[4] = { 1, 0, 1, 0 };
+
+    if (k == 4)
+        y = q[q4[j]][y] ^ byteOf(L[3], j);
+    if (k >= 3)
+        y = q[q3[j]][y] ^ byteOf(L[2], j);
+    y = q[q2[j]][y] ^ byteOf(L[1], j);
+    y = q[q1[j]][y] ^ byteOf(L[0], j);
+    return q[q0[j]][y];
+}
+
+static inline uint32_t mdsColumn(int j, uint8_t y)
+{
+    return (uint32_t)gfMul(mds[0][j], y, 0x169) |
+           ((uint32_t)gfMul(mds[1][j], y, 0x169) << 8) |
+           ((uint32_t)gfMul(mds[2][j], y, 0x169) << 16) |
+           ((uint32_t)gfMul(mds[3][j], y, 0x169) << 24);
+}
+
+static uint32_t h(const uint8_t q[2][256], uint32_t x, const uint32_t* L, int k)
+{
+    uint32_t z = 0;
+
+    for (int j = 0; j < 4; j++)
+        z ^= mdsColumn(j, hByte(q, j, byteOf(x, j), L, k));
+    return z;
+}
+
+static inline uint32_t loadLe32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void storeLe32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+bool zsrtpTwofishPrepareKey(const uint8_t* key, int32_t keyLength, ZsrtpTwofishKey* xkey)
+{
+    uint8_t q[2][256];
+    uint32_t me[4], mo[4], sk[4];
+    int k = keyLength / 8;
+
+    if (keyLength != 16 && keyLength != 24 && keyLength != 32)
+        return false;
+
+    buildQ(q);
+
+    for (int i = 0; i < k; i++) {
+        me[i] = loadLe32(key + 8 * i);
+        mo[i] = loadLe32(key + 8 * i + 4);
+
+        // S-box key words in reverse order, computed with the RS code
+        uint32_t s = 0;
+        for (int r = 0; r < 4; r++) {
+            uint8_t v = 0;
+            for (int c = 0; c < 8; c++)
+                v ^= gfMul(rs[r][c], key[8 * i + c], 0x14D);
+            s |= (uint32_t)v << (8 * r);
+        }
+        sk[k - 1 - i] = s;
+    }
+
+    for (int i = 0; i < 20; i++) {
+        uint32_t a = h(q, 0x02020202u * i, me, k);
+        uint32_t b = h(q, 0x02020202u * i + 0x01010101u, mo, k);
+        b = ROL(b, 8);
+        xkey->K[2 * i] = a + b;
+        a = a + 2 * b;
+        xkey->K[2 * i + 1] = ROL(a, 9);
+    }
+
+    for (int j = 0; j < 4; j++) {
+        for (int x = 0; x < 256; x++)
+            xkey->s[j][x] = mdsColumn(j, hByte(q, j, (uint8_t)x, sk, k));
+    }
+    memset(me, 0, sizeof(me));
+    memset(mo, 0, sizeof(mo));
+    memset(sk, 0, sizeof(sk));
+    return true;
+}
+
+#define G0(k, x) ((k)->s[0][(x) & 0xFF] ^ (k)->s[1][((x) >> 8) & 0xFF] ^ \
+                  (k)->s[2][((x) >> 16) & 0xFF] ^ (k)->s[3][(x) >> 24])
+#define G1(k, x) ((k)->s[0][(x) >> 24] ^ (k)->s[1][(x) & 0xFF] ^ \
+                  (k)->s[2][((x) >> 8) & 0xFF] ^ (k)->s[3][((x) >> 16) & 0xFF])
+
+static inline void encryptWords(const ZsrtpTwofishKey* xkey, uint32_t w[4])
+{
+    const uint32_t* K = xkey->K;
+    uint32_t a = w[0] ^ K[0], b = w[1] ^ K[1], c = w[2] ^ K[2], d = w[3] ^ K[3];
+    uint32_t t0, t1;
+
+    for (int r = 0; r < 8; r++) {
+        t0 = G0(xkey, a);
+        t1 = G1(xkey, b);
+        c ^= t0 + t1 + K[8 + 4 * r];
+        c = ROR(c, 1);
+        d = ROL(d, 1) ^ (t0 + 2 * t1 + K[9 + 4 * r]);
+
+        t0 = G0(xkey, c);
+        t1 = G1(xkey, d);
+        a ^= t0 + t1 + K[10 + 4 * r];
+        a = ROR(a, 1);
+        b = ROL(b, 1) ^ (t0 + 2 * t1 + K[11 + 4 * r]);
+    }
+    w[0] = c ^ K[4];
+    w[1] = d ^ K[5];
+    w[2] = a ^ K[6];
+    w[3] = b ^ K[7];
+}
+
+void zsrtpTwofishEncrypt(const ZsrtpTwofishKey* xkey, const uint8_t in[16], uint8_t out[16])
+{
+    uint32_t w[4];
+
+    for (int i = 0; i < 4; i++)
+        w[i] = loadLe32(in + 4 * i);
+    encryptWords(xkey, w);
+    for (int i = 0; i < 4; i++)
+        storeLe32(out + 4 * i, w[i]);
+}
+
+/*
+ * Counter block n: the first 14 IV bytes and the 16 bit counter big endian
+ */
+static inline uint32_t counterWord(const uint8_t iv[16], uint32_t ctr)
+{
+    return (uint32_t)iv[12] | ((uint32_t)iv[13] << 8) |
+           (((ctr >> 8) & 0xFF) << 16) | ((ctr & 0xFF) << 24);
+}
+
+static void ctrScalar(const ZsrtpTwofishKey* xkey, const uint8_t iv[16], uint32_t ctr,
+                         uint8_t* data, int32_t length)
+{
+    uint32_t w[4];
+    uint8_t ks[16];
+
+    for (; length > 0; ctr++) {
+        w[0] = loadLe32(iv);
+        w[1] = loadLe32(iv + 4);
+        w[2] = loadLe32(iv + 8);
+        w[3] = counterWord(iv, ctr);
+        encryptWords(xkey, w);
+        for (int i = 0; i < 4; i++)
+            storeLe32(ks + 4 * i, w[i]);
+
+        int32_t n = length < 16 ? length : 16;
+        for (int32_t i = 0; i < n; i++)
+            data[i] ^= ks[i];
+        data += n;
+        length -= n;
+    }
+}
+
+#ifdef ZSRTP_TWOFISH_AVX2
+
+#define VROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define VROR(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+#define VGATHER(t, i) _mm256_i32gather_epi32((const int*)(t), (i), 4)
+
+__attribute__((target("avx2")))
+static inline __m256i vG0(const ZsrtpTwofishKey* xkey, __m256i x, __m256i mask)
+{
+    __m256i r = VGATHER(xkey->s[0], _mm256_and_si256(x, mask));
+    r = _mm256_xor_si256(r, VGATHER(xkey->s[1], _mm256_and_si256(_mm256_srli_epi32(x, 8), mask)));
+    r = _mm256_xor_si256(r, VGATHER(xkey->s[2], _mm256_and_si256(_mm256_srli_epi32(x, 16), mask)));
+    return _mm256_xor_si256(r, VGATHER(xkey->s[3], _mm256_srli_epi32(x, 24)));
+}
+
+/*
+ * Encrypt eight counter blocks in parallel, each vector holds the same
+ * word of the eight blocks.
+ */
+__attribute__((target("avx2")))
+static void ctrAvx2(const ZsrtpTwofishKey* xkey, const uint8_t iv[16], uint32_t ctr,
+                       uint8_t* data, int32_t length)
+{
+    const uint32_t* K = xkey->K;
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    uint32_t ks[4][8];
+    uint32_t w3[8];
+
+    const __m256i a0 = _mm256_set1_epi32((int)(loadLe32(iv) ^ K[0]));
+    const __m256i b0 = _mm256_set1_epi32((int)(loadLe32(iv + 4) ^ K[1]));
+    const __m256i c0 = _mm256_set1_epi32((int)(loadLe32(iv + 8) ^ K[2]));
+
+    for (; length >= 128; ctr += 8) {
+        for (int n = 0; n < 8; n++)
+            w3[n] = counterWord(iv, ctr + n) ^ K[3];
+
+        __m256i a = a0, b = b0, c = c0;
+        __m256i d = _mm256_loadu_si256((const __m256i*)w3);
+        __m256i t0, t1;
+
+        for (int r = 0; r < 8; r++) {
+            t0 = vG0(xkey, a, mask);
+            t1 = vG0(xkey, VROL(b, 8), mask);
+            c = _mm256_xor_si256(c, _mm256_add_epi32(_mm256_add_epi32(t0, t1),
+                                                     _mm256_set1_epi32((int)K[8 + 4 * r])));
+            c = VROR(c, 1);
+            d = _mm256_xor_si256(VROL(d, 1),
+                                 _mm256_add_epi32(_mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                                                  _mm256_set1_epi32((int)K[9 + 4 * r])));
+
+            t0 = vG0(xkey, c, mask);
+            t1 = vG0(xkey, VROL(d, 8), mask);
+            a = _mm256_xor_si256(a, _mm256_add_epi32(_mm256_add_epi32(t0, t1),
+                                                     _mm256_set1_epi32((int)K[10 + 4 * r])));
+            a = VROR(a, 1);
+            b = _mm256_xor_si256(VROL(b, 1),
+                                 _mm256_add_epi32(_mm256_add_epi32(t0, _mm256_add_epi32(t1, t1)),
+                                                  _mm256_set1_epi32((int)K[11 + 4 * r])));
+        }
+        _mm256_storeu_si256((__m256i*)ks[0], _mm256_xor_si256(c, _mm256_set1_epi32((int)K[4])));
+        _mm256_storeu_si256((__m256i*)ks[1], _mm256_xor_si256(d, _mm256_set1_epi32((int)K[5])));
+        _mm256_storeu_si256((__m256i*)ks[2], _mm256_xor_si256(a, _mm256_set1_epi32((int)K[6])));
+        _mm256_storeu_si256((__m256i*)ks[3], _mm256_xor_si256(b, _mm256_set1_epi32((int)K[7])));
+
+        // x86 is little endian, the words go to memory as they are
+        for (int n = 0; n < 8; n++) {
+            for (int i = 0; i < 4; i++) {
+                uint32_t v;
+                memcpy(&v, data + 4 * i, sizeof(v));
+                v ^= ks[i][n];
+                memcpy(data + 4 * i, &v, sizeof(v));
+            }
+            data += 16;
+        }
+        length -= 128;
+    }
+    ctrScalar(xkey, iv, ctr, data, length);
+}
+
+static bool haveAvx2()
+{
+    static const bool avx2 = __builtin_cpu_supports("avx2") != 0;
+    return avx2;
+}
+#endif
+
+void zsrtpTwofishCtr(const ZsrtpTwofishKey* xkey, const uint8_t iv[16], uint8_t* data, int32_t length)
+{
+#ifdef ZSRTP_TWOFISH_AVX2
+    if (length >= 128 && haveAvx2()) {
+        ctrAvx2(xkey, iv, 0, data, length);
+        return;
+    }
+#endif
+    ctrScalar(xkey, iv, 0, data, length);
+}
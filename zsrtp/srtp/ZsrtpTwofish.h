@@ -0,0 +1,67 @@
+/*
+    This file defines the Twofish counter mode of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPTWOFISH_H
+#define ZSRTPTWOFISH_H
+
+/*
+ * Twofish with full keying: the key setup folds the key dependent S-boxes
+ * and the MDS matrix into four tables of 256 words. A round then needs
+ * eight table lookups, the AVX2 code does these lookups for eight blocks
+ * at once with gather instructions.
+ */
+
+#include <stdint.h>
+
+typedef struct zsrtpTwofishKey
+{
+    uint32_t s[4][256];     /* key dependent S-boxes multiplied by MDS */
+    uint32_t K[40];         /* whitening and round keys */
+} ZsrtpTwofishKey;
+
+/**
+ * Compute the Twofish key schedule.
+ *
+ * @param key    the key, 16, 24 or 32 bytes
+ * @param keyLength length of the key in bytes
+ * @param xkey   receives the key schedule
+ * @return false if the key length is not supported.
+ */
+bool zsrtpTwofishPrepareKey(const uint8_t* key, int32_t keyLength, ZsrtpTwofishKey* xkey);
+
+/**
+ * Encrypt one 16 byte block.
+ */
+void zsrtpTwofishEncrypt(const ZsrtpTwofishKey* xkey, const uint8_t in[16], uint8_t out[16]);
+
+/**
+ * XOR data with the SRTP counter mode keystream, RFC 3711 chapter 4.1.1.
+ *
+ * The block counter starts at 0 and occupies the last two bytes of the IV,
+ * the function ignores these bytes of @c iv. Uses AVX2 if the CPU supports
+ * it.
+ *
+ * @param xkey   the key schedule
+ * @param iv     the 16 byte IV
+ * @param data   the data, encrypted or decrypted in place
+ * @param length length of the data
+ */
+void zsrtpTwofishCtr(const ZsrtpTwofishKey* xkey, const uint8_t iv[16], uint8_t* data, int32_t length);
+
+#endif
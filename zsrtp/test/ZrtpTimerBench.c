@@ -0,0 +1,145 @@
+/*
+    This file implements the timer wheel benchmark of the ZRTP transport.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Drives one shard of the ZRTP timer wheel without its thread: 10000
+ * transports with one timer each, the ZRTP retransmission pattern of
+ * scheduling and cancelling timers 50 ms to 20 s ahead. Prints the
+ * schedule/cancel operations per second, which must be at least 100000,
+ * then lets all timers expire and checks that none fired early or twice.
+ *
+ * The benchmark includes the transport source to reach the static wheel
+ * functions.
+ */
+
+#include "../transport_zrtp.c"
+#include "ZsrtpTest.h"
+
+#ifdef DYNAMIC_TIMER
+int main(int argc, char* argv[])
+{
+    printf("ZrtpTimerBench: built with DYNAMIC_TIMER, no timer wheel\n");
+    return 0;
+}
+#else
+
+#define TIMERS      10000
+#define OPERATIONS  2000000
+#define MIN_RATE    100000
+#define MAX_DELAY   20000
+
+static struct zrtp_wheel bench_wheel;
+static struct zrtp_timer timers[TIMERS];
+static int fired[TIMERS];
+static int early;
+
+static unsigned long rnd = 1;
+
+static unsigned long next_random()
+{
+    rnd = rnd * 1103515245 + 12345;
+    return rnd >> 8;
+}
+
+static void bench_timeout(void* user_data)
+{
+    struct zrtp_timer* t = (struct zrtp_timer*)user_data;
+
+    /* The wheel processes tick next while it runs the callbacks */
+    if ((long)((unsigned long)bench_wheel.next - t->expires) < 0)
+        early++;
+    fired[t - timers]++;
+}
+
+static void bench_init()
+{
+    int i;
+
+    for (i = 0; i < WHEEL_BUCKETS; i++)
+        bench_wheel.buckets[i].head.next = bench_wheel.buckets[i].head.prev =
+            &bench_wheel.buckets[i].head;
+    bench_wheel.next = (long)wheel_ticks();
+    /* No thread sleeps, schedule must not try to wake it */
+    bench_wheel.deadline = bench_wheel.next + WHEEL_FOREVER;
+
+    for (i = 0; i < TIMERS; i++)
+    {
+        timers[i].wheel = &bench_wheel;
+        timers[i].callback = &bench_timeout;
+        timers[i].user_data = &timers[i];
+    }
+}
+
+/* ZRTP retransmits after 50 ms up to seconds, some timers run for 20 s */
+static unsigned long timer_delay()
+{
+    unsigned long r = next_random() % 100;
+
+    if (r < 80)
+        return 50 + next_random() % 1200;
+    return 1250 + next_random() % (MAX_DELAY - 1250);
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t start, elapsed;
+    unsigned long end;
+    double rate;
+    int i, scheduled;
+
+    pj_init();
+    bench_init();
+
+    start = zsrtpTestNow();
+    for (i = 0; i < OPERATIONS; i++)
+    {
+        struct zrtp_timer* t = &timers[next_random() % TIMERS];
+
+        if (next_random() % 4 != 0)
+            wheel_schedule(&bench_wheel, t, timer_delay());
+        else
+            wheel_cancel(&bench_wheel, t, PJ_FALSE);
+    }
+    elapsed = zsrtpTestNow() - start;
+    rate = (double)OPERATIONS * 1e9 / (double)elapsed;
+
+    printf("Timer wheel, %d timers: %.0f schedule/cancel per second, %.0f ns each\n",
+           TIMERS, rate, (double)elapsed / OPERATIONS);
+    ZSRTP_CHECK(rate >= MIN_RATE);
+
+    /* Expire all timers, the wheel ticks without waiting for the clock */
+    scheduled = (int)bench_wheel.count;
+    end = wheel_ticks() + MAX_DELAY + 1000;
+    start = zsrtpTestNow();
+    wheel_advance(&bench_wheel, end);
+    elapsed = zsrtpTestNow() - start;
+
+    printf("Timer wheel: expired %d timers in %.1f ms\n", scheduled, (double)elapsed / 1e6);
+    ZSRTP_CHECK(bench_wheel.count == 0);
+    ZSRTP_CHECK(early == 0);
+    for (i = 0; i < TIMERS; i++)
+    {
+        ZSRTP_CHECK(fired[i] <= 1);
+        scheduled -= fired[i];
+    }
+    ZSRTP_CHECK(scheduled == 0);
+
+    return zsrtpTestResult("ZrtpTimerBench");
+}
+#endif
@@ -0,0 +1,305 @@
+/*
+    This file implements the allocation check driver of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Runs the protect and unprotect functions of all transforms in loops and
+ * fails if one of them allocated heap memory. Build with ZSRTP_ALLOC_CHECK,
+ * "make test" does this. The loops also check that a packet survives the
+ * round trip. Last, more threads than the context has cipher contexts for
+ * protect packets of one context at the same time, each of them may
+ * allocate once.
+ */
+
+#include <thread>
+#include <pjlib.h>
+#include <ZsrtpCWrapper.h>
+#include "ZsrtpTransforms.h"
+#include "ZsrtpTest.h"
+
+#ifndef ZSRTP_ALLOC_CHECK
+#error "Build the allocation check driver with ZSRTP_ALLOC_CHECK"
+#endif
+
+#define PAYLOAD     160
+#define BURST       32
+#define ROUNDS      50
+#define BUFFER_SIZE (12 + PAYLOAD + 64)
+
+typedef struct suite
+{
+    const char* name;
+    int32_t ealg;
+    int32_t aalg;
+    int32_t keyLength;
+    int32_t authKeyLength;
+    int32_t tagLength;
+} Suite;
+
+static const Suite suites[] = {
+    { "AES-CM/HMAC-SHA1",     SrtpEncryptionAESCM,  SrtpAuthenticationSha1Hmac,  16, 20, 10 },
+    { "AES-CM-256/HMAC-SHA1", SrtpEncryptionAESCM,  SrtpAuthenticationSha1Hmac,  32, 20, 4 },
+    { "AES-CM/Skein",         SrtpEncryptionAESCM,  SrtpAuthenticationSkeinHmac, 16, 32, 8 },
+    { "Twofish-CM/HMAC-SHA1", SrtpEncryptionTWOCM,  SrtpAuthenticationSha1Hmac,  16, 20, 10 },
+    { "Twofish-CM/Skein",     SrtpEncryptionTWOCM,  SrtpAuthenticationSkeinHmac, 32, 32, 4 },
+    { "AES-GCM",              SrtpEncryptionAESGCM, SrtpAuthenticationNull,      16, 0,  16 },
+};
+
+static uint8_t masterKey[32];
+static uint8_t masterSalt[14];
+
+static ZsrtpContext* newContext(const Suite* s, uint32_t ssrc)
+{
+    ZsrtpContext* ctx = zsrtp_CreateWrapper(ssrc, 0, 0L, s->ealg, s->aalg,
+                                            masterKey, s->keyLength,
+                                            masterSalt, sizeof(masterSalt),
+                                            s->keyLength, s->authKeyLength,
+                                            sizeof(masterSalt), s->tagLength);
+    zsrtp_deriveSrtpKeys(ctx, 0L);
+    return ctx;
+}
+
+static ZsrtpContextCtrl* newContextCtrl(const Suite* s, uint32_t ssrc)
+{
+    ZsrtpContextCtrl* ctx = zsrtp_CreateWrapperCtrl(ssrc, s->ealg, s->aalg,
+                                                    masterKey, s->keyLength,
+                                                    masterSalt, sizeof(masterSalt),
+                                                    s->keyLength, s->authKeyLength,
+                                                    sizeof(masterSalt), s->tagLength);
+    zsrtp_deriveSrtpKeysCtrl(ctx);
+    return ctx;
+}
+
+static uint8_t buffers[BURST][BUFFER_SIZE];
+static uint8_t plain[BURST][BUFFER_SIZE];
+static int32_t lens[BURST];
+static int32_t protLens[BURST];
+static int32_t newLens[BURST];
+static int32_t results[BURST];
+static pj_uint8_t* pkts[BURST];
+static ZsrtpContext* ctxs[BURST];
+static ZsrtpUnprotectJob jobs[BURST];
+
+/*
+ * Fill the burst buffers with n RTP packets, packet i uses stream
+ * i % streams.
+ */
+static void fillBurst(int32_t n, int32_t streams, const uint32_t ssrcs[2], uint16_t seqs[2])
+{
+    for (int32_t i = 0; i < n; i++) {
+        int32_t s = i % streams;
+
+        lens[i] = zsrtpTestRtp(buffers[i], ssrcs[s], seqs[s]++, PAYLOAD);
+        memcpy(plain[i], buffers[i], lens[i]);
+        pkts[i] = buffers[i];
+    }
+}
+
+static void checkBurst(int32_t n)
+{
+    for (int32_t i = 0; i < n; i++) {
+        ZSRTP_CHECK(results[i] == 1);
+        ZSRTP_CHECK(newLens[i] == lens[i]);
+        ZSRTP_CHECK(memcmp(buffers[i], plain[i], lens[i]) == 0);
+    }
+}
+
+static void runSuite(const Suite* s)
+{
+    const uint32_t ssrcs[2] = { 0x11223344, 0x55667788 };
+    uint16_t seqs[2] = { 0xfff0, 0x7ff0 };      /* the first wraps the ROC */
+    int32_t newLength;
+
+    ZsrtpContext* tx[2] = { newContext(s, ssrcs[0]), newContext(s, ssrcs[1]) };
+    ZsrtpContext* rx = newContext(s, ssrcs[0]);
+    ZsrtpContextCtrl* txCtrl = newContextCtrl(s, ssrcs[0]);
+    ZsrtpContextCtrl* rxCtrl = newContextCtrl(s, ssrcs[0]);
+
+    zsrtp_enableStreamTable(rx, 4);
+    zsrtp_enableStreamTableCtrl(rxCtrl, 4);
+    zsrtp_setReplayWindow(rx, 1024);
+
+    zsrtp_resetAllocViolations();
+
+    for (int32_t round = 0; round < ROUNDS; round++) {
+        /* One packet at a time */
+        for (int32_t i = 0; i < BURST; i++) {
+            fillBurst(1, 1, ssrcs, seqs);
+            ZSRTP_CHECK(zsrtp_protect(tx[0], buffers[0], lens[0], &newLength) == 1);
+            ZSRTP_CHECK(newLength == lens[0] + zsrtp_getTrailerLength(tx[0]));
+            results[0] = zsrtp_unprotect(rx, buffers[0], newLength, &newLens[0]);
+            checkBurst(1);
+
+            /* A replayed packet fails */
+            ZSRTP_CHECK(zsrtp_protect(tx[0], buffers[0], lens[0], &newLength) == 1);
+            ZSRTP_CHECK(zsrtp_unprotect(rx, buffers[0], newLength, &newLens[0]) == -2);
+        }
+
+        /* Bursts of one stream */
+        fillBurst(BURST, 1, ssrcs, seqs);
+        ZSRTP_CHECK(zsrtp_protect_batch(tx[0], pkts, lens, BURST, protLens) == BURST);
+        ZSRTP_CHECK(zsrtp_unprotect_batch(rx, pkts, protLens, BURST, newLens, results) == BURST);
+        checkBurst(BURST);
+
+        /* Packets of two streams, the receiver uses its stream table */
+        fillBurst(BURST, 2, ssrcs, seqs);
+        for (int32_t i = 0; i < BURST; i++)
+            ctxs[i] = tx[i % 2];
+        ZSRTP_CHECK(zsrtp_protect_multi(ctxs, pkts, lens, BURST, protLens) == BURST);
+        ZSRTP_CHECK(zsrtp_unprotect_batch(rx, pkts, protLens, BURST, newLens, results) == BURST);
+        checkBurst(BURST);
+
+        /* Prepare, run and commit */
+        fillBurst(BURST, 2, ssrcs, seqs);
+        ZSRTP_CHECK(zsrtp_protect_multi(ctxs, pkts, lens, BURST, protLens) == BURST);
+        int32_t todo = zsrtp_unprotect_prepare(rx, pkts, protLens, BURST, jobs);
+        ZSRTP_CHECK(todo == BURST);
+        for (int32_t i = BURST - 1; i >= 0; i--)
+            zsrtp_unprotect_run(rx, &jobs[i]);
+        ZSRTP_CHECK(zsrtp_unprotect_commit(rx, jobs, BURST, newLens, results) == BURST);
+        checkBurst(BURST);
+
+        /* A modified packet fails */
+        fillBurst(1, 1, ssrcs, seqs);
+        ZSRTP_CHECK(zsrtp_protect(tx[0], buffers[0], lens[0], &newLength) == 1);
+        buffers[0][20] ^= 1;
+        ZSRTP_CHECK(zsrtp_unprotect(rx, buffers[0], newLength, &newLens[0]) == -1);
+
+        /* SRTCP: sender report header and some report data */
+        for (int32_t i = 0; i < BURST; i++) {
+            uint8_t* rtcp = buffers[0];
+
+            lens[0] = zsrtpTestRtp(rtcp, ssrcs[0], (uint16_t)i, 40);
+            rtcp[0] = 0x80;
+            rtcp[1] = 200;
+            memcpy(rtcp + 4, rtcp + 8, 4);
+            memcpy(plain[0], rtcp, lens[0]);
+            ZSRTP_CHECK(zsrtp_protectCtrl(txCtrl, rtcp, lens[0], &newLength) == 1);
+            ZSRTP_CHECK(newLength == lens[0] + zsrtp_getTrailerLengthCtrl(txCtrl));
+            ZSRTP_CHECK(zsrtp_unprotectCtrl(rxCtrl, rtcp, newLength, &newLens[0]) == 1);
+            ZSRTP_CHECK(newLens[0] == lens[0]);
+            ZSRTP_CHECK(memcmp(rtcp, plain[0], lens[0]) == 0);
+        }
+    }
+
+    uint64_t violations = zsrtp_getAllocViolations();
+    if (violations != 0)
+        fprintf(stderr, "%s: %llu heap allocations in the packet path\n",
+                s->name, (unsigned long long)violations);
+    ZSRTP_CHECK(violations == 0);
+
+    zsrtp_DestroyWrapper(tx[0]);
+    zsrtp_DestroyWrapper(tx[1]);
+    zsrtp_DestroyWrapper(rx);
+    zsrtp_DestroyWrapperCtrl(txCtrl);
+    zsrtp_DestroyWrapperCtrl(rxCtrl);
+}
+
+#define SENDERS      6
+#define SEND_ROUNDS  2000
+
+static void sendPackets(ZsrtpContext* ctx, int32_t sender, int32_t* failures)
+{
+    uint8_t pkt[BUFFER_SIZE];
+    int32_t newLength;
+
+    for (int32_t i = 0; i < SEND_ROUNDS; i++) {
+        int32_t length = zsrtpTestRtp(pkt, 0x11223344, (uint16_t)(sender * SEND_ROUNDS + i), PAYLOAD);
+        if (zsrtp_protect(ctx, pkt, length, &newLength) != 1)
+            (*failures)++;
+    }
+}
+
+/*
+ * When more threads than zsrtp_setConcurrency() use the AES transforms, a
+ * thread that finds no free cipher context creates its own copy once and
+ * uses it from then on.
+ */
+static void runConcurrent(const Suite* s)
+{
+    std::thread* senders[SENDERS];
+    int32_t failures[SENDERS];
+
+    ZSRTP_CHECK(zsrtp_setConcurrency(2) == 1);
+    ZsrtpContext* tx = newContext(s, 0x11223344);
+
+    zsrtp_resetAllocViolations();
+    for (int32_t i = 0; i < SENDERS; i++) {
+        failures[i] = 0;
+        senders[i] = new std::thread(sendPackets, tx, i, &failures[i]);
+    }
+    for (int32_t i = 0; i < SENDERS; i++) {
+        senders[i]->join();
+        delete senders[i];
+        ZSRTP_CHECK(failures[i] == 0);
+    }
+    ZSRTP_CHECK(zsrtp_getAllocViolations() <= SENDERS);
+
+    zsrtp_DestroyWrapper(tx);
+    ZSRTP_CHECK(zsrtp_setConcurrency(ZSRTP_CONCURRENCY_DEFAULT) == 1);
+}
+
+/*
+ * A thread that finds all slots busy gets its own copy, and the same one
+ * on the next try.
+ */
+static void checkThreadCopy()
+{
+    uint8_t key[16] = { 0 };
+    int32_t slots[3];
+
+    ZSRTP_CHECK(zsrtp_setConcurrency(2) == 1);
+    EVP_CIPHER_CTX* keyed = EVP_CIPHER_CTX_new();
+    ZSRTP_CHECK(EVP_EncryptInit_ex(keyed, EVP_aes_128_ctr(), NULL, key, NULL) == 1);
+
+    SrtpEvpPool pool;
+    ZSRTP_CHECK(pool.init(keyed));
+    EVP_CIPHER_CTX* a = pool.acquire(&slots[0]);
+    EVP_CIPHER_CTX* b = pool.acquire(&slots[1]);
+    EVP_CIPHER_CTX* c = pool.acquire(&slots[2]);
+    ZSRTP_CHECK(a != NULL && b != NULL && c != NULL && a != b && c != a && c != b);
+    ZSRTP_CHECK(slots[0] >= 0 && slots[1] >= 0 && slots[2] == -1);
+    pool.release(slots[2]);
+    ZSRTP_CHECK(pool.acquire(&slots[2]) == c && slots[2] == -1);
+    pool.release(slots[2]);
+    pool.release(slots[1]);
+    pool.release(slots[0]);
+
+    ZSRTP_CHECK(zsrtp_setConcurrency(ZSRTP_CONCURRENCY_DEFAULT) == 1);
+}
+
+int main(int argc, char* argv[])
+{
+    pj_init();
+
+    for (size_t i = 0; i < sizeof(masterKey); i++)
+        masterKey[i] = (uint8_t)(0x10 + i);
+    for (size_t i = 0; i < sizeof(masterSalt); i++)
+        masterSalt[i] = (uint8_t)(0xa0 + i);
+
+    for (size_t i = 0; i < sizeof(suites) / sizeof(suites[0]); i++)
+        runSuite(&suites[i]);
+
+    ZSRTP_CHECK(zsrtp_setConcurrency(0) == 0);
+    ZSRTP_CHECK(zsrtp_setConcurrency(ZSRTP_CONCURRENCY_MAX + 1) == 0);
+    runConcurrent(&suites[0]);
+    runConcurrent(&suites[5]);
+    checkThreadCopy();
+
+    return zsrtpTestResult("ZsrtpAllocTest");
+}
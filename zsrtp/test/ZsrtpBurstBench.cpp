@@ -0,0 +1,205 @@
+/*
+    This file implements the burst decryption benchmark of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Decryption latency of a 1 MB video keyframe: 874 SRTP packets of 1200
+ * bytes payload arrive as one burst. Compares zsrtp_unprotect_batch() on
+ * one thread with zsrtp_unprotect_prepare(), _run() on 1, 2 and 4 threads
+ * and _commit(). Prints the time from the first packet to the last
+ * decrypted packet and checks that all packets decrypt correctly.
+ */
+
+#include <atomic>
+#include <thread>
+#include <pjlib.h>
+#include <ZsrtpCWrapper.h>
+#include "ZsrtpTest.h"
+
+#define PAYLOAD     1200
+#define PACKETS     874                 /* 874 * 1200 bytes = 1 MB */
+#define ROUNDS      50
+#define MAX_THREADS 4
+#define BUFFER_SIZE (12 + PAYLOAD + 16)
+
+typedef struct suite
+{
+    const char* name;
+    int32_t ealg;
+    int32_t aalg;
+    int32_t authKeyLength;
+    int32_t tagLength;
+} Suite;
+
+static const Suite suites[] = {
+    { "AES-CM/HMAC-SHA1", SrtpEncryptionAESCM,  SrtpAuthenticationSha1Hmac, 20, 10 },
+    { "AES-GCM",          SrtpEncryptionAESGCM, SrtpAuthenticationNull,     0,  16 },
+};
+
+static uint8_t masterKey[16];
+static uint8_t masterSalt[14];
+
+static uint8_t buffers[PACKETS][BUFFER_SIZE];
+static uint8_t plain[PACKETS][BUFFER_SIZE];
+static pj_uint8_t* pkts[PACKETS];
+static int32_t lens[PACKETS];
+static int32_t protLens[PACKETS];
+static int32_t newLens[PACKETS];
+static int32_t results[PACKETS];
+static ZsrtpUnprotectJob jobs[PACKETS];
+
+/*
+ * Helper threads of the run step. The main thread starts a burst by
+ * incrementing the generation, all threads take jobs from a shared
+ * counter until none is left.
+ */
+static ZsrtpContext* runCtx;
+static std::atomic<int32_t> nextJob;
+static std::atomic<int32_t> finished;
+static std::atomic<uint32_t> generation;
+static std::atomic<bool> stopHelpers;
+static int32_t activeHelpers;
+
+static void runJobs()
+{
+    int32_t i;
+
+    while ((i = nextJob.fetch_add(1)) < PACKETS)
+        zsrtp_unprotect_run(runCtx, &jobs[i]);
+}
+
+static void helper(int32_t id)
+{
+    uint32_t seen = 0;
+
+    for (;;) {
+        uint32_t g;
+        while ((g = generation.load(std::memory_order_acquire)) == seen) {
+            if (stopHelpers.load(std::memory_order_relaxed))
+                return;
+            std::this_thread::yield();
+        }
+        seen = g;
+        if (id < activeHelpers)
+            runJobs();
+        finished.fetch_add(1, std::memory_order_release);
+    }
+}
+
+static ZsrtpContext* newContext(const Suite* s)
+{
+    ZsrtpContext* ctx = zsrtp_CreateWrapper(0x11223344, 0, 0L, s->ealg, s->aalg,
+                                            masterKey, sizeof(masterKey),
+                                            masterSalt, sizeof(masterSalt),
+                                            sizeof(masterKey), s->authKeyLength,
+                                            sizeof(masterSalt), s->tagLength);
+    zsrtp_deriveSrtpKeys(ctx, 0L);
+    return ctx;
+}
+
+static void makeKeyframe(ZsrtpContext* tx, uint16_t* seq)
+{
+    for (int32_t i = 0; i < PACKETS; i++) {
+        lens[i] = zsrtpTestRtp(buffers[i], 0x11223344, (*seq)++, PAYLOAD);
+        memcpy(plain[i], buffers[i], lens[i]);
+        pkts[i] = buffers[i];
+    }
+    ZSRTP_CHECK(zsrtp_protect_batch(tx, pkts, lens, PACKETS, protLens) == PACKETS);
+}
+
+static void checkKeyframe()
+{
+    for (int32_t i = 0; i < PACKETS; i++) {
+        ZSRTP_CHECK(results[i] == 1);
+        ZSRTP_CHECK(newLens[i] == lens[i]);
+        ZSRTP_CHECK(memcmp(buffers[i], plain[i], lens[i]) == 0);
+    }
+}
+
+/*
+ * threads 0: zsrtp_unprotect_batch, otherwise prepare, run and commit
+ */
+static double decryptKeyframes(const Suite* s, int32_t threads)
+{
+    ZsrtpContext* tx = newContext(s);
+    ZsrtpContext* rx = newContext(s);
+    uint16_t seq = 1;
+    uint64_t total = 0;
+
+    runCtx = rx;
+    activeHelpers = threads - 1;
+
+    for (int32_t r = 0; r < ROUNDS; r++) {
+        makeKeyframe(tx, &seq);
+
+        uint64_t start = zsrtpTestNow();
+        if (threads == 0) {
+            ZSRTP_CHECK(zsrtp_unprotect_batch(rx, pkts, protLens, PACKETS, newLens, results) == PACKETS);
+        }
+        else {
+            ZSRTP_CHECK(zsrtp_unprotect_prepare(rx, pkts, protLens, PACKETS, jobs) == PACKETS);
+            nextJob.store(0);
+            finished.store(0);
+            generation.fetch_add(1, std::memory_order_release);
+            runJobs();
+            while (finished.load(std::memory_order_acquire) < MAX_THREADS - 1)
+                std::this_thread::yield();
+            ZSRTP_CHECK(zsrtp_unprotect_commit(rx, jobs, PACKETS, newLens, results) == PACKETS);
+        }
+        total += zsrtpTestNow() - start;
+        checkKeyframe();
+    }
+
+    zsrtp_DestroyWrapper(tx);
+    zsrtp_DestroyWrapper(rx);
+    return (double)total / ROUNDS / 1000.0;
+}
+
+int main(int argc, char* argv[])
+{
+    std::thread* helpers[MAX_THREADS - 1];
+
+    pj_init();
+    for (size_t i = 0; i < sizeof(masterKey); i++)
+        masterKey[i] = (uint8_t)(0x10 + i);
+    for (size_t i = 0; i < sizeof(masterSalt); i++)
+        masterSalt[i] = (uint8_t)(0xa0 + i);
+
+    ZSRTP_CHECK(zsrtp_setConcurrency(MAX_THREADS) == 1);
+    for (int32_t i = 0; i < MAX_THREADS - 1; i++)
+        helpers[i] = new std::thread(helper, i);
+
+    printf("1 MB keyframe, %d packets of %d bytes, %u CPUs\n",
+           PACKETS, PAYLOAD, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < sizeof(suites) / sizeof(suites[0]); i++) {
+        const Suite* s = &suites[i];
+
+        printf("%-18s %7.0f us batch", s->name, decryptKeyframes(s, 0));
+        for (int32_t threads = 1; threads <= MAX_THREADS; threads *= 2)
+            printf(", %7.0f us %d thread%s", decryptKeyframes(s, threads),
+                   threads, threads > 1 ? "s" : "");
+        printf("\n");
+    }
+
+    stopHelpers.store(true);
+    for (int32_t i = 0; i < MAX_THREADS - 1; i++) {
+        helpers[i]->join();
+        delete helpers[i];
+    }
+    return zsrtpTestResult("ZsrtpBurstBench");
+}
@@ -0,0 +1,144 @@
+/*
+    This file implements the benchmark of the SRTP authentication transforms.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Compares the MAC cost per packet with the key state precomputed once
+ * (SrtpHmacSha1, SrtpSkeinMac) against keying the MAC for each packet, as
+ * the ZRTP library's HMAC and Skein-MAC helpers do. Prints ns/packet for
+ * 20, 160 and 1200 byte payloads and checks that both compute the same
+ * tag.
+ */
+
+#include <openssl/hmac.h>
+#include "ZsrtpTransforms.h"
+#include "ZsrtpTest.h"
+
+#define ROUNDS  200000
+#define SHA1_TAG_LENGTH  10
+#define SKEIN_TAG_LENGTH 8
+
+static uint8_t masterKey[16];
+static uint8_t masterSalt[14];
+static uint8_t authKey[32];
+static uint8_t packet[12 + 1200 + 4];
+
+static volatile uint8_t sink;
+
+static void storeRoc(uint8_t* p, uint32_t roc)
+{
+    p[0] = (uint8_t)(roc >> 24);
+    p[1] = (uint8_t)(roc >> 16);
+    p[2] = (uint8_t)(roc >> 8);
+    p[3] = (uint8_t)roc;
+}
+
+static void benchSha1(int32_t payload)
+{
+    uint8_t tag[SHA_DIGEST_LENGTH];
+    uint8_t ref[SHA_DIGEST_LENGTH];
+    unsigned int refLength;
+    int32_t length = zsrtpTestRtp(packet, 0x11223344, 1, payload);
+
+    SrtpHmacSha1 mac(masterKey, sizeof(masterKey), masterSalt, sizeof(masterSalt),
+                     20, SHA1_TAG_LENGTH, false, false);
+    ZSRTP_CHECK(mac.deriveKeys());
+    ZSRTP_CHECK(zsrtpDeriveKey(masterKey, sizeof(masterKey), masterSalt,
+                               SRTP_LABEL_RTP_AUTH, authKey, 20));
+
+    /* The packet buffer holds the ROC after the data for the one-shot HMAC */
+    storeRoc(packet + length, 0);
+    mac.authenticate(packet, length, 0, tag);
+    HMAC(EVP_sha1(), authKey, 20, packet, length + 4, ref, &refLength);
+    ZSRTP_CHECK(memcmp(tag, ref, SHA1_TAG_LENGTH) == 0);
+
+    uint64_t start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        mac.authenticate(packet, length, i, tag);
+        sink ^= tag[0];
+    }
+    uint64_t keyed = zsrtpTestNow() - start;
+
+    start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        storeRoc(packet + length, i);
+        HMAC(EVP_sha1(), authKey, 20, packet, length + 4, ref, &refLength);
+        sink ^= ref[0];
+    }
+    uint64_t perPacket = zsrtpTestNow() - start;
+
+    printf("HMAC-SHA1  %4d bytes: %6.0f ns/packet precomputed key, %6.0f ns/packet keyed per packet\n",
+           payload, (double)keyed / ROUNDS, (double)perPacket / ROUNDS);
+}
+
+static void benchSkein(int32_t payload)
+{
+    uint8_t tag[SKEIN_TAG_LENGTH];
+    uint8_t ref[SKEIN_TAG_LENGTH];
+    uint8_t roc[4];
+    ZsrtpSkeinMacKey key;
+    int32_t length = zsrtpTestRtp(packet, 0x11223344, 1, payload);
+
+    SrtpSkeinMac mac(masterKey, sizeof(masterKey), masterSalt, sizeof(masterSalt),
+                     32, SKEIN_TAG_LENGTH, false, false);
+    ZSRTP_CHECK(mac.deriveKeys());
+    ZSRTP_CHECK(zsrtpDeriveKey(masterKey, sizeof(masterKey), masterSalt,
+                               SRTP_LABEL_RTP_AUTH, authKey, 32));
+
+    storeRoc(roc, 0);
+    mac.authenticate(packet, length, 0, tag);
+    ZSRTP_CHECK(zsrtpSkeinMacInit(authKey, 32, SKEIN_TAG_LENGTH, &key));
+    zsrtpSkeinMac(&key, packet, length, roc, sizeof(roc), ref);
+    ZSRTP_CHECK(memcmp(tag, ref, SKEIN_TAG_LENGTH) == 0);
+
+    uint64_t start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        mac.authenticate(packet, length, i, tag);
+        sink ^= tag[0];
+    }
+    uint64_t keyed = zsrtpTestNow() - start;
+
+    start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        storeRoc(roc, i);
+        zsrtpSkeinMacInit(authKey, 32, SKEIN_TAG_LENGTH, &key);
+        zsrtpSkeinMac(&key, packet, length, roc, sizeof(roc), ref);
+        sink ^= ref[0];
+    }
+    uint64_t perPacket = zsrtpTestNow() - start;
+
+    printf("Skein-MAC  %4d bytes: %6.0f ns/packet precomputed key, %6.0f ns/packet keyed per packet\n",
+           payload, (double)keyed / ROUNDS, (double)perPacket / ROUNDS);
+}
+
+int main(int argc, char* argv[])
+{
+    static const int32_t payloads[] = { 20, 160, 1200 };
+
+    for (size_t i = 0; i < sizeof(masterKey); i++)
+        masterKey[i] = (uint8_t)(0x10 + i);
+    for (size_t i = 0; i < sizeof(masterSalt); i++)
+        masterSalt[i] = (uint8_t)(0xa0 + i);
+
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++)
+        benchSha1(payloads[i]);
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++)
+        benchSkein(payloads[i]);
+
+    return zsrtpTestResult("ZsrtpMacBench");
+}
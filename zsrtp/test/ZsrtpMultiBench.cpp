@@ -0,0 +1,161 @@
+/*
+    This file implements the benchmark of the multi-buffer SRTP protection.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * A conference bridge tick: one 160 byte packet on each of 256 streams,
+ * every stream has its own key. Compares protecting the packets one by one
+ * with zsrtp_protect_multi, for the AES-CM encryption alone and for the
+ * whole SRTP protection, and checks that both produce the same packets.
+ */
+
+#include <pjlib.h>
+#include <ZsrtpCWrapper.h>
+#include "ZsrtpTransforms.h"
+#include "ZsrtpTest.h"
+
+#define STREAMS 256
+#define PAYLOAD 160
+#define ROUNDS  400
+#define BUFFER_SIZE (12 + PAYLOAD + 32)
+
+static uint8_t buffers[STREAMS][BUFFER_SIZE];
+static uint8_t check[STREAMS][BUFFER_SIZE];
+static pj_uint8_t* pkts[STREAMS];
+static int32_t lens[STREAMS];
+static int32_t newLens[STREAMS];
+static ZsrtpAesCtrJob jobs[STREAMS];
+
+static void makeKey(uint8_t* key, int32_t keyLength, uint8_t* salt, int32_t stream)
+{
+    for (int32_t i = 0; i < keyLength; i++)
+        key[i] = (uint8_t)(stream * 7 + i);
+    for (int32_t i = 0; i < 14; i++)
+        salt[i] = (uint8_t)(stream * 3 + 0xa0 + i);
+}
+
+static void benchCipher(int32_t keyLength)
+{
+    uint8_t key[32], salt[14];
+    SrtpAesCm* ciphers[STREAMS];
+
+    for (int32_t s = 0; s < STREAMS; s++) {
+        makeKey(key, keyLength, salt, s);
+        ciphers[s] = new SrtpAesCm(key, keyLength, salt, sizeof(salt), false);
+        ciphers[s]->deriveKeys();
+    }
+    if (!ciphers[0]->multiJob(&jobs[0], buffers[0], PAYLOAD, 0, 0)) {
+        printf("AES-%d-CM: no multi-buffer support on this CPU\n", keyLength * 8);
+        goto done;
+    }
+
+    {
+        uint64_t start = zsrtpTestNow();
+        for (int32_t r = 0; r < ROUNDS; r++) {
+            for (int32_t s = 0; s < STREAMS; s++)
+                ciphers[s]->crypt(buffers[s], PAYLOAD, r, s);
+        }
+        uint64_t single = zsrtpTestNow() - start;
+
+        start = zsrtpTestNow();
+        for (int32_t r = 0; r < ROUNDS; r++) {
+            for (int32_t s = 0; s < STREAMS; s++)
+                ciphers[s]->multiJob(&jobs[s], check[s], PAYLOAD, r, s);
+            zsrtpAesCtrMulti(jobs, STREAMS);
+        }
+        uint64_t multi = zsrtpTestNow() - start;
+
+        for (int32_t s = 0; s < STREAMS; s++)
+            ZSRTP_CHECK(memcmp(buffers[s], check[s], PAYLOAD) == 0);
+
+        printf("AES-%d-CM %d bytes: %5.0f ns/packet one by one, %5.0f ns/packet multi-buffer\n",
+               keyLength * 8, PAYLOAD, (double)single / (ROUNDS * STREAMS),
+               (double)multi / (ROUNDS * STREAMS));
+    }
+
+done:
+    for (int32_t s = 0; s < STREAMS; s++)
+        delete ciphers[s];
+}
+
+static ZsrtpContext* newContext(int32_t stream, int32_t keyLength)
+{
+    uint8_t key[32], salt[14];
+
+    makeKey(key, keyLength, salt, stream);
+    ZsrtpContext* ctx = zsrtp_CreateWrapper(stream, 0, 0L, SrtpEncryptionAESCM,
+                                            SrtpAuthenticationSha1Hmac,
+                                            key, keyLength, salt, sizeof(salt),
+                                            keyLength, 20, sizeof(salt), 10);
+    zsrtp_deriveSrtpKeys(ctx, 0L);
+    return ctx;
+}
+
+static void benchProtect(int32_t keyLength)
+{
+    ZsrtpContext* single[STREAMS];
+    ZsrtpContext* multi[STREAMS];
+    int32_t newLength;
+    uint64_t singleTime = 0, multiTime = 0;
+
+    for (int32_t s = 0; s < STREAMS; s++) {
+        single[s] = newContext(s, keyLength);
+        multi[s] = newContext(s, keyLength);
+        pkts[s] = check[s];
+    }
+
+    for (int32_t r = 0; r < ROUNDS; r++) {
+        for (int32_t s = 0; s < STREAMS; s++) {
+            lens[s] = zsrtpTestRtp(buffers[s], s, (uint16_t)r, PAYLOAD);
+            memcpy(check[s], buffers[s], lens[s]);
+        }
+
+        uint64_t start = zsrtpTestNow();
+        for (int32_t s = 0; s < STREAMS; s++)
+            zsrtp_protect(single[s], buffers[s], lens[s], &newLength);
+        singleTime += zsrtpTestNow() - start;
+
+        start = zsrtpTestNow();
+        zsrtp_protect_multi(multi, pkts, lens, STREAMS, newLens);
+        multiTime += zsrtpTestNow() - start;
+
+        for (int32_t s = 0; s < STREAMS; s++) {
+            ZSRTP_CHECK(newLens[s] == newLength);
+            ZSRTP_CHECK(memcmp(buffers[s], check[s], newLength) == 0);
+        }
+    }
+    printf("SRTP AES-%d-CM/HMAC-SHA1 %d bytes: %5.0f ns/packet zsrtp_protect, "
+           "%5.0f ns/packet zsrtp_protect_multi\n",
+           keyLength * 8, PAYLOAD, (double)singleTime / (ROUNDS * STREAMS),
+           (double)multiTime / (ROUNDS * STREAMS));
+
+    for (int32_t s = 0; s < STREAMS; s++) {
+        zsrtp_DestroyWrapper(single[s]);
+        zsrtp_DestroyWrapper(multi[s]);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    benchCipher(16);
+    benchCipher(32);
+    benchProtect(16);
+    benchProtect(32);
+
+    return zsrtpTestResult("ZsrtpMultiBench");
+}
@@ -0,0 +1,164 @@
+/*
+    This file implements the replay window test of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Model check of SrtpReplayWindow: random packet indices, reordered,
+ * duplicated, far too old and far ahead, go to the window and to a naive
+ * model that keeps every received index in a set. Both must agree on every
+ * check. The window sizes cover the minimum, sizes that are not a multiple
+ * of 64 and resizing while packets arrive.
+ */
+
+#include <set>
+#include "ZsrtpTransforms.h"
+#include "ZsrtpTest.h"
+
+#define STEPS 200000
+
+class ReplayModel
+{
+public:
+    ReplayModel(int32_t size) : size(size), highest(0), initialized(false) {}
+
+    bool check(int64_t index) const {
+        if (index < 0)
+            return false;
+        if (!initialized || index > highest)
+            return true;
+        return highest - index < size && received.count(index) == 0;
+    }
+
+    void update(int64_t index) {
+        if (!initialized || index > highest) {
+            highest = index;
+            initialized = true;
+        }
+        else if (highest - index >= size) {
+            return;
+        }
+        received.insert(index);
+    }
+
+    /* The window keeps the packets that the old and the new size cover */
+    void setSize(int32_t newSize) {
+        int32_t keep = size < newSize ? size : newSize;
+        std::set<int64_t>::iterator it = received.begin();
+        while (it != received.end()) {
+            if (highest - *it >= keep)
+                received.erase(it++);
+            else
+                ++it;
+        }
+        size = newSize;
+    }
+
+private:
+    std::set<int64_t> received;
+    int32_t size;
+    int64_t highest;
+    bool initialized;
+};
+
+static uint32_t rnd = 1;
+
+static uint32_t nextRandom()
+{
+    rnd = rnd * 1103515245 + 12345;
+    return rnd >> 8;
+}
+
+/*
+ * Mostly indices close to the highest one, some duplicates of recent
+ * packets, some far behind and some jumps that move the window by more
+ * than its ring.
+ */
+static int64_t nextIndex(int64_t highest, int32_t size)
+{
+    uint32_t kind = nextRandom() % 100;
+
+    if (kind < 60)
+        return highest + 1 + nextRandom() % 4;
+    if (kind < 90)
+        return highest - (int64_t)(nextRandom() % (size + 16));
+    if (kind < 97)
+        return highest - (int64_t)(nextRandom() % (4 * size + 256));
+    return highest + 1 + nextRandom() % (8 * size + 1024);
+}
+
+static void modelCheck(int32_t size, bool resize)
+{
+    static const int32_t sizes[] = { 64, 65, 128, 1000, 4096 };
+    SrtpReplayWindow window(size);
+    ReplayModel model(size);
+    int64_t highest = 1000;
+    int32_t errors = 0;
+
+    ZSRTP_CHECK(window.getSize() == size);
+
+    for (int32_t step = 0; step < STEPS && errors < 10; step++) {
+        if (resize && step % 5000 == 4999) {
+            int32_t newSize = sizes[nextRandom() % (sizeof(sizes) / sizeof(sizes[0]))];
+            ZSRTP_CHECK(window.setSize(newSize));
+            model.setSize(newSize);
+            size = newSize;
+        }
+
+        int64_t index = nextIndex(highest, size);
+        bool accept = model.check(index);
+        if (window.check(index) != accept) {
+            fprintf(stderr, "size %d step %d: index %lld highest %lld: window %d model %d\n",
+                    size, step, (long long)index, (long long)highest, !accept, accept);
+            errors++;
+        }
+        /* Like the receiver: only accepted packets update the window */
+        if (accept) {
+            window.update(index);
+            model.update(index);
+            if (index > highest)
+                highest = index;
+        }
+    }
+    ZSRTP_CHECK(errors == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    SrtpReplayWindow window(64);
+
+    ZSRTP_CHECK(!window.setSize(63));
+    ZSRTP_CHECK(window.getSize() == 64);
+    ZSRTP_CHECK(!window.check(-1));
+
+    /* Reset forgets the indices but keeps the size */
+    ZSRTP_CHECK(window.setSize(256));
+    window.update(500);
+    ZSRTP_CHECK(!window.check(500));
+    ZSRTP_CHECK(!window.check(500 - 256));
+    window.reset();
+    ZSRTP_CHECK(window.check(500));
+    ZSRTP_CHECK(window.getSize() == 256);
+
+    modelCheck(64, false);
+    modelCheck(100, false);
+    modelCheck(1000, false);
+    modelCheck(4096, false);
+    modelCheck(64, true);
+
+    return zsrtpTestResult("ZsrtpReplayTest");
+}
@@ -0,0 +1,100 @@
+/*
+    This file implements the Skein tests of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Checks Skein-512-512 against the reference vectors of the Skein 1.3
+ * submission (skein_golden_kat_short_internals.txt), and checks that a
+ * MAC over data plus trailer equals the MAC over the same bytes in one
+ * buffer.
+ */
+
+#include "ZsrtpSkein.h"
+#include "ZsrtpTest.h"
+
+typedef struct kat
+{
+    int32_t length;         /* message FF, FE, FD, ... */
+    const char* digest;
+} Kat;
+
+static const Kat kats[] = {
+    { 1,   "71B7BCE6FE6452227B9CED6014249E5BF9A9754C3AD618CCC4E0AAE16B316CC8"
+           "CA698D864307ED3E80B6EF1570812AC5272DC409B5A012DF2A579102F340617A" },
+    { 64,  "45863BA3BE0C4DFC27E75D358496F4AC9A736A505D9313B42B2F5EADA79FC17F"
+           "63861E947AFB1D056AA199575AD3F8C9A3CC1780B5E5FA4CAE050E989876625B" },
+    { 128, "91CCA510C263C4DDD010530A33073309628631F308747E1BCBAA90E451CAB92E"
+           "5188087AF4188773A332303E6667A7A210856F742139000071F48E8BA2A5ADB7" },
+};
+
+static void checkKat(const Kat* k)
+{
+    ZsrtpSkeinMacKey mkey;
+    uint8_t msg[128], digest[64], expected[64];
+
+    for (int32_t i = 0; i < k->length; i++)
+        msg[i] = (uint8_t)(0xff - i);
+
+    /* No key gives plain Skein-512 */
+    ZSRTP_CHECK(zsrtpSkeinMacInit(NULL, 0, 64, &mkey));
+    zsrtpSkeinMac(&mkey, msg, k->length, NULL, 0, digest);
+    ZSRTP_CHECK(zsrtpTestHex(k->digest, expected) == 64);
+    ZSRTP_CHECK(memcmp(digest, expected, 64) == 0);
+}
+
+/*
+ * The trailer takes the last bytes of the buffer, lengths around the 64
+ * byte block boundaries.
+ */
+static void checkTrailer(int32_t macLength)
+{
+    ZsrtpSkeinMacKey mkey;
+    uint8_t key[32], data[300], whole[64], split[64];
+
+    for (int32_t i = 0; i < (int32_t)sizeof(key); i++)
+        key[i] = (uint8_t)(0x40 + i);
+    for (int32_t i = 0; i < (int32_t)sizeof(data); i++)
+        data[i] = (uint8_t)(i * 7);
+    ZSRTP_CHECK(zsrtpSkeinMacInit(key, sizeof(key), macLength, &mkey));
+
+    for (int32_t length = 0; length <= 260; length++) {
+        zsrtpSkeinMac(&mkey, data, length, NULL, 0, whole);
+        for (int32_t t = 1; t <= 8 && t <= length; t++) {
+            memset(split, 0, sizeof(split));
+            zsrtpSkeinMac(&mkey, data, length - t, data + length - t, t, split);
+            ZSRTP_CHECK(memcmp(whole, split, macLength) == 0);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    ZsrtpSkeinMacKey mkey;
+
+    for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++)
+        checkKat(&kats[i]);
+
+    checkTrailer(4);
+    checkTrailer(8);
+    checkTrailer(64);
+
+    ZSRTP_CHECK(!zsrtpSkeinMacInit(NULL, 0, 0, &mkey));
+    ZSRTP_CHECK(!zsrtpSkeinMacInit(NULL, 0, 65, &mkey));
+
+    return zsrtpTestResult("ZsrtpSkeinTest");
+}
@@ -0,0 +1,287 @@
+/*
+    This file implements the stream table test of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Model check of the SSRC tables: random lookups and inserts go to the
+ * table and to a model that keeps the streams in a std::map with their
+ * last use. The table must find exactly the streams of the model, keep
+ * the state of a stream until it is evicted, and evict the stream that was
+ * idle the longest. An evicted stream that comes back must start at its
+ * old highest index. Small SSRC sets make the linear probing chains
+ * collide and exercise the deletion.
+ *
+ * Also checks that zsrtp_newCryptoContextForSSRC() switches a context to
+ * a new SSRC with the given ROC, and that a receiver refuses the replayed
+ * packets of an evicted stream and keeps its ROC.
+ */
+
+#include <map>
+#include <pjlib.h>
+#include <ZsrtpCWrapper.h>
+#include "ZsrtpTransforms.h"
+#include "ZsrtpTest.h"
+
+#define STEPS 100000
+
+static uint32_t rnd = 1;
+
+static uint32_t nextRandom()
+{
+    rnd = rnd * 1103515245 + 12345;
+    return rnd >> 8;
+}
+
+/*
+ * Each stream marks its state with a sequence number derived from the
+ * SSRC, a lookup checks that the mark is still there.
+ */
+static inline uint16_t markOf(uint32_t ssrc)
+{
+    return (uint16_t)(ssrc * 31 + 7);
+}
+
+static void mark(SrtpIndexState* state, uint32_t ssrc)
+{
+    state->update(markOf(ssrc));
+}
+
+static bool isMarked(SrtpIndexState* state, uint32_t ssrc)
+{
+    return !state->checkReplay(markOf(ssrc));
+}
+
+static void mark(SrtpReplayWindow* state, uint32_t ssrc)
+{
+    state->update(markOf(ssrc));
+}
+
+static bool isMarked(SrtpReplayWindow* state, uint32_t ssrc)
+{
+    return !state->check(markOf(ssrc));
+}
+
+/* A packet newer than all packets the stream sent before its eviction */
+static void markNewer(SrtpIndexState* state, int64_t highest)
+{
+    state->update((uint16_t)(highest + 1));
+}
+
+static void markNewer(SrtpReplayWindow* state, int64_t highest)
+{
+    state->update(highest + 1);
+}
+
+struct ModelStream
+{
+    void* state;
+    uint64_t lastUse;
+};
+
+template <class Table, class State>
+static void modelCheck(int32_t maxStreams, int32_t ssrcCount)
+{
+    Table table(maxStreams, 128);
+    std::map<uint32_t, ModelStream> model;
+    std::map<uint32_t, int64_t> evicted;    /* highest index of evicted streams */
+    uint32_t ssrcs[256];
+    uint64_t useCounter = 0;
+    int32_t errors = 0;
+
+    for (int32_t i = 0; i < ssrcCount; i++)
+        ssrcs[i] = (i % 4 == 0) ? (uint32_t)i : nextRandom() * 257 + i;
+
+    for (int32_t step = 0; step < STEPS && errors < 10; step++) {
+        uint32_t ssrc = ssrcs[nextRandom() % ssrcCount];
+        std::map<uint32_t, ModelStream>::iterator it = model.find(ssrc);
+        State* state = table.lookup(ssrc);
+
+        if (it != model.end()) {
+            it->second.lastUse = ++useCounter;
+            if (state != it->second.state || !isMarked(state, ssrc)) {
+                fprintf(stderr, "step %d: stream %08x lost its state\n", step, ssrc);
+                errors++;
+            }
+            continue;
+        }
+        if (state != NULL) {
+            fprintf(stderr, "step %d: stream %08x should be gone\n", step, ssrc);
+            errors++;
+            continue;
+        }
+
+        // Unknown SSRC: the packet uses the spare, only some packets
+        // authenticate and insert the stream. The spare of an evicted
+        // stream refuses its old packets.
+        State* spare = table.spare(ssrc);
+        std::map<uint32_t, int64_t>::iterator old = evicted.find(ssrc);
+        if (old != evicted.end()) {
+            ZSRTP_CHECK(spare->getHighest() == old->second);
+            ZSRTP_CHECK(isMarked(spare, ssrc));
+            if (nextRandom() % 4 == 0)
+                continue;
+            markNewer(spare, old->second);
+            evicted.erase(old);
+        }
+        else {
+            ZSRTP_CHECK(!isMarked(spare, ssrc));
+            if (nextRandom() % 4 == 0)
+                continue;
+            mark(spare, ssrc);
+        }
+
+        if ((int32_t)model.size() == maxStreams) {
+            std::map<uint32_t, ModelStream>::iterator victim = model.begin();
+            for (it = model.begin(); it != model.end(); ++it) {
+                if (it->second.lastUse < victim->second.lastUse)
+                    victim = it;
+            }
+            evicted[victim->first] = ((State*)victim->second.state)->getHighest();
+            model.erase(victim);
+        }
+        table.insert(ssrc);
+        ModelStream stream = { spare, ++useCounter };
+        model[ssrc] = stream;
+
+        if (table.getCount() != (int32_t)model.size()) {
+            fprintf(stderr, "step %d: %d streams, expected %d\n",
+                    step, table.getCount(), (int32_t)model.size());
+            errors++;
+        }
+    }
+
+    // Every stream of the model has its own state
+    for (std::map<uint32_t, ModelStream>::iterator it = model.begin(); it != model.end(); ++it) {
+        for (std::map<uint32_t, ModelStream>::iterator o = model.begin(); o != it; ++o)
+            ZSRTP_CHECK(it->second.state != o->second.state);
+    }
+    ZSRTP_CHECK(errors == 0);
+}
+
+static uint8_t masterKey[16];
+static uint8_t masterSalt[14];
+
+static ZsrtpContext* newContext(uint32_t ssrc, int32_t roc)
+{
+    ZsrtpContext* ctx = zsrtp_CreateWrapper(ssrc, roc, 0L, SrtpEncryptionAESCM,
+                                            SrtpAuthenticationSha1Hmac,
+                                            masterKey, sizeof(masterKey),
+                                            masterSalt, sizeof(masterSalt),
+                                            sizeof(masterKey), 20, sizeof(masterSalt), 10);
+    zsrtp_deriveSrtpKeys(ctx, 0L);
+    return ctx;
+}
+
+/*
+ * A sender switches from SSRC 1 to SSRC 2 with ROC 5, a receiver set up
+ * for SSRC 2 and ROC 5 must accept its packets.
+ */
+static void checkNewContext()
+{
+    uint8_t pkt[12 + 160 + 16];
+    int32_t length, newLength, plainLength;
+
+    ZsrtpContext* tx = newContext(1, 0);
+    ZsrtpContext* rx = newContext(2, 5);
+
+    length = zsrtpTestRtp(pkt, 1, 0xfffe, 160);
+    ZSRTP_CHECK(zsrtp_protect(tx, pkt, length, &newLength) == 1);
+    ZSRTP_CHECK(zsrtp_protect(tx, pkt, length, &newLength) == 1);
+
+    zsrtp_newCryptoContextForSSRC(tx, 2, 5, 0L);
+    zsrtp_deriveSrtpKeys(tx, 0L);
+
+    for (int32_t i = 0; i < 4; i++) {
+        length = zsrtpTestRtp(pkt, 2, (uint16_t)(100 + i), 160);
+        ZSRTP_CHECK(zsrtp_protect(tx, pkt, length, &newLength) == 1);
+        ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, newLength, &plainLength) == 1);
+        ZSRTP_CHECK(plainLength == length);
+    }
+
+    zsrtp_DestroyWrapper(tx);
+    zsrtp_DestroyWrapper(rx);
+}
+
+/*
+ * A receiver with room for one stream. SSRC 1 wraps its sequence numbers,
+ * SSRC 2 evicts it, then a captured packet of SSRC 1 comes again. The
+ * receiver must refuse it and accept the next packet of SSRC 1 with ROC 1.
+ */
+static void checkEvictedReplay()
+{
+    uint8_t pkt[12 + 160 + 16];
+    uint8_t captured[sizeof(pkt)];
+    int32_t length, newLength, plainLength, capturedLength = 0;
+
+    ZsrtpContext* tx1 = newContext(1, 0);
+    ZsrtpContext* tx2 = newContext(2, 0);
+    ZsrtpContext* rx = newContext(1, 0);
+    ZSRTP_CHECK(zsrtp_enableStreamTable(rx, 1) == 1);
+
+    for (int32_t seq = 0xfffe; seq <= 0x10001; seq++) {
+        length = zsrtpTestRtp(pkt, 1, (uint16_t)seq, 160);
+        ZSRTP_CHECK(zsrtp_protect(tx1, pkt, length, &newLength) == 1);
+        if (seq == 0x10000) {
+            memcpy(captured, pkt, newLength);
+            capturedLength = newLength;
+        }
+        ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, newLength, &plainLength) == 1);
+    }
+
+    length = zsrtpTestRtp(pkt, 2, 7, 160);
+    ZSRTP_CHECK(zsrtp_protect(tx2, pkt, length, &newLength) == 1);
+    ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, newLength, &plainLength) == 1);
+
+    memcpy(pkt, captured, capturedLength);
+    ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, capturedLength, &plainLength) == -2);
+
+    length = zsrtpTestRtp(pkt, 1, 2, 160);
+    ZSRTP_CHECK(zsrtp_protect(tx1, pkt, length, &newLength) == 1);
+    ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, newLength, &plainLength) == 1);
+
+    // Stream 2 was evicted in turn, its packet is a replay now
+    length = zsrtpTestRtp(pkt, 2, 7, 160);
+    ZSRTP_CHECK(zsrtp_protect(tx2, pkt, length, &newLength) == 1);
+    ZSRTP_CHECK(zsrtp_unprotect(rx, pkt, newLength, &plainLength) == -2);
+
+    zsrtp_DestroyWrapper(tx1);
+    zsrtp_DestroyWrapper(tx2);
+    zsrtp_DestroyWrapper(rx);
+}
+
+int main(int argc, char* argv[])
+{
+    pj_init();
+    for (size_t i = 0; i < sizeof(masterKey); i++)
+        masterKey[i] = (uint8_t)(0x10 + i);
+    for (size_t i = 0; i < sizeof(masterSalt); i++)
+        masterSalt[i] = (uint8_t)(0xa0 + i);
+
+    modelCheck<SrtpStreamTable, SrtpIndexState>(1, 3);
+    modelCheck<SrtpStreamTable, SrtpIndexState>(4, 6);
+    modelCheck<SrtpStreamTable, SrtpIndexState>(16, 40);
+    modelCheck<SrtpStreamTable, SrtpIndexState>(64, 64);
+    modelCheck<SrtpStreamTable, SrtpIndexState>(64, 200);
+    modelCheck<SrtpCtrlStreamTable, SrtpReplayWindow>(4, 6);
+    modelCheck<SrtpCtrlStreamTable, SrtpReplayWindow>(64, 200);
+
+    checkNewContext();
+    checkEvictedReplay();
+
+    return zsrtpTestResult("ZsrtpSsrcTableTest");
+}
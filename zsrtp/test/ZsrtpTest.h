@@ -0,0 +1,110 @@
+/*
+    This file contains helpers for the ZRTP SRTP tests and benchmarks.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef ZSRTPTEST_H
+#define ZSRTPTEST_H
+
+/*
+ * Each test or benchmark is a small program, "make test" and "make bench"
+ * in build/zsrtp build and run them. A program exits with a non-zero
+ * status if a check failed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int zsrtpTestFailures = 0;
+
+#define ZSRTP_CHECK(cond)                                               \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            zsrtpTestFailures++;                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+        }                                                               \
+    } while (0)
+
+/*
+ * Monotonic time in nanoseconds.
+ */
+static inline uint64_t zsrtpTestNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Convert a hex string into bytes, returns the number of bytes.
+ */
+static inline int zsrtpTestHex(const char* hex, uint8_t* out)
+{
+    int n = 0;
+    unsigned int byte;
+
+    while (hex[0] != '\0' && hex[1] != '\0' && sscanf(hex, "%2x", &byte) == 1) {
+        out[n++] = (uint8_t)byte;
+        hex += 2;
+    }
+    return n;
+}
+
+/*
+ * Build an RTP packet with a 12 byte header and a payload pattern that
+ * depends on the sequence number, returns the packet length.
+ */
+static inline int32_t zsrtpTestRtp(uint8_t* pkt, uint32_t ssrc, uint16_t seq,
+                                   int32_t payloadLength)
+{
+    int32_t i;
+
+    pkt[0] = 0x80;
+    pkt[1] = 0x60;
+    pkt[2] = (uint8_t)(seq >> 8);
+    pkt[3] = (uint8_t)seq;
+    pkt[4] = (uint8_t)(seq >> 8);     /* timestamp */
+    pkt[5] = (uint8_t)seq;
+    pkt[6] = 0;
+    pkt[7] = 0;
+    pkt[8] = (uint8_t)(ssrc >> 24);
+    pkt[9] = (uint8_t)(ssrc >> 16);
+    pkt[10] = (uint8_t)(ssrc >> 8);
+    pkt[11] = (uint8_t)ssrc;
+    for (i = 0; i < payloadLength; i++)
+        pkt[12 + i] = (uint8_t)(i + seq);
+    return 12 + payloadLength;
+}
+
+/*
+ * Print the result line of a test program, returns its exit status.
+ */
+static inline int zsrtpTestResult(const char* name)
+{
+    if (zsrtpTestFailures != 0) {
+        printf("%s: %d checks FAILED\n", name, zsrtpTestFailures);
+        return 1;
+    }
+    printf("%s: OK\n", name);
+    return 0;
+}
+
+#endif
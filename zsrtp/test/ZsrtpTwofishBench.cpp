@@ -0,0 +1,91 @@
+/*
+    This file implements the Twofish benchmark of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Twofish counter mode throughput: zsrtpTwofishCtr(), which uses AVX2 for
+ * packets of 128 bytes and more, against encrypting the counter blocks one
+ * by one with zsrtpTwofishEncrypt(). Prints ns/packet and MB/s for 20, 160
+ * and 1200 byte payloads.
+ */
+
+#include "ZsrtpTwofish.h"
+#include "ZsrtpTest.h"
+
+#define ROUNDS 200000
+
+static uint8_t data[1200];
+static volatile uint8_t sink;
+
+static void ctrBlocks(const ZsrtpTwofishKey* xkey, const uint8_t iv[16], uint8_t* data, int32_t length)
+{
+    uint8_t block[16], ks[16];
+
+    memcpy(block, iv, 16);
+    for (int32_t offset = 0, ctr = 0; offset < length; offset += 16, ctr++) {
+        block[14] = (uint8_t)(ctr >> 8);
+        block[15] = (uint8_t)ctr;
+        zsrtpTwofishEncrypt(xkey, block, ks);
+        for (int32_t i = 0; i < 16 && offset + i < length; i++)
+            data[offset + i] ^= ks[i];
+    }
+}
+
+static void bench(const ZsrtpTwofishKey* xkey, int32_t length)
+{
+    uint8_t iv[16];
+
+    memset(iv, 0x5a, sizeof(iv));
+
+    uint64_t start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        iv[0] = (uint8_t)i;
+        zsrtpTwofishCtr(xkey, iv, data, length);
+        sink ^= data[0];
+    }
+    uint64_t ctr = zsrtpTestNow() - start;
+
+    start = zsrtpTestNow();
+    for (int32_t i = 0; i < ROUNDS; i++) {
+        iv[0] = (uint8_t)i;
+        ctrBlocks(xkey, iv, data, length);
+        sink ^= data[0];
+    }
+    uint64_t blocks = zsrtpTestNow() - start;
+
+    printf("Twofish-CM %4d bytes: %6.0f ns/packet %6.1f MB/s zsrtpTwofishCtr, "
+           "%6.0f ns/packet %6.1f MB/s block by block\n",
+           length, (double)ctr / ROUNDS, (double)length * ROUNDS * 1000.0 / ctr,
+           (double)blocks / ROUNDS, (double)length * ROUNDS * 1000.0 / blocks);
+}
+
+int main(int argc, char* argv[])
+{
+    static const int32_t payloads[] = { 20, 160, 1200 };
+    ZsrtpTwofishKey xkey;
+    uint8_t key[16];
+
+    for (size_t i = 0; i < sizeof(key); i++)
+        key[i] = (uint8_t)(0x10 + i);
+    ZSRTP_CHECK(zsrtpTwofishPrepareKey(key, sizeof(key), &xkey));
+
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++)
+        bench(&xkey, payloads[i]);
+
+    return zsrtpTestResult("ZsrtpTwofishBench");
+}
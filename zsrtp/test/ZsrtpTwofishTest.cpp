@@ -0,0 +1,119 @@
+/*
+    This file implements the Twofish tests of the ZRTP SRTP wrapper.
+    Copyright (C) 2010  Werner Dittmann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+ * Checks the Twofish block cipher against the known answer tests of the
+ * Twofish paper (ecb_tbl.txt) and the counter mode against a block by
+ * block reference, this covers the AVX2 code for packets of 128 bytes and
+ * more.
+ */
+
+#include "ZsrtpTwofish.h"
+#include "ZsrtpTest.h"
+
+typedef struct kat
+{
+    int32_t keyLength;
+    const char* first;      /* zero key, zero plaintext */
+    const char* last;       /* after 49 iterations */
+} Kat;
+
+static const Kat kats[] = {
+    { 16, "9F589F5CF6122C32B6BFEC2F2AE8C35A", "5D9D4EEFFA9151575524F115815A12E0" },
+    { 24, "EFA71F788965BD4453F860178FC19101", "E75449212BEEF9F4A390BD860A640941" },
+    { 32, "57FF739D4DC92C1BD7FC01700CC8216F", "37FE26FF1CF66175F5DDF4C33B97A205" },
+};
+
+/*
+ * The iterated test: the next key is the last plaintext followed by the
+ * leading bytes of the last key, the next plaintext is the last
+ * ciphertext.
+ */
+static void checkKat(const Kat* k)
+{
+    ZsrtpTwofishKey xkey;
+    uint8_t key[32], pt[16], ct[16], expected[16];
+
+    memset(key, 0, sizeof(key));
+    memset(pt, 0, sizeof(pt));
+
+    for (int32_t i = 1; i <= 49; i++) {
+        ZSRTP_CHECK(zsrtpTwofishPrepareKey(key, k->keyLength, &xkey));
+        zsrtpTwofishEncrypt(&xkey, pt, ct);
+        if (i == 1) {
+            zsrtpTestHex(k->first, expected);
+            ZSRTP_CHECK(memcmp(ct, expected, 16) == 0);
+        }
+        memmove(key + 16, key, k->keyLength - 16);
+        memcpy(key, pt, 16);
+        memcpy(pt, ct, 16);
+    }
+    zsrtpTestHex(k->last, expected);
+    ZSRTP_CHECK(memcmp(ct, expected, 16) == 0);
+}
+
+/*
+ * Counter mode against zsrtpTwofishEncrypt() of each counter block.
+ */
+static void checkCtr(int32_t keyLength, int32_t length)
+{
+    ZsrtpTwofishKey xkey;
+    uint8_t key[32], iv[16], block[16], ks[16];
+    uint8_t data[1600], ref[1600];
+
+    for (int32_t i = 0; i < keyLength; i++)
+        key[i] = (uint8_t)(0x30 + i);
+    for (int32_t i = 0; i < 16; i++)
+        iv[i] = (uint8_t)(0xc0 + i);
+    for (int32_t i = 0; i < length; i++)
+        data[i] = ref[i] = (uint8_t)(i * 13);
+
+    ZSRTP_CHECK(zsrtpTwofishPrepareKey(key, keyLength, &xkey));
+    zsrtpTwofishCtr(&xkey, iv, data, length);
+
+    memcpy(block, iv, 16);
+    for (int32_t offset = 0, ctr = 0; offset < length; offset += 16, ctr++) {
+        block[14] = (uint8_t)(ctr >> 8);
+        block[15] = (uint8_t)ctr;
+        zsrtpTwofishEncrypt(&xkey, block, ks);
+        for (int32_t i = 0; i < 16 && offset + i < length; i++)
+            ref[offset + i] ^= ks[i];
+    }
+    ZSRTP_CHECK(memcmp(data, ref, length) == 0);
+}
+
+int main(int argc, char* argv[])
+{
+    static const int32_t lengths[] = { 0, 1, 15, 16, 17, 127, 128, 129, 160, 255, 256, 1200, 1600 };
+    ZsrtpTwofishKey xkey;
+    uint8_t key[32];
+
+    for (size_t i = 0; i < sizeof(kats) / sizeof(kats[0]); i++)
+        checkKat(&kats[i]);
+
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        checkCtr(16, lengths[i]);
+        checkCtr(32, lengths[i]);
+    }
+
+    memset(key, 0, sizeof(key));
+    ZSRTP_CHECK(!zsrtpTwofishPrepareKey(key, 20, &xkey));
+
+    return zsrtpTestResult("ZsrtpTwofishTest");
+}
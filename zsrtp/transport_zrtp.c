@@ -18,6 +18,10 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             /* pthread_setaffinity_np for the SRTP workers */
+#endif
+
 #include <transport_zrtp.h>
 
 /* Code only if ZRTP support */
@@ -27,8 +31,50 @@
 #include <pjlib-util.h>
 #include <ZsrtpCWrapper.h>
 
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#endif
+
 #define THIS_FILE "transport_zrtp.c"
 
+/* Entries of the per SSRC cache of the re-key window, a power of 2 */
+#define REKEY_SSRC_CACHE 8
+
+/* SDP media attribute that announces AES-GCM SRTP, see setSrtpAead */
+#define ZRTP_SDP_AEAD_ATTR "zrtp-srtp-aead"
+
+/*
+ * Atomic access to the SRTP context pointers and the grace period counters.
+ * The ZRTP thread publishes new contexts while media threads use the old
+ * ones, see srtp_read_enter() and srtp_publish().
+ */
+#ifdef _MSC_VER
+#define zrtp_atomic_load(p)     InterlockedCompareExchange((p), 0, 0)
+#define zrtp_atomic_store(p, v) InterlockedExchange((p), (v))
+#define zrtp_atomic_cas(p, e, v) (InterlockedCompareExchange((p), (v), (e)) == (e))
+#define zrtp_atomic_inc(p)      InterlockedIncrement(p)
+#define zrtp_atomic_dec(p)      InterlockedDecrement(p)
+#define zrtp_load_ptr(p)        InterlockedCompareExchangePointer((PVOID volatile*)(p), NULL, NULL)
+#define zrtp_swap_ptr(p, v)     InterlockedExchangePointer((PVOID volatile*)(p), (v))
+#define zrtp_store_ptr(p, v)    ((void)InterlockedExchangePointer((PVOID volatile*)(p), (v)))
+#else
+#define zrtp_atomic_load(p)     __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define zrtp_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define zrtp_atomic_cas(p, e, v) __sync_bool_compare_and_swap((p), (e), (v))
+#define zrtp_atomic_inc(p)      __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define zrtp_atomic_dec(p)      __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define zrtp_load_ptr(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define zrtp_swap_ptr(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define zrtp_store_ptr(p, v)    __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
 /* Transport functions prototypes */
 static pj_status_t transport_get_info(pjmedia_transport *tp,
                                       pjmedia_transport_info *info);
@@ -97,6 +143,40 @@ static struct pjmedia_transport_op tp_zrtp_op =
     &transport_attach2
 };
 
+struct zrtp_worker;
+
+/*
+ * A received burst that the receive thread and workers decrypt together.
+ * The jobs live on the stack of the receive thread, a worker uses them
+ * only while it is counted in active and the generation did not change.
+ */
+struct zrtp_burst
+{
+    ZsrtpContext* srtp;
+    ZsrtpUnprotectJob* jobs;
+    long count;
+    long next;                  /* next job to take */
+    long gen;                   /* changes when a burst starts and ends */
+    long active;                /* workers that may take jobs */
+};
+
+#ifndef DYNAMIC_TIMER
+struct zrtp_bucket;
+struct zrtp_wheel;
+
+/* A timer of the timer wheel */
+struct zrtp_timer
+{
+    struct zrtp_timer* next;
+    struct zrtp_timer* prev;
+    struct zrtp_bucket* bucket;     /* NULL if the timer is not scheduled */
+    unsigned long expires;          /* wheel tick */
+    struct zrtp_wheel* wheel;       /* the shard of the transport */
+    void (*callback)(void* user_data);
+    void* user_data;
+};
+#endif
+
 /* The transport zrtp instance */
 struct tp_zrtp
 {
@@ -117,18 +197,37 @@ struct tp_zrtp
     uint64_t unprotect;
     int32_t  unprotect_err;
     int32_t refcount;
-    pj_timer_entry timeoutEntry;
 #ifdef DYNAMIC_TIMER
-    pj_pool_t* timer_pool;
-    pj_timer_heap_t* timer_heap;
+    pj_timer_entry timeoutEntry;
+#else
+    struct zrtp_timer timeoutTimer;
 #endif
     pj_mutex_t* zrtpMutex;
+    /* The SRTP contexts, media threads read them between srtp_read_enter()
+       and srtp_read_leave(), the ZRTP thread replaces them with srtp_publish() */
     ZsrtpContext* srtpReceive;
     ZsrtpContext* srtpSend;
     ZsrtpContextCtrl* srtcpReceive;
     ZsrtpContextCtrl* srtcpSend;
-    pj_uint8_t* sendBuffer;
-    pj_uint8_t* sendBufferCtrl;
+    long srtpEpoch;             /* grace period counter, bit 0 selects the reader count */
+    long srtpReaders[2];        /* threads that may use the SRTP contexts, per epoch parity */
+    ZsrtpContext* srtpReceivePrev;      /* receive contexts of the previous key */
+    ZsrtpContextCtrl* srtcpReceivePrev;
+    long rekeyEnd;              /* msec tick when the previous contexts expire */
+    unsigned rekeyWindow;       /* msec to keep the previous contexts, 0: off */
+    struct
+    {
+        pj_uint32_t ssrc;
+        ZsrtpContext* srtp;     /* context that authenticated the last packet */
+    } rekeyCache[REKEY_SSRC_CACHE];
+    struct zrtp_worker* sendWorker;     /* SRTP workers of this transport, NULL: inline */
+    struct zrtp_worker* recvWorker;
+    struct zrtp_worker* zrtpWorker;     /* worker for received ZRTP packets, NULL: inline */
+    long asyncPending;          /* packets queued to the workers or in progress */
+    unsigned parallelMin;       /* decrypt bursts of this size on the workers, 0: off */
+    struct zrtp_burst burst;
+    pj_uint8_t* sendBatchBuffer;    /* allocated on first batch send */
+    pj_atomic_t* sendBatchBusy;     /* > 0 while a batch send uses sendBatchBuffer */
     pj_uint8_t* zrtpBuffer;
 //    pj_int32_t sendBufferLen;
     pj_uint32_t peerSSRC;       /* stored in host order */
@@ -142,6 +241,12 @@ struct tp_zrtp
     pj_bool_t started;
     pj_bool_t close_slave;
     pj_bool_t mitmMode;
+    pj_bool_t srtpAead;         /* offer AES-GCM instead of AES-CM and HMAC */
+    pj_bool_t srtpAeadAgreed;   /* both SDPs of the call have ZRTP_SDP_AEAD_ATTR */
+    unsigned keystreamPackets;  /* keystream cache of the sender, 0: off */
+    unsigned keystreamLength;
+    unsigned replayWindow;      /* replay window of the receiver, 0: default */
+    unsigned recvStreams;       /* SSRCs of the receiver, 0: default */
 };
 
 /* Forward declaration of thethe ZRTP specific callback functions that this
@@ -184,73 +289,510 @@ static zrtp_Callbacks c_callbacks =
     &zrtp_checkSASSignature
 };
 
+#ifdef DYNAMIC_TIMER
 static void timer_callback(pj_timer_heap_t *ht, pj_timer_entry *e);
+#else
+static void timer_timeout(void* user_data);
+#endif
 
 #ifndef DYNAMIC_TIMER
 /**
  * The static, singleton Timer implementation
+ *
+ * A hierarchical timer wheel with 1 ms ticks: 256 slots at level 0, each
+ * higher level has 64 slots that cover 64 times the range of the level
+ * below. Scheduling and cancelling a timer lock only its slot. The timer
+ * thread expires the slots of the ticks that passed, moves the timers of
+ * a higher level slot down when the lower level wraps, and sleeps until
+ * the next occupied slot or the next wrap.
+ *
+ * A timer is linked in the slot computed from its expiry and the next tick
+ * the thread processes. A thread that schedules a timer checks the slot
+ * again after it locked the slot. The timer thread advances the tick only
+ * with the lock of the slot of this tick, thus the slot stays correct.
+ *
+ * The timer service has several shards, each with its own wheel and
+ * thread. A transport stays on the shard its address hashes to, thus the
+ * timeouts of different transports run in parallel and the shards share
+ * no lock.
+ *
+ * The threads stay when the last transport is destroyed, the next
+ * transport uses them again. The endpoint stops them when it shuts down.
  */
-static pj_thread_t* thread_run;
+#define WHEEL_BITS0     8
+#define WHEEL_BITS      6
+#define WHEEL_LEVELS    4
+#define WHEEL_SLOTS0    (1 << WHEEL_BITS0)
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_BUCKETS   (WHEEL_SLOTS0 + (WHEEL_LEVELS - 1) * WHEEL_SLOTS)
+#define WHEEL_MAX_DELAY ((1UL << (WHEEL_BITS0 + (WHEEL_LEVELS - 1) * WHEEL_BITS)) - 1)
+#define WHEEL_FOREVER   0x40000000UL
+
+struct zrtp_bucket
+{
+    long lock;
+    long count;                     /* timers in the slot, read without lock */
+    struct zrtp_timer head;         /* list head */
+};
+
+/* A shard of the timer service */
+struct zrtp_wheel
+{
+    struct zrtp_bucket buckets[WHEEL_BUCKETS];
+    long next;                      /* next tick to process, the thread writes it */
+    long count;                     /* scheduled timers */
+    long deadline;                  /* tick the thread sleeps until */
+    struct zrtp_timer* running;     /* timer whose callback runs now */
+    pj_thread_t* thread;
+    /* pjlib has no semaphore wait with timeout */
+#ifdef _MSC_VER
+    HANDLE event;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int kicked;
+#endif
+};
+
 static pj_pool_t* timer_pool;
-static pj_timer_heap_t* timer;
-static pj_sem_t* timer_sem;
+static struct zrtp_wheel* wheels;
+static unsigned wheel_count;
+static unsigned timer_threads = ZRTP_TIMER_THREADS;
 static pj_bool_t timer_running;
 static pj_bool_t timer_initialized = 0;
 static pj_mutex_t* timer_mutex;
 
-#ifndef DYNAMIC_TIMER
-static int pool_ref_count = 0;
+static unsigned cpu_count()
+{
+#ifdef _MSC_VER
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (unsigned)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (n > 0) ? (unsigned)n : 1;
 #endif
+}
 
-static void timer_stop()
+static pj_status_t timer_wait_create(struct zrtp_wheel* w)
 {
-#ifndef DYNAMIC_TIMER // timer_stop is not called if defined
-    --pool_ref_count;
-    if(pool_ref_count > 0)
-        return;
+#ifdef _MSC_VER
+    w->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return (w->event != NULL) ? PJ_SUCCESS : PJ_RETURN_OS_ERROR(GetLastError());
+#else
+    pthread_condattr_t attr;
+    int rc;
+
+    rc = pthread_mutex_init(&w->mutex, NULL);
+    if (rc != 0)
+        return PJ_RETURN_OS_ERROR(rc);
+    pthread_condattr_init(&attr);
+#if defined(__linux__)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
 #endif
-    timer_running = 0;
-    pj_sem_post(timer_sem);
+    rc = pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0)
+    {
+        pthread_mutex_destroy(&w->mutex);
+        return PJ_RETURN_OS_ERROR(rc);
+    }
+    w->kicked = 0;
+    return PJ_SUCCESS;
+#endif
+}
+
+static void timer_wait_destroy(struct zrtp_wheel* w)
+{
+#ifdef _MSC_VER
+    CloseHandle(w->event);
+    w->event = NULL;
+#else
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->mutex);
+#endif
+}
+
+/* Wake the timer thread, it computes the next deadline again */
+static void timer_wake(struct zrtp_wheel* w)
+{
+#ifdef _MSC_VER
+    SetEvent(w->event);
+#else
+    pthread_mutex_lock(&w->mutex);
+    w->kicked = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+#endif
+}
+
+/*
+ * Wait for msec milliseconds or until timer_wake(), a negative msec waits
+ * forever.
+ */
+static void timer_wait(struct zrtp_wheel* w, long msec)
+{
+#ifdef _MSC_VER
+    WaitForSingleObject(w->event, (msec < 0) ? INFINITE : (DWORD)msec);
+#else
+    struct timespec ts;
 
-    if (pj_thread_join(thread_run) != PJ_SUCCESS) {
-        PJ_LOG(1, (THIS_FILE, "Joining timer thread failed."));
+    pthread_mutex_lock(&w->mutex);
+    if (!w->kicked && msec > 0)
+    {
+#if defined(__linux__)
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+        ts.tv_sec += msec / 1000;
+        ts.tv_nsec += (msec % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while (!w->kicked)
+        {
+            if (pthread_cond_timedwait(&w->cond, &w->mutex, &ts) != 0)
+                break;
+        }
     }
+    else
+    {
+        while (!w->kicked && msec < 0)
+            pthread_cond_wait(&w->cond, &w->mutex);
+    }
+    w->kicked = 0;
+    pthread_mutex_unlock(&w->mutex);
+#endif
 }
 
-static int timer_thread_run(void* p)
+/* The wheel ticks are milliseconds, they wrap around */
+static unsigned long wheel_ticks()
 {
-    pj_time_val tick = {0, 10};
+    pj_time_val now;
 
-    timer_running = 1;
+    pj_gettickcount(&now);
+    return (unsigned long)now.sec * 1000 + (unsigned long)now.msec;
+}
 
-    while (timer_running)
+static void bucket_lock(struct zrtp_bucket* b)
+{
+    while (!zrtp_atomic_cas(&b->lock, 0, 1))
+        pj_thread_sleep(0);
+}
+
+static void bucket_unlock(struct zrtp_bucket* b)
+{
+    zrtp_atomic_store(&b->lock, 0);
+}
+
+static void bucket_link(struct zrtp_bucket* b, struct zrtp_timer* t)
+{
+    t->prev = b->head.prev;
+    t->next = &b->head;
+    b->head.prev->next = t;
+    b->head.prev = t;
+    zrtp_store_ptr(&t->bucket, b);
+    zrtp_atomic_store(&b->count, b->count + 1);
+}
+
+static void bucket_unlink(struct zrtp_bucket* b, struct zrtp_timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    zrtp_store_ptr(&t->bucket, NULL);
+    zrtp_atomic_store(&b->count, b->count - 1);
+}
+
+/*
+ * The slot of a timer if the thread processes tick now next. Expired
+ * timers go to the slot of now, timers beyond the range of the wheel to
+ * the last slot that covers them, they move on when it wraps.
+ */
+static struct zrtp_bucket* wheel_bucket(struct zrtp_wheel* w, unsigned long expires,
+                                        unsigned long now)
+{
+    unsigned long delta = expires - now;
+    int level, shift;
+
+    if ((long)delta < 0)
+    {
+        expires = now;
+        delta = 0;
+    }
+    else if (delta > WHEEL_MAX_DELAY)
+    {
+        expires = now + WHEEL_MAX_DELAY;
+        delta = WHEEL_MAX_DELAY;
+    }
+    if (delta < WHEEL_SLOTS0)
+        return &w->buckets[expires & (WHEEL_SLOTS0 - 1)];
+
+    for (level = 1; level < WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < (1UL << (WHEEL_BITS0 + level * WHEEL_BITS)))
+            break;
+    }
+    shift = WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+    return &w->buckets[WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS +
+                       ((expires >> shift) & (WHEEL_SLOTS - 1))];
+}
+
+/*
+ * Returns PJ_TRUE if the timer was scheduled. With wait the function also
+ * waits until a running callback of the timer returned, then the owner may
+ * free the timer. The callback may schedule the timer again, the function
+ * cancels it once more after the wait. The timer thread itself never
+ * waits, and neither do the ZRTP engine calls: the callback may wait for
+ * the ZRTP mutex they hold.
+ */
+static pj_bool_t wheel_cancel(struct zrtp_wheel* w, struct zrtp_timer* t, pj_bool_t wait)
+{
+    struct zrtp_bucket* b;
+    pj_bool_t scheduled = PJ_FALSE;
+
+    if (wait && w->thread != NULL && pj_thread_this() == w->thread)
+        wait = PJ_FALSE;
+    for (;;)
     {
-        if (pj_timer_heap_count(timer) == 0)
+        while ((b = (struct zrtp_bucket*)zrtp_load_ptr(&t->bucket)) != NULL)
         {
-            pj_sem_wait(timer_sem);
+            bucket_lock(b);
+            /* The timer thread may have moved the timer to a lower level */
+            if (zrtp_load_ptr(&t->bucket) == b)
+            {
+                bucket_unlink(b, t);
+                bucket_unlock(b);
+                zrtp_atomic_dec(&w->count);
+                scheduled = PJ_TRUE;
+                break;
+            }
+            bucket_unlock(b);
         }
-        else
+        /* The thread sets running before it unlinks the timer */
+        if (!wait || zrtp_load_ptr(&w->running) != t)
+            return scheduled;
+        while (zrtp_load_ptr(&w->running) == t)
+            pj_thread_sleep(1);
+    }
+}
+
+static void wheel_schedule(struct zrtp_wheel* w, struct zrtp_timer* t, unsigned long msec)
+{
+    struct zrtp_bucket* b;
+    unsigned long expires;
+
+    wheel_cancel(w, t, PJ_FALSE);
+    if (msec > WHEEL_MAX_DELAY)
+        msec = WHEEL_MAX_DELAY;
+    expires = wheel_ticks() + msec;
+
+    /* Count first, the timer thread skips ticks only if no timer is scheduled */
+    zrtp_atomic_inc(&w->count);
+    for (;;)
+    {
+        b = wheel_bucket(w, expires, (unsigned long)zrtp_atomic_load(&w->next));
+        bucket_lock(b);
+        if (b == wheel_bucket(w, expires, (unsigned long)zrtp_atomic_load(&w->next)))
+            break;
+        bucket_unlock(b);
+    }
+    t->expires = expires;
+    bucket_link(b, t);
+    bucket_unlock(b);
+
+    /* Wake the thread only if it sleeps beyond the new timer */
+    if ((long)(expires - (unsigned long)zrtp_atomic_load(&w->deadline)) < 0)
+        timer_wake(w);
+}
+
+/* Move the timers of a higher level slot to the slots they belong to now */
+static void wheel_cascade(struct zrtp_wheel* w, struct zrtp_bucket* b, unsigned long now)
+{
+    struct zrtp_timer* t;
+    struct zrtp_bucket* nb;
+
+    bucket_lock(b);
+    while ((t = b->head.next) != &b->head)
+    {
+        nb = wheel_bucket(w, t->expires, now);
+        pj_assert(nb != b);
+        bucket_unlink(b, t);
+        bucket_lock(nb);
+        bucket_link(nb, t);
+        bucket_unlock(nb);
+    }
+    bucket_unlock(b);
+}
+
+/*
+ * Jump over the ticks the thread slept through if no timer is scheduled.
+ * A thread that schedules a timer and locked its slot before sees the new
+ * tick when it checks the slot again.
+ */
+static void wheel_jump(struct zrtp_wheel* w, unsigned long now)
+{
+    int i;
+
+    for (i = 0; i < WHEEL_BUCKETS; i++)
+        bucket_lock(&w->buckets[i]);
+    if (zrtp_atomic_load(&w->count) == 0)
+        zrtp_atomic_store(&w->next, (long)now);
+    for (i = 0; i < WHEEL_BUCKETS; i++)
+        bucket_unlock(&w->buckets[i]);
+}
+
+/* Expire the timers of all ticks up to now */
+static void wheel_advance(struct zrtp_wheel* w, unsigned long now)
+{
+    unsigned long tick;
+    struct zrtp_bucket* b;
+    struct zrtp_timer* t;
+    void (*callback)(void* user_data);
+    void* user_data;
+    int level, shift;
+
+    if ((long)(now - (unsigned long)w->next) >= WHEEL_SLOTS0 && zrtp_atomic_load(&w->count) == 0)
+        wheel_jump(w, now);
+
+    while ((long)(now - (tick = (unsigned long)w->next)) >= 0)
+    {
+        if ((tick & (WHEEL_SLOTS0 - 1)) == 0)
+        {
+            for (level = 1; level < WHEEL_LEVELS; level++)
+            {
+                shift = WHEEL_BITS0 + (level - 1) * WHEEL_BITS;
+                wheel_cascade(w, &w->buckets[WHEEL_SLOTS0 + (level - 1) * WHEEL_SLOTS +
+                                             ((tick >> shift) & (WHEEL_SLOTS - 1))], tick);
+                if (((tick >> shift) & (WHEEL_SLOTS - 1)) != 0)
+                    break;
+            }
+        }
+        /* All timers of the slot are due, a timeout may schedule a timer
+           in the same slot again */
+        b = &w->buckets[tick & (WHEEL_SLOTS0 - 1)];
+        for (;;)
+        {
+            bucket_lock(b);
+            t = b->head.next;
+            if (t == &b->head)
+            {
+                zrtp_atomic_store(&w->next, (long)(tick + 1));
+                bucket_unlock(b);
+                break;
+            }
+            zrtp_store_ptr(&w->running, t);
+            bucket_unlink(b, t);
+            callback = t->callback;
+            user_data = t->user_data;
+            bucket_unlock(b);
+            zrtp_atomic_dec(&w->count);
+            callback(user_data);
+            zrtp_store_ptr(&w->running, NULL);
+        }
+    }
+}
+
+/*
+ * Publish the tick the thread sleeps until, then look at the slots again:
+ * a thread that scheduled a timer either sees the deadline and wakes the
+ * timer thread, or this check sees the timer. Returns the milliseconds to
+ * sleep, -1 if no timer is scheduled.
+ */
+static long wheel_sleep_time(struct zrtp_wheel* w, unsigned long now)
+{
+    unsigned long first = (unsigned long)w->next;
+    unsigned long wrap = ((first - 1) | (WHEEL_SLOTS0 - 1)) + 1;
+    unsigned long tick;
+
+    zrtp_atomic_store(&w->deadline, (long)(first + WHEEL_FOREVER));
+    if (zrtp_atomic_load(&w->count) == 0)
+        return -1;
+
+    /* A higher level slot may move timers down when level 0 wraps */
+    for (tick = first; tick != wrap; tick++)
+    {
+        if (zrtp_atomic_load(&w->buckets[tick & (WHEEL_SLOTS0 - 1)].count) != 0)
+            break;
+    }
+    zrtp_atomic_store(&w->deadline, (long)tick);
+    for (tick = first; (long)(tick - (unsigned long)w->deadline) < 0; tick++)
+    {
+        if (zrtp_atomic_load(&w->buckets[tick & (WHEEL_SLOTS0 - 1)].count) != 0)
+            break;
+    }
+    return (long)(tick - now);
+}
+
+static int timer_thread_run(void* p)
+{
+    struct zrtp_wheel* w = (struct zrtp_wheel*)p;
+    unsigned long now;
+
+    while (timer_running)
+    {
+        /* Timers scheduled while the thread expires timers need no wake up */
+        zrtp_atomic_store(&w->deadline, w->next);
+        now = wheel_ticks();
+        wheel_advance(w, now);
+        if (!timer_running)
+            break;
+        timer_wait(w, wheel_sleep_time(w, now));
+    }
+    return 0;
+}
+
+static void timer_threads_stop(unsigned count)
+{
+    unsigned i;
+
+    timer_running = 0;
+    for (i = 0; i < count; i++)
+    {
+        struct zrtp_wheel* w = &wheels[i];
+
+        if (w->thread != NULL)
         {
-            pj_thread_sleep(PJ_TIME_VAL_MSEC(tick));
-            pj_timer_heap_poll(timer, NULL);
+            timer_wake(w);
+            if (pj_thread_join(w->thread) != PJ_SUCCESS) {
+                PJ_LOG(1, (THIS_FILE, "Joining timer thread failed."));
+            }
+            pj_thread_destroy(w->thread);
+            w->thread = NULL;
         }
+        timer_wait_destroy(w);
     }
+    wheels = NULL;
+    wheel_count = 0;
+}
+
+/* Called by the endpoint when it shuts down, the timer pool belongs to it */
+static void timer_shutdown(pjmedia_endpt *endpt)
+{
+    PJ_UNUSED_ARG(endpt);
+
+    if (!timer_initialized)
+        return;
+
+    timer_threads_stop(wheel_count);
     pj_mutex_destroy(timer_mutex);
     timer_mutex = NULL;
-    pj_timer_heap_destroy(timer);
-    timer = NULL;
-    pj_sem_destroy(timer_sem);
-    timer_sem = NULL;
     pj_pool_release(timer_pool);
     timer_pool = NULL;
     timer_initialized = 0;
-    return 0;
 }
 
-static int timer_initialize()
+static int timer_initialize(pjmedia_endpt *endpt)
 {
     pj_status_t rc;
     pj_mutex_t* temp_mutex;
+    unsigned count, n;
+    int i;
 
     rc = pj_mutex_create_simple(timer_pool, "zrtp_timer", &temp_mutex);
     if (rc != PJ_SUCCESS)
@@ -273,39 +815,49 @@ static int timer_initialize()
         return PJ_SUCCESS;
     }
 
-    rc = pj_timer_heap_create(timer_pool, 4, &timer);
-    if (rc != PJ_SUCCESS)
+    count = (timer_threads == 0) ? cpu_count() : timer_threads;
+    if (count > MAX_ZRTP_TIMER_THREADS)
+        count = MAX_ZRTP_TIMER_THREADS;
+
+    wheels = (struct zrtp_wheel*)pj_pool_calloc(timer_pool, count, sizeof(struct zrtp_wheel));
+    if (wheels == NULL)
     {
+        rc = PJ_ENOMEM;
         goto ERROR;
     }
 
-    rc = pj_sem_create(timer_pool, "zrtp_timer", 0, 1, &timer_sem);
-    if (rc != PJ_SUCCESS)
+    timer_running = 1;
+    for (n = 0; n < count; n++)
     {
-        goto ERROR;
-    }
+        struct zrtp_wheel* w = &wheels[n];
 
-    rc = pj_thread_create(timer_pool, "zrtp_timer", &timer_thread_run, NULL,
-                          PJ_THREAD_DEFAULT_STACK_SIZE, 0, &thread_run);
+        for (i = 0; i < WHEEL_BUCKETS; i++)
+            w->buckets[i].head.next = w->buckets[i].head.prev = &w->buckets[i].head;
+        w->next = (long)wheel_ticks();
+        w->deadline = w->next;
+
+        rc = timer_wait_create(w);
+        if (rc != PJ_SUCCESS)
+            break;
+        wheel_count = n + 1;
+
+        rc = pj_thread_create(timer_pool, "zrtp_timer", &timer_thread_run, w,
+                              PJ_THREAD_DEFAULT_STACK_SIZE, 0, &w->thread);
+        if (rc != PJ_SUCCESS)
+            break;
+    }
     if (rc != PJ_SUCCESS)
     {
+        timer_threads_stop(wheel_count);
         goto ERROR;
     }
+    pjmedia_endpt_atexit(endpt, &timer_shutdown);
     timer_initialized = 1;
     pj_mutex_unlock(timer_mutex);
     return PJ_SUCCESS;
 
     ERROR:
-    if (timer != NULL)
-    {
-        pj_timer_heap_destroy(timer);
-        timer = NULL;
-    }
-    if (timer_sem != NULL)
-    {
-        pj_sem_destroy(timer_sem);
-        timer_sem = NULL;
-    }
+    timer_running = 0;
     if (timer_mutex != NULL)
     {
         pj_mutex_unlock(timer_mutex);
@@ -316,86 +868,533 @@ static int timer_initialize()
     return rc;
 }
 
-static int timer_add_entry(pj_timer_entry* entry, pj_time_val* delay)
+/* Pin a transport to a shard, hash the address to spread the transports */
+static struct zrtp_wheel* timer_shard(void* key)
 {
-    pj_status_t rc;
+    pj_size_t h = (pj_size_t)key;
+
+    h ^= h >> 7;
+    h *= 0x9E3779B1UL;
+    return &wheels[(h >> 8) % wheel_count];
+}
 
-    if (timer_initialized && timer != NULL)
+static int timer_add_entry(struct zrtp_timer* entry, int32_t msec)
+{
+    if (timer_initialized && entry->wheel != NULL)
     {
-        rc = pj_timer_heap_schedule(timer, entry, delay);
-        pj_sem_post(timer_sem);
-        return rc;
+        wheel_schedule(entry->wheel, entry, (unsigned long)(msec < 0 ? 0 : msec));
+        return PJ_SUCCESS;
     }
     else
         return PJ_EIGNORED;
 }
 
-static int timer_cancel_entry(pj_timer_entry* entry)
+static int timer_cancel_entry(struct zrtp_timer* entry)
 {
-    if (timer_initialized && timer != NULL)
-        return pj_timer_heap_cancel(timer, entry);
+    if (timer_initialized && entry->wheel != NULL)
+        return wheel_cancel(entry->wheel, entry, PJ_FALSE) ? 1 : 0;
     else
         return PJ_EIGNORED;
 }
+
+/* Cancel the timer before its owner goes away, see wheel_cancel() */
+static void timer_stop_entry(struct zrtp_timer* entry)
+{
+    if (timer_initialized && entry->wheel != NULL)
+        wheel_cancel(entry->wheel, entry, PJ_TRUE);
+}
 /*
  * End of timer implementation
  */
-#endif
+#else
+/**
+ * The application polls the ZRTP timers on its own thread, see
+ * pjmedia_transport_zrtp_poll_timers(), or the timers go into a timer
+ * heap of the application. All transports share one heap.
+ */
+static pj_pool_t* timer_pool;
+static pj_timer_heap_t* timer_heap;
+static pj_bool_t timer_external;
 
+/* Called by the endpoint when it shuts down, the timer pool belongs to it */
+static void timer_shutdown(pjmedia_endpt *endpt)
+{
+    PJ_UNUSED_ARG(endpt);
 
-//                                         1
-//                                1234567890123456
-static pj_char_t clientId[] =    "PJS ZRTP 4.6.4  ";
+    if (timer_external || timer_heap == NULL)
+        return;
+    pj_timer_heap_destroy(timer_heap);
+    timer_heap = NULL;
+    pj_pool_release(timer_pool);
+    timer_pool = NULL;
+}
 
-/*
- * Create the ZRTP transport.
- */
-PJ_DEF(pj_status_t) pjmedia_transport_zrtp_create(pjmedia_endpt *endpt,
-        const char *name,
-        pjmedia_transport *transport,
-        pjmedia_transport **p_tp,
-        pj_bool_t close_slave)
+static pj_status_t timer_initialize(pjmedia_endpt *endpt)
 {
-    pj_pool_t *pool;
-    struct tp_zrtp *zrtp;
+    pj_pool_t* pool;
+    pj_timer_heap_t* heap;
     pj_status_t rc;
 
-    if (name == NULL)
-        name = "tzrtp%p";
-
-    /* Create the pool and initialize the adapter structure */
-    pool = pjmedia_endpt_create_pool(endpt, name, 5*1024, 512);
-    zrtp = PJ_POOL_ZALLOC_T(pool, struct tp_zrtp);
-    zrtp->pool = pool;
-    pj_ansi_strncpy(zrtp->base.name, pool->obj_name,
-                    sizeof(zrtp->base.name));
-    zrtp->base.type = (pjmedia_transport_type)
-                      (PJMEDIA_TRANSPORT_TYPE_USER + 2);
-    zrtp->base.op = &tp_zrtp_op;
+    if (zrtp_load_ptr(&timer_heap) != NULL)
+        return PJ_SUCCESS;
 
-#ifndef DYNAMIC_TIMER
-    ++pool_ref_count;
-    if (timer_pool == NULL)
+    pool = pjmedia_endpt_create_pool(endpt, "zrtp_timer", 256, 256);
+    rc = pj_timer_heap_create(pool, 64, &heap);
+    if (rc != PJ_SUCCESS)
     {
-        timer_pool = pjmedia_endpt_create_pool(endpt, "zrtp_timer", 256, 256);
-        rc = timer_initialize();
-        if (rc != PJ_SUCCESS)
+        pj_pool_release(pool);
+        return rc;
+    }
+
+    pj_enter_critical_section();
+    if (timer_heap == NULL)
+    {
+        timer_pool = pool;
+        zrtp_store_ptr(&timer_heap, heap);
+        pool = NULL;
+    }
+    pj_leave_critical_section();
+
+    if (pool != NULL)
+    {
+        pj_timer_heap_destroy(heap);
+        pj_pool_release(pool);
+    }
+    else
+        pjmedia_endpt_atexit(endpt, &timer_shutdown);
+    return PJ_SUCCESS;
+}
+#endif
+
+/*
+ * The SRTP workers. A transport in async mode queues each packet to the
+ * worker of its direction. Thus the packets of a stream keep their order
+ * and only one thread uses the receive state of the SRTP contexts. The
+ * queues are bounded rings with many producers and one consumer, a slot
+ * holds a copy of the packet.
+ */
+#define ZRTP_JOB_SEND_RTP   0
+#define ZRTP_JOB_SEND_RTCP  1
+#define ZRTP_JOB_RECV_RTP   2
+#define ZRTP_JOB_RECV_RTCP  3
+#define ZRTP_JOB_DECRYPT    4   /* help with a burst, size is the generation */
+#define ZRTP_JOB_ZRTP       5   /* received ZRTP packet */
+
+struct zrtp_job
+{
+    long seq;                   /* ring position the slot is ready for */
+    struct tp_zrtp* zrtp;
+    int type;
+    pj_ssize_t size;
+    pj_uint8_t data[PJMEDIA_MAX_MTU];
+};
+
+struct zrtp_worker
+{
+    struct zrtp_job* jobs;
+    long head;                  /* next position a producer fills */
+    long tail;                  /* next position the worker processes */
+    long sleeping;              /* the worker waits on sem */
+    int cpu;                    /* CPU the worker runs on, -1: any */
+    pj_sem_t* sem;
+    pj_thread_t* thread;
+};
+
+static pj_pool_t* worker_pool;
+static struct zrtp_worker* workers;
+static unsigned worker_count;
+static long worker_next;
+static long workers_running;
+
+static pj_status_t send_rtp(pjmedia_transport *tp, const void *pkt, pj_size_t size);
+static pj_status_t send_rtcp(pjmedia_transport *tp, const void *pkt, pj_size_t size);
+static void receive_rtp(void *user_data, void *pkt, pj_ssize_t size);
+static void receive_rtcp(void *user_data, void *pkt, pj_ssize_t size);
+static void burst_help(struct tp_zrtp* zrtp, long gen);
+
+static void worker_set_affinity(int cpu)
+{
+#if defined(_MSC_VER)
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0)
+        PJ_LOG(3, (THIS_FILE, "Setting SRTP worker affinity failed."));
+#elif defined(__linux__)
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        PJ_LOG(3, (THIS_FILE, "Setting SRTP worker affinity failed."));
+#else
+    PJ_UNUSED_ARG(cpu);
+#endif
+}
+
+/* Return the next job of the worker, NULL if the queue is empty */
+static struct zrtp_job* worker_peek(struct zrtp_worker* w)
+{
+    struct zrtp_job* job = &w->jobs[(unsigned long)w->tail & (ZRTP_WORKER_QUEUE - 1)];
+
+    if (zrtp_atomic_load(&job->seq) != (long)((unsigned long)w->tail + 1))
+        return NULL;
+    return job;
+}
+
+static void worker_run_job(struct zrtp_job* job)
+{
+    struct tp_zrtp* zrtp = job->zrtp;
+
+    switch (job->type)
+    {
+    case ZRTP_JOB_SEND_RTP:
+        send_rtp(&zrtp->base, job->data, job->size);
+        break;
+    case ZRTP_JOB_SEND_RTCP:
+        send_rtcp(&zrtp->base, job->data, job->size);
+        break;
+    case ZRTP_JOB_RECV_RTP:
+    case ZRTP_JOB_ZRTP:
+        receive_rtp(zrtp, job->data, job->size);
+        break;
+    case ZRTP_JOB_RECV_RTCP:
+        receive_rtcp(zrtp, job->data, job->size);
+        break;
+    case ZRTP_JOB_DECRYPT:
+        burst_help(zrtp, (long)job->size);
+        break;
+    }
+    zrtp_atomic_dec(&zrtp->asyncPending);
+}
+
+static int worker_thread_run(void* p)
+{
+    struct zrtp_worker* w = (struct zrtp_worker*)p;
+    struct zrtp_job* job;
+
+    if (w->cpu >= 0)
+        worker_set_affinity(w->cpu);
+
+    for (;;)
+    {
+        job = worker_peek(w);
+        if (job == NULL)
+        {
+            /* The worker drains its queue before it stops */
+            if (!zrtp_atomic_load(&workers_running))
+                break;
+
+            /* Announce the wait and look again: a producer that queued a
+               job meanwhile sees the flag and posts the semaphore */
+            zrtp_atomic_store(&w->sleeping, 1);
+            if (worker_peek(w) == NULL && zrtp_atomic_load(&workers_running))
+                pj_sem_wait(w->sem);
+            zrtp_atomic_store(&w->sleeping, 0);
+            continue;
+        }
+        worker_run_job(job);
+        zrtp_atomic_store(&job->seq, (long)((unsigned long)w->tail + ZRTP_WORKER_QUEUE));
+        w->tail++;
+    }
+    return 0;
+}
+
+/*
+ * Queue a job to a worker, copy size bytes of pkt into the job. Returns
+ * PJ_FALSE if the queue is full. The caller counts the job in the
+ * asyncPending of the transport.
+ */
+static pj_bool_t worker_queue(struct zrtp_worker* w, struct tp_zrtp* zrtp, int type,
+                              const void* pkt, pj_ssize_t size)
+{
+    struct zrtp_job* job;
+    long pos, diff;
+
+    pos = zrtp_atomic_load(&w->head);
+    for (;;)
+    {
+        job = &w->jobs[(unsigned long)pos & (ZRTP_WORKER_QUEUE - 1)];
+        diff = (long)((unsigned long)zrtp_atomic_load(&job->seq) - (unsigned long)pos);
+        if (diff == 0)
+        {
+            if (zrtp_atomic_cas(&w->head, pos, (long)((unsigned long)pos + 1)))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return PJ_FALSE;
+        }
+        pos = zrtp_atomic_load(&w->head);
+    }
+    job->zrtp = zrtp;
+    job->type = type;
+    job->size = size;
+    if (pkt != NULL)
+        pj_memcpy(job->data, pkt, size);
+    zrtp_atomic_store(&job->seq, (long)((unsigned long)pos + 1));
+
+    if (zrtp_atomic_load(&w->sleeping) && zrtp_atomic_cas(&w->sleeping, 1, 0))
+        pj_sem_post(w->sem);
+
+    return PJ_TRUE;
+}
+
+/*
+ * Queue a packet to the worker of the transport. Returns PJ_FALSE if the
+ * transport does not use workers, the caller then processes the packet.
+ * Otherwise @c status is PJ_SUCCESS, or PJ_ETOOMANY if the queue is full
+ * and the packet was dropped. Processing it here would reorder the stream.
+ */
+static pj_bool_t async_submit(struct tp_zrtp* zrtp, int type,
+                              const void* pkt, pj_ssize_t size,
+                              pj_status_t* status)
+{
+    struct zrtp_worker** slot;
+    struct zrtp_worker* w;
+
+    if (type == ZRTP_JOB_ZRTP)
+        slot = &zrtp->zrtpWorker;
+    else
+        slot = (type == ZRTP_JOB_SEND_RTP || type == ZRTP_JOB_SEND_RTCP) ?
+               &zrtp->sendWorker : &zrtp->recvWorker;
+    if (zrtp_load_ptr(slot) == NULL || size < 0 || size > PJMEDIA_MAX_MTU)
+        return PJ_FALSE;
+
+    /* Count the packet before the worker is known, async_stop() waits
+       for the count after it removed the workers */
+    zrtp_atomic_inc(&zrtp->asyncPending);
+    w = (struct zrtp_worker*)zrtp_load_ptr(slot);
+    if (w == NULL)
+    {
+        zrtp_atomic_dec(&zrtp->asyncPending);
+        return PJ_FALSE;
+    }
+    *status = PJ_SUCCESS;
+    if (!worker_queue(w, zrtp, type, pkt, size))
+    {
+        zrtp_atomic_dec(&zrtp->asyncPending);
+        *status = PJ_ETOOMANY;
+    }
+    return PJ_TRUE;
+}
+
+/* Wait until the workers processed all queued packets of the transport */
+static void async_drain(struct tp_zrtp* zrtp)
+{
+    while (zrtp_atomic_load(&zrtp->asyncPending) != 0)
+        pj_thread_sleep(1);
+}
+
+static void async_stop(struct tp_zrtp* zrtp)
+{
+    zrtp_store_ptr(&zrtp->sendWorker, NULL);
+    zrtp_store_ptr(&zrtp->recvWorker, NULL);
+    zrtp_store_ptr(&zrtp->zrtpWorker, NULL);
+    async_drain(zrtp);
+}
+
+static void workers_stop(unsigned count)
+{
+    unsigned i;
+
+    zrtp_atomic_store(&workers_running, 0);
+    for (i = 0; i < count; i++)
+    {
+        struct zrtp_worker* w = &workers[i];
+
+        if (w->thread != NULL)
+        {
+            pj_sem_post(w->sem);
+            if (pj_thread_join(w->thread) != PJ_SUCCESS)
+                PJ_LOG(1, (THIS_FILE, "Joining SRTP worker thread failed."));
+            pj_thread_destroy(w->thread);
+        }
+        if (w->sem != NULL)
+            pj_sem_destroy(w->sem);
+    }
+    pj_pool_release(worker_pool);
+    worker_pool = NULL;
+    workers = NULL;
+    worker_count = 0;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_workers_create(pjmedia_endpt *endpt,
+                                                          unsigned count,
+                                                          const int cpus[])
+{
+    pj_status_t rc = PJ_SUCCESS;
+    unsigned i, j;
+
+    PJ_ASSERT_RETURN(endpt && count >= 1 && count <= MAX_ZRTP_WORKERS, PJ_EINVAL);
+    PJ_ASSERT_RETURN(worker_count == 0, PJ_EEXISTS);
+
+    zsrtp_setConcurrency(count + ZRTP_MEDIA_THREADS);
+
+    worker_pool = pjmedia_endpt_create_pool(endpt, "zrtp_workers", 4096, 4096);
+    if (worker_pool == NULL)
+        return PJ_ENOMEM;
+
+    workers = (struct zrtp_worker*)pj_pool_calloc(worker_pool, count, sizeof(struct zrtp_worker));
+    if (workers == NULL)
+    {
+        pj_pool_release(worker_pool);
+        worker_pool = NULL;
+        return PJ_ENOMEM;
+    }
+    zrtp_atomic_store(&workers_running, 1);
+
+    for (i = 0; i < count; i++)
+    {
+        struct zrtp_worker* w = &workers[i];
+
+        w->jobs = (struct zrtp_job*)pj_pool_alloc(worker_pool,
+                                                  ZRTP_WORKER_QUEUE * sizeof(struct zrtp_job));
+        if (w->jobs == NULL)
+        {
+            rc = PJ_ENOMEM;
+            break;
+        }
+        for (j = 0; j < ZRTP_WORKER_QUEUE; j++)
+            w->jobs[j].seq = (long)j;
+        w->cpu = cpus != NULL ? cpus[i] : -1;
+
+        rc = pj_sem_create(worker_pool, "zrtp_worker", 0, ZRTP_WORKER_QUEUE, &w->sem);
+        if (rc != PJ_SUCCESS)
+            break;
+        rc = pj_thread_create(worker_pool, "zrtp_worker", &worker_thread_run, w,
+                              PJ_THREAD_DEFAULT_STACK_SIZE, 0, &w->thread);
+        if (rc != PJ_SUCCESS)
+            break;
+    }
+    if (rc != PJ_SUCCESS)
+    {
+        workers_stop(count);
+        return rc;
+    }
+    worker_count = count;
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setTimerThreads(unsigned count)
+{
+#ifndef DYNAMIC_TIMER
+    PJ_ASSERT_RETURN(count <= MAX_ZRTP_TIMER_THREADS, PJ_EINVAL);
+
+    if (timer_initialized)
+        return PJ_EBUSY;
+    timer_threads = count;
+    return PJ_SUCCESS;
+#else
+    PJ_UNUSED_ARG(count);
+    return PJ_ENOTSUP;
+#endif
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setTimerHeap(pj_timer_heap_t *ht)
+{
+#ifdef DYNAMIC_TIMER
+    pj_status_t rc = PJ_SUCCESS;
+    PJ_ASSERT_RETURN(ht, PJ_EINVAL);
+
+    pj_enter_critical_section();
+    if (timer_heap != NULL && timer_heap != ht)
+        rc = PJ_EBUSY;
+    else
+    {
+        zrtp_store_ptr(&timer_heap, ht);
+        timer_external = PJ_TRUE;
+    }
+    pj_leave_critical_section();
+    return rc;
+#else
+    PJ_UNUSED_ARG(ht);
+    return PJ_ENOTSUP;
+#endif
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_next_deadline(pj_time_val *deadline)
+{
+    PJ_ASSERT_RETURN(deadline, PJ_EINVAL);
+#ifdef DYNAMIC_TIMER
+    if (timer_heap == NULL || pj_timer_heap_count(timer_heap) == 0)
+        return PJ_ENOTFOUND;
+    return pj_timer_heap_earliest_time(timer_heap, deadline);
+#else
+    return PJ_ENOTSUP;
+#endif
+}
+
+PJ_DEF(unsigned) pjmedia_transport_zrtp_poll_timers(pj_time_val *next_delay)
+{
+#ifdef DYNAMIC_TIMER
+    if (timer_heap != NULL)
+        return pj_timer_heap_poll(timer_heap, next_delay);
+#endif
+    if (next_delay != NULL)
+        next_delay->sec = next_delay->msec = PJ_MAXINT32;
+    return 0;
+}
+
+PJ_DEF(void) pjmedia_transport_zrtp_workers_destroy(void)
+{
+    if (worker_count == 0)
+        return;
+    workers_stop(worker_count);
+}
+
+
+//                                         1
+//                                1234567890123456
+static pj_char_t clientId[] =    "PJS ZRTP 4.6.4  ";
+
+/*
+ * Create the ZRTP transport.
+ */
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_create(pjmedia_endpt *endpt,
+        const char *name,
+        pjmedia_transport *transport,
+        pjmedia_transport **p_tp,
+        pj_bool_t close_slave)
+{
+    pj_pool_t *pool;
+    struct tp_zrtp *zrtp;
+    pj_status_t rc;
+
+    if (name == NULL)
+        name = "tzrtp%p";
+
+    /* Create the pool and initialize the adapter structure */
+    pool = pjmedia_endpt_create_pool(endpt, name, 5*1024, 512);
+    zrtp = PJ_POOL_ZALLOC_T(pool, struct tp_zrtp);
+    zrtp->pool = pool;
+    pj_ansi_strncpy(zrtp->base.name, pool->obj_name,
+                    sizeof(zrtp->base.name));
+    zrtp->base.type = (pjmedia_transport_type)
+                      (PJMEDIA_TRANSPORT_TYPE_USER + 2);
+    zrtp->base.op = &tp_zrtp_op;
+
+#ifndef DYNAMIC_TIMER
+    if (timer_pool == NULL)
+    {
+        timer_pool = pjmedia_endpt_create_pool(endpt, "zrtp_timer", 256, 256);
+        rc = timer_initialize(endpt);
+        if (rc != PJ_SUCCESS)
         {
             pj_pool_release(timer_pool);
+            timer_pool = NULL;
             pj_pool_release(zrtp->pool);
             return rc;
         }
     }
+    zrtp->timeoutTimer.callback = &timer_timeout;
+    zrtp->timeoutTimer.user_data = zrtp;
+    zrtp->timeoutTimer.wheel = timer_shard(zrtp);
 #else
-    zrtp->timer_heap = NULL;
-    zrtp->timer_pool = pjmedia_endpt_create_pool(endpt, "zrtp_timer", 256, 256);
-    rc = pj_timer_heap_create(zrtp->timer_pool, 4, &zrtp->timer_heap);
-	if (rc != PJ_SUCCESS)
-	{
-		pj_pool_release(zrtp->timer_pool);
-		pj_pool_release(zrtp->pool);
-		return rc;
-	}
+    rc = timer_initialize(endpt);
+    if (rc != PJ_SUCCESS)
+    {
+        pj_pool_release(zrtp->pool);
+        return rc;
+    }
+    pj_timer_entry_init(&zrtp->timeoutEntry, 0, zrtp, &timer_callback);
 #endif
 
     /* Create the empty wrapper */
@@ -406,12 +1405,17 @@ PJ_DEF(pj_status_t) pjmedia_transport_zrtp_create(pjmedia_endpt *endpt,
     zrtp->zrtpSeq = 1;                  /* TODO: randomize */
     rc = pj_mutex_create_simple(zrtp->pool, "zrtp", &zrtp->zrtpMutex);
     zrtp->zrtpBuffer = ( pj_uint8_t*)pj_pool_zalloc(pool, MAX_ZRTP_SIZE);
-    zrtp->sendBuffer = (pj_uint8_t*)pj_pool_zalloc(pool, MAX_RTP_BUFFER_LEN);
-    zrtp->sendBufferCtrl = (pj_uint8_t*)pj_pool_zalloc(pool, MAX_RTCP_BUFFER_LEN);
+    rc = pj_atomic_create(zrtp->pool, 0, &zrtp->sendBatchBusy);
+    if (rc != PJ_SUCCESS)
+    {
+        pj_pool_release(zrtp->pool);
+        return rc;
+    }
 
     zrtp->slave_tp = transport;
     zrtp->close_slave = close_slave;
     zrtp->mitmMode = PJ_FALSE;
+    zrtp->rekeyWindow = ZRTP_REKEY_WINDOW;
 
     /* Done */
     zrtp->refcount++;
@@ -419,6 +1423,199 @@ PJ_DEF(pj_status_t) pjmedia_transport_zrtp_create(pjmedia_endpt *endpt,
     return PJ_SUCCESS;
 }
 
+/*
+ * The ZRTP algorithm profile of all transports. The ZRTP wrapper keeps a
+ * configuration per context, each transport copies the names from here.
+ */
+static const pjmedia_zrtp_profile profile_low_latency =
+{
+    { "S256" },
+    { "AES1" },
+    { "E255", "EC25", "DH3k" },
+    { "B32 " },
+    { "HS80", "HS32" }
+};
+
+static const pjmedia_zrtp_profile profile_low_cpu =
+{
+    { "S256" },
+    { "AES1", "2FS1" },
+    { "E255", "EC25", "DH2k", "DH3k" },
+    { "B32 " },
+    { "HS32", "HS80" }
+};
+
+static const pjmedia_zrtp_profile profile_max_security =
+{
+    { "S384", "SKN3", "S256" },
+    { "AES3", "2FS3", "AES1" },
+    { "E414", "EC38", "E255", "DH3k" },
+    { "B256", "B32 " },
+    { "SK64", "HS80", "HS32" }
+};
+
+#define PROFILE_TYPES 5
+
+static const Zrtp_AlgoTypes profile_types[PROFILE_TYPES] =
+{
+    zrtp_HashAlgorithm, zrtp_CipherAlgorithm, zrtp_PubKeyAlgorithm,
+    zrtp_SasType, zrtp_AuthLength
+};
+
+static pj_bool_t profile_active;
+static char profile_algos[PROFILE_TYPES][PJMEDIA_ZRTP_MAX_ALGOS][5];
+
+static const char* const* profile_list(const pjmedia_zrtp_profile* profile, int type)
+{
+    switch (type)
+    {
+    case 0: return profile->hash;
+    case 1: return profile->cipher;
+    case 2: return profile->pubKey;
+    case 3: return profile->sas;
+    default: return profile->authLength;
+    }
+}
+
+/* The names a profile may use per type, NULL terminated */
+static const char* const profile_known[PROFILE_TYPES][7] =
+{
+    { "S256", "S384", "SKN2", "SKN3", NULL },
+    { "AES1", "AES3", "2FS1", "2FS3", NULL },
+    { "DH2k", "DH3k", "EC25", "EC38", "E255", "E414", NULL },
+    { "B32 ", "B256", "B32E", NULL },
+    { "HS32", "HS80", "SK32", "SK64", NULL }
+};
+
+/* RFC 6189 chapter 5.1.2 to 5.1.6: every endpoint supports these, a list
+   that leaves one out may not negotiate with some peers */
+static const char* const profile_mandatory[PROFILE_TYPES][3] =
+{
+    { "S256", NULL },
+    { "AES1", NULL },
+    { "DH3k", NULL },
+    { "B32 ", NULL },
+    { "HS32", "HS80", NULL }
+};
+
+static pj_bool_t profile_contains(const char* const* list, int n, const char* name)
+{
+    int i;
+
+    for (i = 0; i < n && list[i] != NULL; i++)
+    {
+        if (pj_ansi_strcmp(list[i], name) == 0)
+            return PJ_TRUE;
+    }
+    return PJ_FALSE;
+}
+
+/* Known names only, and a list that is not empty keeps the mandatory ones */
+static pj_status_t profile_check(const pjmedia_zrtp_profile* profile)
+{
+    const char* const* list;
+    int type, i;
+
+    for (type = 0; type < PROFILE_TYPES; type++)
+    {
+        list = profile_list(profile, type);
+        if (list[0] == NULL)
+            continue;
+
+        for (i = 0; i < PJMEDIA_ZRTP_MAX_ALGOS && list[i] != NULL; i++)
+        {
+            if (!profile_contains(profile_known[type], 7, list[i]))
+            {
+                PJ_LOG(3, (THIS_FILE, "ZRTP profile: unknown algorithm %s", list[i]));
+                return PJ_EINVAL;
+            }
+        }
+        for (i = 0; profile_mandatory[type][i] != NULL; i++)
+        {
+            if (!profile_contains(list, PJMEDIA_ZRTP_MAX_ALGOS, profile_mandatory[type][i]))
+            {
+                PJ_LOG(3, (THIS_FILE, "ZRTP profile: mandatory algorithm %s missing",
+                           profile_mandatory[type][i]));
+                return PJ_EINVAL;
+            }
+        }
+    }
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setCustomProfile(const pjmedia_zrtp_profile *profile)
+{
+    const char* const* list;
+    pj_status_t rc;
+    int type, i;
+
+    if (profile != NULL && (rc = profile_check(profile)) != PJ_SUCCESS)
+        return rc;
+
+    pj_enter_critical_section();
+    pj_bzero(profile_algos, sizeof(profile_algos));
+    profile_active = (profile != NULL);
+    for (type = 0; profile != NULL && type < PROFILE_TYPES; type++)
+    {
+        list = profile_list(profile, type);
+        for (i = 0; i < PJMEDIA_ZRTP_MAX_ALGOS && list[i] != NULL; i++)
+            pj_memcpy(profile_algos[type][i], list[i], 4);
+    }
+    pj_leave_critical_section();
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setProfile(const char *name)
+{
+    if (name == NULL || pj_ansi_strcmp(name, "default") == 0)
+        return pjmedia_transport_zrtp_setCustomProfile(NULL);
+    if (pj_ansi_strcmp(name, "low-latency") == 0)
+        return pjmedia_transport_zrtp_setCustomProfile(&profile_low_latency);
+    if (pj_ansi_strcmp(name, "low-cpu") == 0)
+        return pjmedia_transport_zrtp_setCustomProfile(&profile_low_cpu);
+    if (pj_ansi_strcmp(name, "max-security") == 0)
+        return pjmedia_transport_zrtp_setCustomProfile(&profile_max_security);
+    return PJ_ENOTFOUND;
+}
+
+/* Configure the algorithms of a ZRTP context before the engine starts */
+static void profile_apply(ZrtpContext* ctx)
+{
+    char algos[PROFILE_TYPES][PJMEDIA_ZRTP_MAX_ALGOS][5];
+    pj_bool_t active;
+    int type, i, n;
+
+    pj_enter_critical_section();
+    active = profile_active;
+    pj_memcpy(algos, profile_algos, sizeof(algos));
+    pj_leave_critical_section();
+
+    if (!active)
+        return;
+
+    zrtp_InitializeConfig(ctx);
+    zrtp_setStandardConfig(ctx);
+    for (type = 0; type < PROFILE_TYPES; type++)
+    {
+        Zrtp_AlgoTypes algoType = profile_types[type];
+
+        if (algos[type][0][0] == '\0')
+            continue;
+
+        /* Replace the standard list of the type */
+        n = zrtp_getNumConfiguredAlgos(ctx, algoType);
+        for (i = 0; i < n; i++)
+            zrtp_removeAlgo(ctx, algoType, zrtp_getAlgoAt(ctx, algoType, 0));
+        for (i = 0; i < PJMEDIA_ZRTP_MAX_ALGOS && algos[type][i][0] != '\0'; i++)
+        {
+            /* The library may be built without some algorithms */
+            if (zrtp_addAlgo(ctx, algoType, algos[type][i]) < 0)
+                PJ_LOG(3, (THIS_FILE, "ZRTP profile: algorithm %s not available",
+                           algos[type][i]));
+        }
+    }
+}
+
 PJ_DECL(pj_status_t) pjmedia_transport_zrtp_initialize(pjmedia_transport *tp,
         const char *zidFilename,
         pj_bool_t autoEnable)
@@ -426,12 +1623,14 @@ PJ_DECL(pj_status_t) pjmedia_transport_zrtp_initialize(pjmedia_transport *tp,
     struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
     PJ_ASSERT_RETURN(tp, PJ_EINVAL);
 
+    profile_apply(zrtp->zrtpCtx);
     zrtp_initializeZrtpEngine(zrtp->zrtpCtx, &c_callbacks, zrtp->clientIdString,
                               zidFilename, zrtp, zrtp->mitmMode);
     zrtp->enableZrtp = autoEnable;
     return PJ_SUCCESS;
 }
 
+#ifdef DYNAMIC_TIMER
 static void timer_callback(pj_timer_heap_t *ht, pj_timer_entry *e)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)e->user_data;
@@ -439,6 +1638,14 @@ static void timer_callback(pj_timer_heap_t *ht, pj_timer_entry *e)
     zrtp_processTimeout(zrtp->zrtpCtx);
     PJ_UNUSED_ARG(ht);
 }
+#else
+static void timer_timeout(void* user_data)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
+
+    zrtp_processTimeout(zrtp->zrtpCtx);
+}
+#endif
 
 /*
  * Here start with callback functions that support the ZRTP core
@@ -472,56 +1679,242 @@ static int32_t zrtp_sendDataZRTP(ZrtpContext* ctx, const uint8_t* data, int32_t
     /* Setup and compute ZRTP CRC */
     crc = zrtp_GenerateCksum(buffer, totalLen-CRC_SIZE);
 
-    /* convert and store CRC in ZRTP packet.*/
-    crc = zrtp_EndCksum(crc);
-    *(uint32_t*)(buffer+totalLen-CRC_SIZE) = pj_htonl(crc);
+    /* convert and store CRC in ZRTP packet.*/
+    crc = zrtp_EndCksum(crc);
+    *(uint32_t*)(buffer+totalLen-CRC_SIZE) = pj_htonl(crc);
+
+    /* Send the ZRTP packet using the slave transport */
+    return (pjmedia_transport_send_rtp(zrtp->slave_tp, buffer, totalLen) == PJ_SUCCESS) ? 1 : 0;
+}
+
+static int32_t zrtp_activateTimer(ZrtpContext* ctx, int32_t time)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+
+#ifndef DYNAMIC_TIMER
+    timer_add_entry(&zrtp->timeoutTimer, time);
+#else
+    pj_time_val timeout;
+
+    timeout.sec = time / 1000;
+    timeout.msec = time % 1000;
+
+    pj_timer_heap_cancel_if_active(timer_heap, &zrtp->timeoutEntry, 0);
+    pj_timer_heap_schedule(timer_heap, &zrtp->timeoutEntry, &timeout);
+#endif
+
+    return 1;
+}
+
+static int32_t zrtp_cancelTimer(ZrtpContext* ctx)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+
+#ifndef DYNAMIC_TIMER
+    timer_cancel_entry(&zrtp->timeoutTimer);
+#else
+    pj_timer_heap_cancel_if_active(timer_heap, &zrtp->timeoutEntry, 0);
+#endif
+    return 1;
+}
+
+static void zrtp_sendInfo(ZrtpContext* ctx, int32_t severity, int32_t subCode)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+
+    if (zrtp->userCallback.zrtp_showMessage != NULL)
+    {
+        zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData, severity, subCode);
+    }
+}
+
+/*
+ * Enter a section that uses the SRTP contexts. Packet processing does not
+ * lock, it only counts the threads inside such sections. The count is kept
+ * per parity of the epoch: a thread that sees the epoch change while it
+ * enters counts itself again for the new epoch.
+ *
+ * The returned value goes to srtp_read_leave(). A section must not call
+ * back into the ZRTP engine, the engine may wait for the section to end.
+ */
+static int srtp_read_enter(struct tp_zrtp* zrtp)
+{
+    long e;
+
+    for (;;)
+    {
+        e = zrtp_atomic_load(&zrtp->srtpEpoch) & 1;
+        zrtp_atomic_inc(&zrtp->srtpReaders[e]);
+        if ((zrtp_atomic_load(&zrtp->srtpEpoch) & 1) == e)
+            return (int)e;
+        zrtp_atomic_dec(&zrtp->srtpReaders[e]);
+    }
+}
+
+static void srtp_read_leave(struct tp_zrtp* zrtp, int e)
+{
+    zrtp_atomic_dec(&zrtp->srtpReaders[e]);
+}
+
+/*
+ * Wait until all threads that may still see the old contexts left their
+ * sections. Sections that start after the epoch changed count for the new
+ * parity and load the new contexts.
+ */
+static void srtp_synchronize(struct tp_zrtp* zrtp)
+{
+    long e = zrtp_atomic_inc(&zrtp->srtpEpoch) - 1;
+
+    while (zrtp_atomic_load(&zrtp->srtpReaders[e & 1]) != 0)
+        pj_thread_sleep(0);
+}
+
+/*
+ * Replace the SRTP and SRTCP context of one direction. The new contexts must
+ * be complete, a media thread may use them as soon as they are stored. The
+ * old contexts are destroyed after the grace period. The ZRTP engine calls
+ * this with the ZRTP mutex held, thus publications do not overlap.
+ */
+static void srtp_publish(struct tp_zrtp* zrtp,
+                         ZsrtpContext** slot, ZsrtpContext* srtp,
+                         ZsrtpContextCtrl** slotCtrl, ZsrtpContextCtrl* srtcp)
+{
+    ZsrtpContext* oldSrtp = (ZsrtpContext*)zrtp_swap_ptr(slot, srtp);
+    ZsrtpContextCtrl* oldSrtcp = (ZsrtpContextCtrl*)zrtp_swap_ptr(slotCtrl, srtcp);
+
+    if (oldSrtp == NULL && oldSrtcp == NULL)
+        return;
 
-    /* Send the ZRTP packet using the slave transport */
-    return (pjmedia_transport_send_rtp(zrtp->slave_tp, buffer, totalLen) == PJ_SUCCESS) ? 1 : 0;
+    srtp_synchronize(zrtp);
+    zsrtp_DestroyWrapper(oldSrtp);
+    zsrtp_DestroyWrapperCtrl(oldSrtcp);
 }
 
-static int32_t zrtp_activateTimer(ZrtpContext* ctx, int32_t time)
+/*
+ * Replace the receive contexts. The old contexts stay usable for the re-key
+ * window, they replace the contexts of the key before, which are destroyed
+ * after the grace period.
+ */
+static void srtp_publish_receive(struct tp_zrtp* zrtp, ZsrtpContext* srtp,
+                                 ZsrtpContextCtrl* srtcp)
 {
-    pj_time_val timeout;
-    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+    ZsrtpContext* oldSrtp;
+    ZsrtpContextCtrl* oldSrtcp;
+    pj_time_val now;
 
-    timeout.sec = time / 1000;
-    timeout.msec = time % 1000;
-
-    pj_timer_entry_init(&zrtp->timeoutEntry, 0, zrtp, &timer_callback);
-#ifndef DYNAMIC_TIMER
-    timer_add_entry(&zrtp->timeoutEntry, &timeout);
-#else
-    if(zrtp->timer_heap != NULL){
-    	pj_timer_heap_schedule(zrtp->timer_heap, &zrtp->timeoutEntry, &timeout);
+    if (zrtp->rekeyWindow == 0)
+    {
+        srtp_publish(zrtp, &zrtp->srtpReceive, srtp, &zrtp->srtcpReceive, srtcp);
+        return;
     }
-#endif
+    oldSrtp = (ZsrtpContext*)zrtp_swap_ptr(&zrtp->srtpReceive, srtp);
+    oldSrtcp = (ZsrtpContextCtrl*)zrtp_swap_ptr(&zrtp->srtcpReceive, srtcp);
 
-    return 1;
+    /* Secrets off followed by secrets ready: keep the previous contexts */
+    if (oldSrtp == NULL && oldSrtcp == NULL)
+        return;
+
+    pj_gettickcount(&now);
+    /* Store the end first, a thread that sees the previous contexts sees it */
+    zrtp_atomic_store(&zrtp->rekeyEnd, (long)(pj_uint32_t)(PJ_TIME_VAL_MSEC(now) + zrtp->rekeyWindow));
+    srtp_publish(zrtp, &zrtp->srtpReceivePrev, oldSrtp, &zrtp->srtcpReceivePrev, oldSrtcp);
 }
 
-static int32_t zrtp_cancelTimer(ZrtpContext* ctx)
+/* Return the previous receive context if the re-key window is open */
+static ZsrtpContext* srtp_receive_prev(struct tp_zrtp* zrtp)
 {
-    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+    ZsrtpContext* prev = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpReceivePrev);
+    pj_time_val now;
+
+    if (prev == NULL)
+        return NULL;
+    pj_gettickcount(&now);
+    if ((pj_int32_t)((pj_uint32_t)zrtp_atomic_load(&zrtp->rekeyEnd) - (pj_uint32_t)PJ_TIME_VAL_MSEC(now)) <= 0)
+        return NULL;
+    return prev;
+}
 
-    #ifndef DYNAMIC_TIMER
-    timer_cancel_entry(&zrtp->timeoutEntry);
-#else
-    if(zrtp->timer_heap != NULL){
-    	pj_timer_heap_cancel(zrtp->timer_heap, &zrtp->timeoutEntry);
+/*
+ * Unprotect a SRTP packet, call it inside a read section. During the re-key
+ * window the function tries the newest and the previous context. A failed
+ * AES-GCM check leaves decrypted data in the packet, thus each try starts
+ * from a copy and a packet that fails is restored, it may be plain RTP
+ * after GoClear.
+ *
+ * Returns the result of zsrtp_unprotect, 0 if no context is active.
+ */
+static int32_t srtp_unprotect(struct tp_zrtp* zrtp, ZsrtpContext* srtp,
+                              pj_uint8_t* pkt, int32_t size, int32_t* newLen)
+{
+    ZsrtpContext* prev = srtp_receive_prev(zrtp);
+    ZsrtpContext* first;
+    ZsrtpContext* second;
+    pj_uint8_t copy[PJMEDIA_MAX_MTU];
+    pj_uint32_t ssrc;
+    int32_t rc;
+    int slot;
+
+    if (prev == NULL || size < 12 || size > PJMEDIA_MAX_MTU)
+        return srtp != NULL ? zsrtp_unprotect(srtp, pkt, size, newLen) : 0;
+
+    ssrc = pj_ntohl(((pj_uint32_t*)pkt)[2]);
+    slot = ssrc & (REKEY_SSRC_CACHE - 1);
+    first = srtp;
+    second = prev;
+    if (srtp == NULL ||
+        (zrtp->rekeyCache[slot].ssrc == ssrc && zrtp->rekeyCache[slot].srtp == prev))
+    {
+        first = prev;
+        second = srtp;
     }
-#endif
-    return 1;
+    pj_memcpy(copy, pkt, size);
+    rc = zsrtp_unprotect(first, pkt, size, newLen);
+    if (rc != 1)
+    {
+        pj_memcpy(pkt, copy, size);
+        if (second != NULL && zsrtp_unprotect(second, pkt, size, newLen) == 1)
+        {
+            first = second;
+            rc = 1;
+        }
+        else if (second != NULL)
+        {
+            pj_memcpy(pkt, copy, size);
+        }
+    }
+    if (rc == 1)
+    {
+        zrtp->rekeyCache[slot].ssrc = ssrc;
+        zrtp->rekeyCache[slot].srtp = first;
+    }
+    return rc;
 }
 
-static void zrtp_sendInfo(ZrtpContext* ctx, int32_t severity, int32_t subCode)
+/* The SRTCP variant of srtp_unprotect, RTCP is rare, no cache */
+static int32_t srtcp_unprotect(struct tp_zrtp* zrtp, ZsrtpContextCtrl* srtcp,
+                               pj_uint8_t* pkt, int32_t size, int32_t* newLen)
 {
-    struct tp_zrtp *zrtp = (struct tp_zrtp*)ctx->userData;
+    ZsrtpContextCtrl* prev = NULL;
+    pj_uint8_t copy[PJMEDIA_MAX_MTU];
+    int32_t rc;
 
-    if (zrtp->userCallback.zrtp_showMessage != NULL)
+    if (srtp_receive_prev(zrtp) != NULL)
+        prev = (ZsrtpContextCtrl*)zrtp_load_ptr(&zrtp->srtcpReceivePrev);
+
+    if (prev == NULL || size > PJMEDIA_MAX_MTU)
+        return srtcp != NULL ? zsrtp_unprotectCtrl(srtcp, pkt, size, newLen) : 0;
+
+    pj_memcpy(copy, pkt, size);
+    rc = srtcp != NULL ? zsrtp_unprotectCtrl(srtcp, pkt, size, newLen) : 0;
+    if (rc != 1)
     {
-        zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData, severity, subCode);
+        pj_memcpy(pkt, copy, size);
+        if (zsrtp_unprotectCtrl(prev, pkt, size, newLen) == 1)
+            rc = 1;
+        else
+            pj_memcpy(pkt, copy, size);
     }
+    return rc;
 }
 
 static int32_t zrtp_srtpSecretsReady(ZrtpContext* ctx, C_SrtpSecret_t* secrets, int32_t part)
@@ -535,6 +1928,7 @@ static int32_t zrtp_srtpSecretsReady(ZrtpContext* ctx, C_SrtpSecret_t* secrets,
     int cipher;
     int authn;
     int authKeyLen;
+    unsigned streams;
     //    int srtcpAuthTagLen;
     
     if (secrets->authAlgorithm == zrtp_Sha1) {
@@ -555,6 +1949,14 @@ static int32_t zrtp_srtpSecretsReady(ZrtpContext* ctx, C_SrtpSecret_t* secrets,
     if (secrets->symEncAlgorithm == zrtp_TwoFish)
         cipher = SrtpEncryptionTWOCM;
     
+    /* AES-GCM provides authentication, the ZRTP authentication algorithm
+       is not used in this case */
+    if (zrtp->srtpAeadAgreed && secrets->symEncAlgorithm == zrtp_Aes) {
+        cipher = SrtpEncryptionAESGCM;
+        authn = SrtpAuthenticationNull;
+        authKeyLen = 0;
+    }
+
     if (part == ForSender) {
         // To encrypt packets: intiator uses initiator keys,
         // responder uses responder keys
@@ -625,10 +2027,13 @@ static int32_t zrtp_srtpSecretsReady(ZrtpContext* ctx, C_SrtpSecret_t* secrets,
         // case: the key derivation is defined as 2^48
         // which is effectively 0.
         zsrtp_deriveSrtpKeys(senderCrypto, 0L);
-        zrtp->srtpSend = senderCrypto;
-        
+        if (zrtp->keystreamPackets > 0)
+            zsrtp_enableKeystreamCache(senderCrypto, zrtp->keystreamPackets,
+                                       zrtp->keystreamLength);
         zsrtp_deriveSrtpKeysCtrl(senderCryptoCtrl);
-        zrtp->srtcpSend = senderCryptoCtrl;
+
+        srtp_publish(zrtp, &zrtp->srtpSend, senderCrypto,
+                     &zrtp->srtcpSend, senderCryptoCtrl);
     }
     if (part == ForReceiver) {
         // To decrypt packets: intiator uses responder keys,
@@ -703,9 +2108,17 @@ static int32_t zrtp_srtpSecretsReady(ZrtpContext* ctx, C_SrtpSecret_t* secrets,
         // case: the key derivation is defined as 2^48
         // which is effectively 0.
         zsrtp_deriveSrtpKeys(recvCrypto, 0L);
-        zrtp->srtpReceive = recvCrypto;
+        if (zrtp->replayWindow > 0)
+        {
+            zsrtp_setReplayWindow(recvCrypto, zrtp->replayWindow);
+            zsrtp_setReplayWindowCtrl(recvCryptoCtrl, zrtp->replayWindow);
+        }
+        streams = zrtp->recvStreams > 0 ? zrtp->recvStreams : MAX_RTP_RECV_STREAMS;
+        zsrtp_enableStreamTable(recvCrypto, streams);
+        zsrtp_enableStreamTableCtrl(recvCryptoCtrl, streams);
         zsrtp_deriveSrtpKeysCtrl(recvCryptoCtrl);
-        zrtp->srtcpReceive = recvCryptoCtrl;
+
+        srtp_publish_receive(zrtp, recvCrypto, recvCryptoCtrl);
     }
     return 1;
 }
@@ -716,17 +2129,11 @@ static void zrtp_srtpSecretsOff(ZrtpContext* ctx, int32_t part)
 
     if (part == ForSender)
     {
-        zsrtp_DestroyWrapper(zrtp->srtpSend);
-        zsrtp_DestroyWrapperCtrl(zrtp->srtcpSend);
-        zrtp->srtpSend = NULL;
-        zrtp->srtcpSend = NULL;
+        srtp_publish(zrtp, &zrtp->srtpSend, NULL, &zrtp->srtcpSend, NULL);
     }
     if (part == ForReceiver)
     {
-        zsrtp_DestroyWrapper(zrtp->srtpReceive);
-        zsrtp_DestroyWrapperCtrl(zrtp->srtcpReceive);
-        zrtp->srtpReceive = NULL;
-        zrtp->srtcpReceive = NULL;
+        srtp_publish_receive(zrtp, NULL, NULL);
     }
     if (zrtp->userCallback.zrtp_secureOff != NULL)
     {
@@ -851,6 +2258,145 @@ PJ_DECL(pj_bool_t) pjmedia_transport_zrtp_isEnableZrtp(pjmedia_transport *tp)
     return zrtp->enableZrtp;
 }
 
+PJ_DEF(void) pjmedia_transport_zrtp_setSrtpAead(pjmedia_transport *tp, pj_bool_t onOff)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_assert(tp);
+
+    zrtp->srtpAead = onOff;
+}
+
+PJ_DEF(pj_bool_t) pjmedia_transport_zrtp_isSrtpAead(pjmedia_transport *tp)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    PJ_ASSERT_RETURN(tp, PJ_FALSE);
+
+    return zrtp->srtpAead;
+}
+
+PJ_DEF(void) pjmedia_transport_zrtp_setKeystreamCache(pjmedia_transport *tp,
+                                                      unsigned packets,
+                                                      unsigned maxLength)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_assert(tp);
+
+    zrtp->keystreamPackets = packets;
+    zrtp->keystreamLength = maxLength;
+}
+
+PJ_DEF(unsigned) pjmedia_transport_zrtp_precomputeKeystream(pjmedia_transport *tp)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    ZsrtpContext* srtpSend;
+    unsigned done = 0;
+    int e;
+    PJ_ASSERT_RETURN(tp, 0);
+
+    e = srtp_read_enter(zrtp);
+    srtpSend = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpSend);
+    if (srtpSend != NULL)
+        done = zsrtp_precomputeKeystream(srtpSend);
+    srtp_read_leave(zrtp, e);
+
+    return done;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setReplayWindow(pjmedia_transport *tp,
+                                                           unsigned size)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+    PJ_ASSERT_RETURN(size >= ZSRTP_REPLAY_WINDOW_MIN &&
+                     size <= ZSRTP_REPLAY_WINDOW_MAX, PJ_EINVAL);
+
+    zrtp->replayWindow = size;
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setReceiveStreams(pjmedia_transport *tp,
+                                                             unsigned maxStreams)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+    PJ_ASSERT_RETURN(maxStreams >= 1 && maxStreams <= 64, PJ_EINVAL);
+
+    zrtp->recvStreams = maxStreams;
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(void) pjmedia_transport_zrtp_setRekeyWindow(pjmedia_transport *tp,
+                                                  unsigned msec)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_assert(tp);
+
+    zrtp->rekeyWindow = msec;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setAsync(pjmedia_transport *tp,
+                                                   pj_bool_t enable)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    long n;
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+
+    if (!enable)
+    {
+        zrtp_store_ptr(&zrtp->sendWorker, NULL);
+        zrtp_store_ptr(&zrtp->recvWorker, NULL);
+        async_drain(zrtp);
+        return PJ_SUCCESS;
+    }
+    PJ_ASSERT_RETURN(worker_count > 0, PJ_EINVALIDOP);
+
+    if (zrtp_load_ptr(&zrtp->sendWorker) != NULL)
+        return PJ_SUCCESS;
+
+    /* Spread the directions of the transports over the workers */
+    n = zrtp_atomic_inc(&worker_next) - 1;
+    zrtp_store_ptr(&zrtp->recvWorker, &workers[((unsigned long)n * 2) % worker_count]);
+    zrtp_store_ptr(&zrtp->sendWorker, &workers[((unsigned long)n * 2 + 1) % worker_count]);
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setZrtpOffload(pjmedia_transport *tp,
+                                                         pj_bool_t enable)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    long n;
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+
+    if (!enable)
+    {
+        zrtp_store_ptr(&zrtp->zrtpWorker, NULL);
+        async_drain(zrtp);
+        return PJ_SUCCESS;
+    }
+    PJ_ASSERT_RETURN(worker_count > 0, PJ_EINVALIDOP);
+
+    if (zrtp_load_ptr(&zrtp->zrtpWorker) != NULL)
+        return PJ_SUCCESS;
+
+    /* One worker keeps the order of the ZRTP packets of the transport */
+    n = zrtp_atomic_inc(&worker_next) - 1;
+    zrtp_store_ptr(&zrtp->zrtpWorker, &workers[(unsigned long)n % worker_count]);
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_setParallelDecrypt(pjmedia_transport *tp,
+                                                             unsigned minBurst)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+    PJ_ASSERT_RETURN(minBurst == 0 || worker_count > 0, PJ_EINVALIDOP);
+
+    zrtp->parallelMin = minBurst;
+    if (minBurst == 0)
+        async_drain(zrtp);
+    return PJ_SUCCESS;
+}
+
 PJ_DEF(void) pjmedia_transport_zrtp_setUserCallback(pjmedia_transport *tp, zrtp_UserCallbacks* ucb)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
@@ -883,7 +2429,15 @@ PJ_DEF(void) pjmedia_transport_zrtp_stopZrtp(pjmedia_transport *tp)
 
     pj_assert(tp && zrtp->zrtpCtx);
 
+    /* A worker may process a ZRTP packet */
+    zrtp_store_ptr(&zrtp->zrtpWorker, NULL);
+    async_drain(zrtp);
+
     zrtp_stopZrtpEngine(zrtp->zrtpCtx);
+#ifndef DYNAMIC_TIMER
+    /* The timeout callback uses the ZRTP context */
+    timer_stop_entry(&zrtp->timeoutTimer);
+#endif
     zrtp_DestroyWrapper(zrtp->zrtpCtx);
 
     /* In case mutex is being acquired by other thread */
@@ -892,16 +2446,10 @@ PJ_DEF(void) pjmedia_transport_zrtp_stopZrtp(pjmedia_transport *tp)
     pj_mutex_destroy(zrtp->zrtpMutex);
 
 #ifdef DYNAMIC_TIMER
-    pj_timer_heap_destroy(zrtp->timer_heap);
-    pj_pool_release(zrtp->timer_pool);
-#else
-    timer_stop();
+    pj_timer_heap_cancel_if_active(timer_heap, &zrtp->timeoutEntry, 0);
 #endif
     pj_pool_release(zrtp->pool);
 
-#ifdef DYNAMIC_TIMER
-    zrtp->timer_pool = NULL;
-#endif
     zrtp->pool = NULL;
     zrtp->zrtpCtx = NULL;
     zrtp->zrtpMutex = NULL;
@@ -970,16 +2518,34 @@ static pj_status_t transport_get_info(pjmedia_transport *tp,
     return pjmedia_transport_get_info(zrtp->slave_tp, info);
 }
 
-/* This is our RTP callback, that is called by the slave transport when it
- * receives RTP packet.
- */
-static void transport_rtp_cb(void *user_data, void *pkt, pj_ssize_t size)
+/* Report a failed SRTP check to the application */
+static void report_unprotect_error(struct tp_zrtp *zrtp, int32_t rc)
+{
+    if (zrtp->userCallback.zrtp_showMessage != NULL)
+    {
+        if (rc == -1) {
+            zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData,
+                                                zrtp_Warning, 
+                                                zrtp_WarningSRTPauthError);
+        }
+        else {
+            zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData,
+                                                zrtp_Warning,
+                                                zrtp_WarningSRTPreplayError);
+        }
+    }
+}
+
+/* Check, decrypt and deliver a RTP packet, or process a ZRTP packet */
+static void receive_rtp(void *user_data, void *pkt, pj_ssize_t size)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
 
     pj_uint8_t* buffer = (pj_uint8_t*)pkt;
+    ZsrtpContext* srtpReceive;
     int32_t newLen = 0;
     pj_status_t rc = PJ_SUCCESS;
+    int e;
 
     pj_assert(zrtp && zrtp->stream_rtcp_cb && pkt);
 
@@ -987,13 +2553,22 @@ static void transport_rtp_cb(void *user_data, void *pkt, pj_ssize_t size)
     if ((*buffer & 0xf0) != 0x10)
     {
         //  Could be real RTP, check if we are in secure mode
-        if (zrtp->srtpReceive == NULL || size < 0)
+        e = srtp_read_enter(zrtp);
+        srtpReceive = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpReceive);
+        if (size >= 0 && (srtpReceive != NULL || srtp_receive_prev(zrtp) != NULL))
+            rc = srtp_unprotect(zrtp, srtpReceive, (pj_uint8_t*)pkt, size, &newLen);
+        else
+            rc = 0;
+        srtp_read_leave(zrtp, e);
+
+        /* Without receive context, or after GoClear in the re-key window,
+           packets that do not authenticate are plain RTP */
+        if ((srtpReceive == NULL && rc != 1) || size < 0)
         {
             zrtp->stream_rtp_cb(zrtp->stream_user_data, pkt, size);
         }
         else
         {
-            rc = zsrtp_unprotect(zrtp->srtpReceive, (pj_uint8_t*)pkt, size, &newLen);
             if (rc == 1)
             {
                 zrtp->unprotect++;
@@ -1003,91 +2578,281 @@ static void transport_rtp_cb(void *user_data, void *pkt, pj_ssize_t size)
             }
             else
             {
-                if (zrtp->userCallback.zrtp_showMessage != NULL)
-                {
-                    if (rc == -1) {
-                        zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData,
-                                                            zrtp_Warning, 
-                                                            zrtp_WarningSRTPauthError);
-                    }
-                    else {
-                        zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData,
-                                                            zrtp_Warning,
-                                                            zrtp_WarningSRTPreplayError);
-                    }
-                }
+                report_unprotect_error(zrtp, rc);
                 zrtp->unprotect_err = rc;
             }
         }
-        if (!zrtp->started && zrtp->enableZrtp)
-            pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+        if (!zrtp->started && zrtp->enableZrtp)
+            pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+
+        return;
+    }
+
+    // We assume all other packets are ZRTP packets here. Process
+    // if ZRTP processing is enabled. Because valid RTP packets are
+    // already handled we delete any packets here after processing.
+    if (zrtp->enableZrtp && zrtp->zrtpCtx != NULL)
+    {
+        unsigned char* zrtpMsg = NULL;
+        pj_uint32_t magic = *(pj_uint32_t*)(buffer + 4);
+
+        // Get CRC value into crc (see above how to compute the offset)
+        pj_uint16_t temp = (pj_uint16_t)(size - CRC_SIZE);
+        pj_uint32_t crc = *(uint32_t*)(buffer + temp);
+        crc = pj_ntohl(crc);
+
+        if (!zrtp_CheckCksum(buffer, temp, crc))
+        {
+            if (zrtp->userCallback.zrtp_showMessage != NULL)
+                zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData, zrtp_Warning, zrtp_WarningCRCmismatch);
+            return;
+        }
+        magic = pj_ntohl(magic);
+
+        // Check if it is really a ZRTP packet, return, no further processing
+        if (magic != ZRTP_MAGIC || zrtp->zrtpCtx == NULL)
+        {
+            return;
+        }
+        // cover the case if the other party sends _only_ ZRTP packets at the
+        // beginning of a session. Start ZRTP in this case as well.
+        if (!zrtp->started)
+        {
+            pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+        }
+        // this now points beyond the undefined and length field.
+        // We need them, thus adjust
+        zrtpMsg = (buffer + 12);
+
+        // store peer's SSRC in host order, used when creating the CryptoContext
+        zrtp->peerSSRC = *(pj_uint32_t*)(buffer + 8);
+        zrtp->peerSSRC = pj_ntohl(zrtp->peerSSRC);
+        zrtp_processZrtpMessage(zrtp->zrtpCtx, zrtpMsg, zrtp->peerSSRC, size);
+    }
+}
+
+
+/* This is our RTP callback, that is called by the slave transport when it
+ * receives RTP packet. ZRTP packets are processed here unless ZRTP offload
+ * hands them to a worker, the DH computation of a handshake then does
+ * not stall the other streams of the slave transport's thread.
+ */
+static void transport_rtp_cb(void *user_data, void *pkt, pj_ssize_t size)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
+    pj_status_t status;
+    int type;
+
+    type = ((*(pj_uint8_t*)pkt & 0xf0) == 0x10) ? ZRTP_JOB_ZRTP : ZRTP_JOB_RECV_RTP;
+    if (async_submit(zrtp, type, pkt, size, &status))
+        return;
+    receive_rtp(user_data, pkt, size);
+}
+
+/*
+ * Take jobs of the current burst until none is left.
+ */
+static void burst_work(struct zrtp_burst* b)
+{
+    long i;
+
+    while ((i = zrtp_atomic_inc(&b->next) - 1) < b->count)
+        zsrtp_unprotect_run(b->srtp, &b->jobs[i]);
+}
+
+/*
+ * A worker helps with the burst of generation gen. The burst may have
+ * ended before the worker got to the job, the generation then changed.
+ * The receive thread waits for active workers before it releases the jobs.
+ */
+static void burst_help(struct tp_zrtp* zrtp, long gen)
+{
+    struct zrtp_burst* b = &zrtp->burst;
+
+    zrtp_atomic_inc(&b->active);
+    if (zrtp_atomic_load(&b->gen) == gen)
+        burst_work(b);
+    zrtp_atomic_dec(&b->active);
+}
+
+/*
+ * Decrypt a burst on the receive thread and on workers. Returns PJ_FALSE
+ * if the context cannot decrypt on several threads.
+ */
+static pj_bool_t parallel_unprotect(struct tp_zrtp *zrtp, ZsrtpContext* srtp,
+                                    pj_uint8_t* buffers[], int32_t lens[], unsigned n,
+                                    int32_t newLens[], int32_t results[])
+{
+    ZsrtpUnprotectJob jobs[MAX_RTP_RECV_BATCH];
+    struct zrtp_burst* b = &zrtp->burst;
+    int32_t todo;
+    long gen, helpers, i;
+    unsigned start;
+
+    todo = zsrtp_unprotect_prepare(srtp, buffers, lens, (int32_t)n, jobs);
+    if (todo < 0)
+        return PJ_FALSE;
+
+    if (todo > 1)
+    {
+        b->srtp = srtp;
+        b->jobs = jobs;
+        b->count = (long)n;
+        zrtp_atomic_store(&b->next, 0);
+        gen = zrtp_atomic_inc(&b->gen);
+
+        /* Start with a worker after the last one used to spread the load */
+        helpers = PJ_MIN((long)worker_count, (long)todo) - 1;
+        start = (unsigned)zrtp_atomic_inc(&worker_next);
+        for (i = 0; i < helpers; i++)
+        {
+            struct zrtp_worker* w = &workers[(start + i) % worker_count];
+
+            zrtp_atomic_inc(&zrtp->asyncPending);
+            if (!worker_queue(w, zrtp, ZRTP_JOB_DECRYPT, NULL, (pj_ssize_t)gen))
+                zrtp_atomic_dec(&zrtp->asyncPending);
+        }
+        burst_work(b);
+
+        /* All jobs are taken. End the burst, then wait for workers that
+           still decrypt a packet. */
+        zrtp_atomic_inc(&b->gen);
+        while (zrtp_atomic_load(&b->active) != 0)
+            pj_thread_sleep(0);
+    }
+    else
+    {
+        for (i = 0; i < (long)n; i++)
+            zsrtp_unprotect_run(srtp, &jobs[i]);
+    }
+    zsrtp_unprotect_commit(srtp, jobs, (int32_t)n, newLens, results);
+    return PJ_TRUE;
+}
+
+/* Check, decrypt and deliver collected SRTP packets in arrival order */
+static void flush_rtp_batch(struct tp_zrtp *zrtp, pj_uint8_t* buffers[],
+                            int32_t lens[], unsigned n)
+{
+    int32_t newLens[MAX_RTP_RECV_BATCH];
+    int32_t results[MAX_RTP_RECV_BATCH];
+    ZsrtpContext* srtpReceive;
+    unsigned i;
+    int e;
+
+    e = srtp_read_enter(zrtp);
+    srtpReceive = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpReceive);
+    if (srtpReceive == NULL || srtp_receive_prev(zrtp) != NULL)
+    {
+        /* SRTP stopped after the packets were collected, or the re-key
+           window is open: handle each packet on its own */
+        srtp_read_leave(zrtp, e);
+        for (i = 0; i < n; i++)
+            receive_rtp(zrtp, buffers[i], lens[i]);
+        return;
+    }
+    if (zrtp->parallelMin == 0 || n < zrtp->parallelMin || worker_count < 2 ||
+        !parallel_unprotect(zrtp, srtpReceive, buffers, lens, n, newLens, results))
+    {
+        zsrtp_unprotect_batch(srtpReceive, buffers, lens, n, newLens, results);
+    }
+    srtp_read_leave(zrtp, e);
+
+    for (i = 0; i < n; i++)
+    {
+        if (results[i] == 1)
+        {
+            zrtp->unprotect++;
+            zrtp->stream_rtp_cb(zrtp->stream_user_data, buffers[i], newLens[i]);
+            zrtp->unprotect_err = 0;
+        }
+        else
+        {
+            report_unprotect_error(zrtp, results[i]);
+            zrtp->unprotect_err = results[i];
+        }
+    }
+}
 
+/* This is the batch variant of our RTP callback, a slave transport that
+ * receives several packets at once may call it.
+ */
+PJ_DEF(void) pjmedia_transport_zrtp_rtp_batch_cb(void *user_data,
+        void *pkts[],
+        const pj_ssize_t sizes[],
+        unsigned count)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
+    pj_uint8_t* buffers[MAX_RTP_RECV_BATCH];
+    int32_t lens[MAX_RTP_RECV_BATCH];
+    unsigned i, n = 0;
+
+    pj_assert(zrtp && zrtp->stream_rtp_cb && pkts && sizes);
+
+    /* The workers take the packets one by one */
+    if (zrtp_load_ptr(&zrtp->recvWorker) != NULL)
+    {
+        for (i = 0; i < count; i++)
+            transport_rtp_cb(zrtp, pkts[i], sizes[i]);
         return;
     }
 
-    // We assume all other packets are ZRTP packets here. Process
-    // if ZRTP processing is enabled. Because valid RTP packets are
-    // already handled we delete any packets here after processing.
-    if (zrtp->enableZrtp && zrtp->zrtpCtx != NULL)
+    for (i = 0; i < count; i++)
     {
-        unsigned char* zrtpMsg = NULL;
-        pj_uint32_t magic = *(pj_uint32_t*)(buffer + 4);
-
-        // Get CRC value into crc (see above how to compute the offset)
-        pj_uint16_t temp = (pj_uint16_t)(size - CRC_SIZE);
-        pj_uint32_t crc = *(uint32_t*)(buffer + temp);
-        crc = pj_ntohl(crc);
-
-        if (!zrtp_CheckCksum(buffer, temp, crc))
-        {
-            if (zrtp->userCallback.zrtp_showMessage != NULL)
-                zrtp->userCallback.zrtp_showMessage(zrtp->userCallback.userData, zrtp_Warning, zrtp_WarningCRCmismatch);
-            return;
-        }
-        magic = pj_ntohl(magic);
+        pj_uint8_t* buffer = (pj_uint8_t*)pkts[i];
 
-        // Check if it is really a ZRTP packet, return, no further processing
-        if (magic != ZRTP_MAGIC || zrtp->zrtpCtx == NULL)
+        // Only SRTP packets go into the batch. Flush the batch before any
+        // other packet to keep the arrival order.
+        if (zrtp_load_ptr(&zrtp->srtpReceive) == NULL || sizes[i] < 0 || (*buffer & 0xf0) == 0x10)
         {
-            return;
+            if (n > 0)
+            {
+                flush_rtp_batch(zrtp, buffers, lens, n);
+                n = 0;
+            }
+            transport_rtp_cb(zrtp, pkts[i], sizes[i]);
+            continue;
         }
-        // cover the case if the other party sends _only_ ZRTP packets at the
-        // beginning of a session. Start ZRTP in this case as well.
-        if (!zrtp->started)
+        buffers[n] = buffer;
+        lens[n] = (int32_t)sizes[i];
+        if (++n == MAX_RTP_RECV_BATCH)
         {
-            pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+            flush_rtp_batch(zrtp, buffers, lens, n);
+            n = 0;
         }
-        // this now points beyond the undefined and length field.
-        // We need them, thus adjust
-        zrtpMsg = (buffer + 12);
-
-        // store peer's SSRC in host order, used when creating the CryptoContext
-        zrtp->peerSSRC = *(pj_uint32_t*)(buffer + 8);
-        zrtp->peerSSRC = pj_ntohl(zrtp->peerSSRC);
-        zrtp_processZrtpMessage(zrtp->zrtpCtx, zrtpMsg, zrtp->peerSSRC, size);
     }
+    if (n > 0)
+        flush_rtp_batch(zrtp, buffers, lens, n);
+
+    if (!zrtp->started && zrtp->enableZrtp)
+        pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
 }
 
 
-/* This is our RTCP callback, that is called by the slave transport when it
- * receives RTCP packet.
- */
-static void transport_rtcp_cb(void *user_data, void *pkt, pj_ssize_t size)
+/* Check, decrypt and deliver a RTCP packet */
+static void receive_rtcp(void *user_data, void *pkt, pj_ssize_t size)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
+    ZsrtpContextCtrl* srtcpReceive;
     int32_t newLen = 0;
     pj_status_t rc = PJ_SUCCESS;
+    int e;
     
     pj_assert(zrtp && zrtp->stream_rtcp_cb);
     
-    if (zrtp->srtcpReceive == NULL || size < 0)
+    e = srtp_read_enter(zrtp);
+    srtcpReceive = (ZsrtpContextCtrl*)zrtp_load_ptr(&zrtp->srtcpReceive);
+    if (size >= 0 && (srtcpReceive != NULL || srtp_receive_prev(zrtp) != NULL))
+        rc = srtcp_unprotect(zrtp, srtcpReceive, (pj_uint8_t*)pkt, size, &newLen);
+    else
+        rc = 0;
+    srtp_read_leave(zrtp, e);
+
+    if ((srtcpReceive == NULL && rc != 1) || size < 0)
     {
         zrtp->stream_rtcp_cb(zrtp->stream_user_data, pkt, size);
     }
     else
     {
-        rc = zsrtp_unprotectCtrl(zrtp->srtcpReceive, (pj_uint8_t*)pkt, size, &newLen);
-
         if (rc == 1)
         {
             /* Call stream's callback */
@@ -1100,6 +2865,19 @@ static void transport_rtcp_cb(void *user_data, void *pkt, pj_ssize_t size)
     }
 }
 
+/* This is our RTCP callback, that is called by the slave transport when it
+ * receives RTCP packet.
+ */
+static void transport_rtcp_cb(void *user_data, void *pkt, pj_ssize_t size)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)user_data;
+    pj_status_t status;
+
+    if (async_submit(zrtp, ZRTP_JOB_RECV_RTCP, pkt, size, &status))
+        return;
+    receive_rtcp(user_data, pkt, size);
+}
+
 
 /*
  * attach() is called by stream to register callbacks that we should
@@ -1159,6 +2937,8 @@ static void transport_detach(pjmedia_transport *tp, void *strm)
     if (zrtp->stream_user_data != NULL)
     {
         pjmedia_transport_detach(zrtp->slave_tp, zrtp);
+        /* Deliver the packets the workers still hold */
+        async_drain(zrtp);
         zrtp->stream_user_data = NULL;
         zrtp->stream_rtp_cb = NULL;
         zrtp->stream_rtcp_cb = NULL;
@@ -1173,11 +2953,29 @@ static void transport_detach(pjmedia_transport *tp, void *strm)
 static pj_status_t transport_send_rtp(pjmedia_transport *tp,
                                       const void *pkt,
                                       pj_size_t size)
+{
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN(tp && pkt, PJ_EINVAL);
+
+    if (async_submit((struct tp_zrtp*)tp, ZRTP_JOB_SEND_RTP, pkt, (pj_ssize_t)size, &status))
+        return status;
+    return send_rtp(tp, pkt, size);
+}
+
+/* Protect and send a RTP packet */
+static pj_status_t send_rtp(pjmedia_transport *tp,
+                            const void *pkt,
+                            pj_size_t size)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
     pj_uint32_t* pui = (pj_uint32_t*)pkt;
+    ZsrtpContext* srtpSend;
     int32_t newLen = 0;
     pj_status_t rc = PJ_SUCCESS;
+    int e;
+    /* Per call buffer, several threads may send at the same time */
+    pj_uint8_t buffer[PJMEDIA_MAX_MTU];
 
     PJ_ASSERT_RETURN(tp && pkt, PJ_EINVAL);
 
@@ -1190,26 +2988,348 @@ static pj_status_t transport_send_rtp(pjmedia_transport *tp,
         pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
     }
 
-    if (zrtp->srtpSend == NULL)
+    e = srtp_read_enter(zrtp);
+    srtpSend = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpSend);
+    if (srtpSend == NULL)
     {
+        srtp_read_leave(zrtp, e);
         return pjmedia_transport_send_rtp(zrtp->slave_tp, pkt, size);
     }
     else
     {
         if (size > MAX_RTP_BUFFER_LEN)
+        {
+            srtp_read_leave(zrtp, e);
             return PJ_ETOOBIG;
-
-        pj_memcpy(zrtp->sendBuffer, pkt, size);
-        rc = zsrtp_protect(zrtp->srtpSend, zrtp->sendBuffer, size, &newLen);
+        }
+        pj_memcpy(buffer, pkt, size);
+        rc = zsrtp_protect(srtpSend, buffer, size, &newLen);
+        srtp_read_leave(zrtp, e);
         zrtp->protect++;
 
         if (rc == 1)
-            return pjmedia_transport_send_rtp(zrtp->slave_tp, zrtp->sendBuffer, newLen);
+            return pjmedia_transport_send_rtp(zrtp->slave_tp, buffer, newLen);
         else
             return PJ_EIGNORED;
     }
 }
 
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_send_rtp_inplace(pjmedia_transport *tp,
+        void *pkt,
+        pj_size_t size,
+        pj_size_t capacity)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_uint32_t* pui = (pj_uint32_t*)pkt;
+    ZsrtpContext* srtpSend;
+    int32_t newLen = 0;
+    int32_t rc;
+    int e;
+
+    PJ_ASSERT_RETURN(tp && pkt && capacity >= size, PJ_EINVAL);
+
+    /* The workers protect a copy of the packet */
+    if (zrtp_load_ptr(&zrtp->sendWorker) != NULL)
+        return transport_send_rtp(tp, pkt, size);
+
+    if (!zrtp->started && zrtp->enableZrtp)
+    {
+        if (zrtp->localSSRC == 0)
+            zrtp->localSSRC = pj_ntohl(pui[2]);   /* Learn own SSRC before starting ZRTP */
+
+        pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+    }
+
+    e = srtp_read_enter(zrtp);
+    srtpSend = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpSend);
+    if (srtpSend == NULL)
+    {
+        srtp_read_leave(zrtp, e);
+        return pjmedia_transport_send_rtp(zrtp->slave_tp, pkt, size);
+    }
+    /* Not enough room for the tag: use the send buffer */
+    if (capacity - size < (pj_size_t)zsrtp_getTrailerLength(srtpSend))
+    {
+        srtp_read_leave(zrtp, e);
+        return send_rtp(tp, pkt, size);
+    }
+    rc = zsrtp_protect(srtpSend, (pj_uint8_t*)pkt, (int32_t)size, &newLen);
+    srtp_read_leave(zrtp, e);
+    zrtp->protect++;
+
+    if (rc == 1)
+        return pjmedia_transport_send_rtp(zrtp->slave_tp, pkt, newLen);
+    else
+        return PJ_EIGNORED;
+}
+
+/*
+ * Send a burst of RTP packets, protect them in chunks of MAX_RTP_SEND_BATCH.
+ * Each chunk slot has PJMEDIA_MAX_MTU bytes, this leaves room for the
+ * SRTP authentication tag.
+ */
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_send_rtp_batch(pjmedia_transport *tp,
+        const void *pkts[],
+        const pj_size_t sizes[],
+        unsigned count)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_uint8_t* buffers[MAX_RTP_SEND_BATCH];
+    int32_t lens[MAX_RTP_SEND_BATCH];
+    int32_t newLens[MAX_RTP_SEND_BATCH];
+    ZsrtpContext* srtpSend;
+    pj_status_t status = PJ_SUCCESS;
+    pj_status_t rc;
+    unsigned i, j, n, chunk;
+    int e;
+
+    PJ_ASSERT_RETURN(tp && pkts && sizes, PJ_EINVAL);
+
+    if (count == 0)
+        return PJ_SUCCESS;
+
+    /* The workers take the packets one by one */
+    if (zrtp_load_ptr(&zrtp->sendWorker) != NULL)
+    {
+        for (i = 0; i < count; i++)
+        {
+            rc = transport_send_rtp(tp, pkts[i], sizes[i]);
+            if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+                status = rc;
+        }
+        return status;
+    }
+
+    if (!zrtp->started && zrtp->enableZrtp)
+    {
+        if (zrtp->localSSRC == 0)
+            zrtp->localSSRC = pj_ntohl(((const pj_uint32_t*)pkts[0])[2]);   /* Learn own SSRC before starting ZRTP */
+
+        pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+    }
+
+    if (zrtp_load_ptr(&zrtp->srtpSend) == NULL)
+    {
+        for (i = 0; i < count; i++)
+        {
+            rc = pjmedia_transport_send_rtp(zrtp->slave_tp, pkts[i], sizes[i]);
+            if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+                status = rc;
+        }
+        return status;
+    }
+
+    /* The batch buffer is too large for the stack. If another thread uses
+     * it then send the packets one by one with per call buffers. */
+    if (pj_atomic_inc_and_get(zrtp->sendBatchBusy) != 1)
+    {
+        pj_atomic_dec(zrtp->sendBatchBusy);
+        for (i = 0; i < count; i++)
+        {
+            rc = send_rtp(tp, pkts[i], sizes[i]);
+            if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+                status = rc;
+        }
+        return status;
+    }
+    if (zrtp->sendBatchBuffer == NULL)
+    {
+        zrtp->sendBatchBuffer = (pj_uint8_t*)pj_pool_alloc(zrtp->pool,
+                                                           MAX_RTP_SEND_BATCH * PJMEDIA_MAX_MTU);
+        if (zrtp->sendBatchBuffer == NULL)
+        {
+            pj_atomic_dec(zrtp->sendBatchBusy);
+            return PJ_ENOMEM;
+        }
+    }
+
+    for (i = 0; i < count; i += chunk)
+    {
+        chunk = count - i;
+        if (chunk > MAX_RTP_SEND_BATCH)
+            chunk = MAX_RTP_SEND_BATCH;
+
+        for (j = 0, n = 0; j < chunk; j++)
+        {
+            if (sizes[i+j] > MAX_RTP_BUFFER_LEN)
+            {
+                if (status == PJ_SUCCESS)
+                    status = PJ_ETOOBIG;
+                continue;
+            }
+            buffers[n] = zrtp->sendBatchBuffer + n * PJMEDIA_MAX_MTU;
+            lens[n] = (int32_t)sizes[i+j];
+            pj_memcpy(buffers[n], pkts[i+j], sizes[i+j]);
+            n++;
+        }
+        e = srtp_read_enter(zrtp);
+        srtpSend = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpSend);
+        if (srtpSend != NULL)
+        {
+            zrtp->protect += zsrtp_protect_batch(srtpSend, buffers, lens, n, newLens);
+        }
+        else
+        {
+            /* SRTP stopped meanwhile, send unprotected as transport_send_rtp would */
+            for (j = 0; j < n; j++)
+                newLens[j] = lens[j];
+        }
+        srtp_read_leave(zrtp, e);
+
+        for (j = 0; j < n; j++)
+        {
+            if (newLens[j] <= 0)
+                continue;
+            rc = pjmedia_transport_send_rtp(zrtp->slave_tp, buffers[j], newLens[j]);
+            if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+                status = rc;
+        }
+    }
+    pj_atomic_dec(zrtp->sendBatchBusy);
+    return status;
+}
+
+/*
+ * The tick collector. Each packet slot has PJMEDIA_MAX_MTU bytes, this
+ * leaves room for the SRTP authentication tag.
+ */
+struct pjmedia_zrtp_tick
+{
+    unsigned maxPackets;
+    unsigned count;
+    struct tp_zrtp** transports;
+    ZsrtpContext** contexts;
+    int* epochs;                /* srtp_read_enter() result of each context */
+    pj_uint8_t** buffers;
+    int32_t* lens;
+    int32_t* newLens;
+};
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_tick_create(pj_pool_t *pool,
+        unsigned max_packets,
+        pjmedia_zrtp_tick **p_tick)
+{
+    pjmedia_zrtp_tick *tick;
+    pj_uint8_t* data;
+    unsigned i;
+
+    PJ_ASSERT_RETURN(pool && max_packets && p_tick, PJ_EINVAL);
+
+    tick = PJ_POOL_ZALLOC_T(pool, pjmedia_zrtp_tick);
+    tick->maxPackets = max_packets;
+    tick->transports = (struct tp_zrtp**)pj_pool_calloc(pool, max_packets, sizeof(struct tp_zrtp*));
+    tick->contexts = (ZsrtpContext**)pj_pool_calloc(pool, max_packets, sizeof(ZsrtpContext*));
+    tick->epochs = (int*)pj_pool_calloc(pool, max_packets, sizeof(int));
+    tick->buffers = (pj_uint8_t**)pj_pool_calloc(pool, max_packets, sizeof(pj_uint8_t*));
+    tick->lens = (int32_t*)pj_pool_calloc(pool, max_packets, sizeof(int32_t));
+    tick->newLens = (int32_t*)pj_pool_calloc(pool, max_packets, sizeof(int32_t));
+    data = (pj_uint8_t*)pj_pool_alloc(pool, max_packets * PJMEDIA_MAX_MTU);
+
+    if (tick->transports == NULL || tick->contexts == NULL || tick->epochs == NULL || tick->buffers == NULL ||
+        tick->lens == NULL || tick->newLens == NULL || data == NULL)
+        return PJ_ENOMEM;
+
+    for (i = 0; i < max_packets; i++)
+        tick->buffers[i] = data + i * PJMEDIA_MAX_MTU;
+
+    *p_tick = tick;
+    return PJ_SUCCESS;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_tick_send_rtp(pjmedia_zrtp_tick *tick,
+        pjmedia_transport *tp,
+        const void *pkt,
+        pj_size_t size)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    pj_status_t status = PJ_SUCCESS;
+
+    PJ_ASSERT_RETURN(tick && tp && pkt, PJ_EINVAL);
+
+    if (!zrtp->started && zrtp->enableZrtp)
+    {
+        if (zrtp->localSSRC == 0)
+            zrtp->localSSRC = pj_ntohl(((const pj_uint32_t*)pkt)[2]);   /* Learn own SSRC before starting ZRTP */
+
+        pjmedia_transport_zrtp_startZrtp((pjmedia_transport *)zrtp);
+    }
+
+    if (zrtp_load_ptr(&zrtp->srtpSend) == NULL)
+        return pjmedia_transport_send_rtp(zrtp->slave_tp, pkt, size);
+
+    if (size > MAX_RTP_BUFFER_LEN)
+        return PJ_ETOOBIG;
+
+    if (tick->count == tick->maxPackets)
+        status = pjmedia_transport_zrtp_tick_flush(tick);
+
+    pj_memcpy(tick->buffers[tick->count], pkt, size);
+    tick->lens[tick->count] = (int32_t)size;
+    tick->transports[tick->count] = zrtp;
+    tick->count++;
+
+    return status;
+}
+
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_tick_flush(pjmedia_zrtp_tick *tick)
+{
+    pj_status_t status = PJ_SUCCESS;
+    pj_status_t rc;
+    unsigned i, n;
+
+    PJ_ASSERT_RETURN(tick, PJ_EINVAL);
+
+    /* Packets of transports that stopped SRTP meanwhile go out unprotected,
+       as transport_send_rtp would do. The contexts of the other packets
+       stay valid until the read sections end after protecting. */
+    for (i = 0, n = 0; i < tick->count; i++)
+    {
+        struct tp_zrtp *zrtp = tick->transports[i];
+        int e = srtp_read_enter(zrtp);
+        ZsrtpContext* srtpSend = (ZsrtpContext*)zrtp_load_ptr(&zrtp->srtpSend);
+
+        if (srtpSend == NULL)
+        {
+            srtp_read_leave(zrtp, e);
+            rc = pjmedia_transport_send_rtp(zrtp->slave_tp, tick->buffers[i], tick->lens[i]);
+            if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+                status = rc;
+            tick->lens[i] = 0;
+            continue;
+        }
+        tick->contexts[n] = srtpSend;
+        tick->epochs[n] = e;
+        tick->transports[n] = zrtp;
+        if (n != i)
+        {
+            pj_uint8_t* tmp = tick->buffers[n];
+            tick->buffers[n] = tick->buffers[i];
+            tick->buffers[i] = tmp;
+            tick->lens[n] = tick->lens[i];
+        }
+        n++;
+    }
+
+    zsrtp_protect_multi(tick->contexts, tick->buffers, tick->lens, n, tick->newLens);
+
+    for (i = 0; i < n; i++)
+        srtp_read_leave(tick->transports[i], tick->epochs[i]);
+
+    for (i = 0; i < n; i++)
+    {
+        struct tp_zrtp *zrtp = tick->transports[i];
+
+        if (tick->newLens[i] <= 0)
+            continue;
+        zrtp->protect++;
+        rc = pjmedia_transport_send_rtp(zrtp->slave_tp, tick->buffers[i], tick->newLens[i]);
+        if (rc != PJ_SUCCESS && status == PJ_SUCCESS)
+            status = rc;
+    }
+    tick->count = 0;
+    return status;
+}
+
 
 /*
  * send_rtcp() is called to send RTCP packet. The "pkt" and "size" argument
@@ -1218,27 +3338,51 @@ static pj_status_t transport_send_rtp(pjmedia_transport *tp,
 static pj_status_t transport_send_rtcp(pjmedia_transport *tp,
                                        const void *pkt,
                                        pj_size_t size)
+{
+    pj_status_t status;
+
+    PJ_ASSERT_RETURN(tp, PJ_EINVAL);
+
+    if (async_submit((struct tp_zrtp*)tp, ZRTP_JOB_SEND_RTCP, pkt, (pj_ssize_t)size, &status))
+        return status;
+    return send_rtcp(tp, pkt, size);
+}
+
+/* Protect and send a RTCP packet */
+static pj_status_t send_rtcp(pjmedia_transport *tp,
+                             const void *pkt,
+                             pj_size_t size)
 {
     struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    ZsrtpContextCtrl* srtcpSend;
     pj_status_t rc = PJ_SUCCESS;
     int32_t newLen = 0;
+    int e;
+    /* Per call buffer, several threads may send at the same time */
+    pj_uint8_t buffer[PJMEDIA_MAX_MTU];
     PJ_ASSERT_RETURN(tp, PJ_EINVAL);
 
     /* You may do some processing to the RTCP packet here if you want. */
-    if (zrtp->srtcpSend == NULL)
+    e = srtp_read_enter(zrtp);
+    srtcpSend = (ZsrtpContextCtrl*)zrtp_load_ptr(&zrtp->srtcpSend);
+    if (srtcpSend == NULL)
     {
+        srtp_read_leave(zrtp, e);
         return pjmedia_transport_send_rtcp(zrtp->slave_tp, pkt, size);
     }
     else
     {
         if (size > MAX_RTCP_BUFFER_LEN)
+        {
+            srtp_read_leave(zrtp, e);
             return PJ_ETOOBIG;
-
-        pj_memcpy(zrtp->sendBufferCtrl, pkt, size);
-        rc = zsrtp_protectCtrl(zrtp->srtcpSend, zrtp->sendBufferCtrl, size, &newLen);
+        }
+        pj_memcpy(buffer, pkt, size);
+        rc = zsrtp_protectCtrl(srtcpSend, buffer, size, &newLen);
+        srtp_read_leave(zrtp, e);
 
         if (rc == 1)
-            return pjmedia_transport_send_rtcp(zrtp->slave_tp, zrtp->sendBufferCtrl, newLen);
+            return pjmedia_transport_send_rtcp(zrtp->slave_tp, buffer, newLen);
         else
             return PJ_EIGNORED;
     }
@@ -1247,6 +3391,45 @@ static pj_status_t transport_send_rtcp(pjmedia_transport *tp,
 //    return pjmedia_transport_send_rtcp(zrtp->slave_tp, pkt, size);
 }
 
+PJ_DEF(pj_status_t) pjmedia_transport_zrtp_send_rtcp_inplace(pjmedia_transport *tp,
+        void *pkt,
+        pj_size_t size,
+        pj_size_t capacity)
+{
+    struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
+    ZsrtpContextCtrl* srtcpSend;
+    int32_t newLen = 0;
+    int32_t rc;
+    int e;
+
+    PJ_ASSERT_RETURN(tp && pkt && capacity >= size, PJ_EINVAL);
+
+    /* The workers protect a copy of the packet */
+    if (zrtp_load_ptr(&zrtp->sendWorker) != NULL)
+        return transport_send_rtcp(tp, pkt, size);
+
+    e = srtp_read_enter(zrtp);
+    srtcpSend = (ZsrtpContextCtrl*)zrtp_load_ptr(&zrtp->srtcpSend);
+    if (srtcpSend == NULL)
+    {
+        srtp_read_leave(zrtp, e);
+        return pjmedia_transport_send_rtcp(zrtp->slave_tp, pkt, size);
+    }
+    /* Not enough room for index and tag: use the send buffer */
+    if (capacity - size < (pj_size_t)zsrtp_getTrailerLengthCtrl(srtcpSend))
+    {
+        srtp_read_leave(zrtp, e);
+        return send_rtcp(tp, pkt, size);
+    }
+    rc = zsrtp_protectCtrl(srtcpSend, (pj_uint8_t*)pkt, (int32_t)size, &newLen);
+    srtp_read_leave(zrtp, e);
+
+    if (rc == 1)
+        return pjmedia_transport_send_rtcp(zrtp->slave_tp, pkt, newLen);
+    else
+        return PJ_EIGNORED;
+}
+
 
 /*
  * This is another variant of send_rtcp(), with the alternate destination
@@ -1287,6 +3470,7 @@ static pj_status_t transport_media_create(pjmedia_transport *tp,
     {
         /* Do your stuff.. */
     }
+    zrtp->srtpAeadAgreed = PJ_FALSE;
 
     /* Once we're done with our initialization, pass the call to the
      * slave transports to let it do it's own initialization too.
@@ -1319,6 +3503,23 @@ static pj_status_t transport_encode_sdp(pjmedia_transport *tp,
         /* Do checking stuffs here.. */
     }
 
+    /* Offer AES-GCM SRTP, answer it only if the offer has it */
+    if (zrtp->srtpAead &&
+        (rem_sdp == NULL ||
+         pjmedia_sdp_media_find_attr2(rem_sdp->media[media_index],
+                                      ZRTP_SDP_AEAD_ATTR, NULL) != NULL))
+    {
+        pjmedia_sdp_attr *aead_attr;
+
+        aead_attr = pjmedia_sdp_attr_create(sdp_pool, ZRTP_SDP_AEAD_ATTR, NULL);
+        if (aead_attr &&
+            pjmedia_sdp_attr_add(&local_sdp->media[media_index]->attr_count,
+                                 local_sdp->media[media_index]->attr,
+                                 aead_attr) == PJ_SUCCESS) {
+            PJ_LOG(4, (THIS_FILE, "attribute added: a=%s", ZRTP_SDP_AEAD_ATTR));
+        }
+    }
+
     /* Add zrtp-hash attributes to both INVITE and 200 OK. */
     numVersions = zrtp_getNumberSupportedVersions(zrtp->zrtpCtx);
     for (i = 0; i < numVersions; i++) {
@@ -1380,7 +3581,15 @@ static pj_status_t transport_media_start(pjmedia_transport *tp,
     struct tp_zrtp *zrtp = (struct tp_zrtp*)tp;
     PJ_ASSERT_RETURN(tp, PJ_EINVAL);
 
-    /* Do something.. */
+    /* Use AES-GCM SRTP only if offer and answer have the attribute */
+    zrtp->srtpAeadAgreed = zrtp->srtpAead && local_sdp && rem_sdp &&
+        pjmedia_sdp_media_find_attr2(local_sdp->media[media_index],
+                                     ZRTP_SDP_AEAD_ATTR, NULL) != NULL &&
+        pjmedia_sdp_media_find_attr2(rem_sdp->media[media_index],
+                                     ZRTP_SDP_AEAD_ATTR, NULL) != NULL;
+    if (zrtp->srtpAead)
+        PJ_LOG(4, (THIS_FILE, "SRTP transform: %s", zrtp->srtpAeadAgreed ?
+                   "AES-GCM, agreed via SDP" : "AES-CM and HMAC, peer did not agree to AES-GCM"));
 
     /* And pass the call to the slave transport */
     return pjmedia_transport_media_start(zrtp->slave_tp, pool, local_sdp,
@@ -1445,29 +3654,38 @@ static pj_status_t transport_destroy(pjmedia_transport *tp)
         // with <= VC 2008, reported by Eeri Kask, TU Dresden (Eeri.Kask@mailbox.tu-dresden.de)
         t = zrtp->slave_tp;
     }
+    /* The workers must not touch the transport after this */
+    async_stop(zrtp);
+#ifndef DYNAMIC_TIMER
+    /* The timeout callback uses the ZRTP context and the pool */
+    if (zrtp->pool != NULL)
+        timer_stop_entry(&zrtp->timeoutTimer);
+#endif
+
     /* Self destruct.. */
     zrtp_DestroyWrapper(zrtp->zrtpCtx);
 
+    /* Receive contexts of the re-key window, the media threads are gone */
+    zsrtp_DestroyWrapper(zrtp->srtpReceivePrev);
+    zsrtp_DestroyWrapperCtrl(zrtp->srtcpReceivePrev);
+    zrtp->srtpReceivePrev = NULL;
+    zrtp->srtcpReceivePrev = NULL;
+
     if (zrtp->zrtpMutex != NULL) {
         /* In case mutex is being acquired by other thread */
         pj_mutex_lock(zrtp->zrtpMutex);
         pj_mutex_unlock(zrtp->zrtpMutex);
         pj_mutex_destroy(zrtp->zrtpMutex);
     }
+    if (zrtp->sendBatchBusy != NULL)
+        pj_atomic_destroy(zrtp->sendBatchBusy);
 #ifdef DYNAMIC_TIMER
-    if (zrtp->timer_pool != NULL) {
-        pj_timer_heap_destroy(zrtp->timer_heap);
-        pj_pool_release(zrtp->timer_pool);
-    }
-#else
-    timer_stop();
+    if (zrtp->pool != NULL)
+        pj_timer_heap_cancel_if_active(timer_heap, &zrtp->timeoutEntry, 0);
 #endif
     if (zrtp->pool != NULL)
         pj_pool_release(zrtp->pool);
 
-#ifdef DYNAMIC_TIMER
-    zrtp->timer_pool = NULL;
-#endif
     zrtp->pool = NULL;
 
     if (t)